@@ -66,8 +66,14 @@ namespace coolwidget {
     }
 
     void triggerHandler() {
-        if (handler)
-            bitvm::action::run(handler);
+        if (handler) {
+            // action::run() expects the caller to hold a reference, and the
+            // handler might replace itself by calling registerHandler()
+            uint32_t h = handler;
+            incr(h);
+            bitvm::action::run(h);
+            decr(h);
+        }
     }
 }
 
@@ -1,5 +1,6 @@
 #include "MicroBitTouchDevelop.h"
 #include "TCS34725.h"
+#include "SerialLog.h"
 
 using namespace touch_develop;
 using namespace micro_bit;
@@ -15,7 +16,7 @@ void app_main() {
       tcs34725::getRawData(&r, &g, &b, &c);
       tcs34725::setInterrupt(true);
 
-      uBit.serial.printf("%d, %d, %d, %d\r\n", r, g, b, c);
+      serial_log::format("%d, %d, %d, %d\r\n", r, g, b, c);
       uBit.sleep(500);
     }
   });
@@ -2,6 +2,9 @@
 #define __BITVM_H
 
 // #define DEBUG_MEMLEAKS 1
+// #define BITVM_PERF_COUNTERS 1
+// #define BITVM_CYCLE_COLLECTOR 1
+// #define BITVM_DEFERRED_DECR 1
 
 #pragma GCC diagnostic ignored "-Wunused-parameter"
 #include "MicroBitCustomConfig.h"
@@ -9,7 +12,8 @@
 #include "MicroBitImage.h"
 #include "ManagedString.h"
 #include "ManagedType.h"
-#define printf(...) uBit.serial.printf(__VA_ARGS__)
+#include "SerialLog.h"
+#define printf(...) ::touch_develop::serial_log::format(__VA_ARGS__)
 // #define printf(...)
 
 // for marking glue functions
@@ -20,10 +24,6 @@
 #include <vector>
 #include <stdint.h>
 
-#ifdef DEBUG_MEMLEAKS
-#include <set>
-#endif
-
 namespace bitvm {
 
   typedef enum {
@@ -31,13 +31,167 @@ namespace bitvm {
     ERR_OUT_OF_BOUNDS = 8,
     ERR_REF_DELETED = 7,
     ERR_SIZE = 9,
+    ERR_LOCAL_ESCAPED = 10,
   } ERROR;
 
+  // Counters of the work done by the runtime, see perf::counter(). The ids
+  // are part of the script API; only append.
+  typedef enum {
+    PERF_INCR = 0,
+    PERF_DECR = 1,
+    PERF_ALLOC_RECORD = 2,
+    PERF_ALLOC_COLLECTION = 3,
+    PERF_ALLOC_BUFFER = 4,
+    PERF_ALLOC_ACTION = 5,
+    PERF_ALLOC_LOCAL = 6,
+    PERF_FREE = 7,
+    PERF_BYTES = 8,     // heapStats.bytes
+    PERF_EVENTS = 9,
+    PERF_FIBERS = 10,
+    PERF_ALLOC_FILTER = 11,
+    PERF_COUNTERS = 12,
+  } PerfCounter;
+
+#ifdef BITVM_PERF_COUNTERS
+  extern uint32_t perfCounters[PERF_COUNTERS];
+  #define PERF_COUNT(c)   (::bitvm::perfCounters[c]++)
+#else
+  #define PERF_COUNT(c)   ((void)0)
+#endif
+
+  // Live RefObjects per type and the bytes they take, kept in all builds: it
+  // costs a few additions per allocation and nothing in the objects
+  // themselves. The order follows PERF_ALLOC_*, except for the filters, which
+  // came after PERF_FREE.
+  typedef enum {
+    HEAP_RECORD = 0,
+    HEAP_COLLECTION = 1,
+    HEAP_BUFFER = 2,
+    HEAP_ACTION = 3,
+    HEAP_LOCAL = 4,
+    HEAP_FILTER = 5,
+    HEAP_TYPES = 6,
+  } HeapType;
+
+  struct HeapStats {
+    uint16_t live[HEAP_TYPES];
+    uint32_t bytes;         // not counting the storage of collections and buffers
+    uint32_t peakBytes;
+  };
+
+  extern HeapStats heapStats;
+
+  inline void heapAlloc(HeapType t, uint32_t size)
+  {
+    PERF_COUNT(t == HEAP_FILTER ? PERF_ALLOC_FILTER : PERF_ALLOC_RECORD + t);
+    heapStats.live[t]++;
+    heapStats.bytes += size;
+    if (heapStats.bytes > heapStats.peakBytes)
+      heapStats.peakBytes = heapStats.bytes;
+  }
+
+  inline void heapFree(HeapType t, uint32_t size)
+  {
+    heapStats.live[t]--;
+    heapStats.bytes -= size;
+  }
+
+#ifdef DEBUG_MEMLEAKS
+  class RefObject;
+
+  // Keeps track of all live RefObjects in a fixed table, so that tracking
+  // allocates nothing and does not change the layout of the objects.
+  class HeapTracker
+  {
+  public:
+    static void track(RefObject *p);
+    static void untrack(RefObject *p);
+    static void setSite(RefObject *p, void *site);
+    static void dump();
+  };
+
+  // Records where in the script the object a shim is about to return was
+  // allocated.
+  #define HEAP_SITE(r)    ::bitvm::HeapTracker::setSite(r, __builtin_return_address(0))
+#else
+  #define HEAP_SITE(r)    ((void)0)
+#endif
+
+#ifdef BITVM_CYCLE_COLLECTOR
+  class RefObject;
+
+  // Reclaims cycles of RefObjects by trial deletion (see bitvm.cpp). Objects
+  // whose ref-count is decremented without reaching zero are remembered as
+  // possible roots of garbage cycles; collect() looks at the objects
+  // reachable from them, up to a fixed number, so that the pause is bounded.
+  class CycleCollector
+  {
+  public:
+    static void possibleRoot(RefObject *p);
+    static void forget(RefObject *p);
+    static int collect();
+    // Set when enough possible roots piled up, or by the timer; the
+    // collection then happens at the next allocation (GC_SAFE_POINT()).
+    static bool pending;
+    // Collect at every allocation while heapStats.bytes is above this.
+    static uint32_t threshold;
+    static uint32_t lastPauseUs;
+    static uint32_t freed;
+    static uint32_t rootsDropped;
+  };
+
+  // Allocations are where collecting is safe: no shim is half-way through
+  // updating a reference.
+  #define GC_SAFE_POINT() \
+    do { \
+      if (::bitvm::CycleCollector::pending || \
+          ::bitvm::heapStats.bytes > ::bitvm::CycleCollector::threshold) \
+        ::bitvm::CycleCollector::collect(); \
+    } while (0)
+#else
+  #define GC_SAFE_POINT() ((void)0)
+#endif
+
+#ifdef BITVM_DEFERRED_DECR
+  class RefObject;
+
+  // Decrements that do not free anything are queued here instead of being
+  // applied, and a ref() of an object with a queued decrement cancels it;
+  // loading a pointer, passing it to a shim and dropping it again, over and
+  // over in a loop, then leaves the object alone. The queue is applied at
+  // safe points: pause, the end of event handlers and fibers, and before
+  // anything that needs exact ref-counts.
+  #define DEFERRED_DECR_SLOTS 8
+
+  class DeferredDecr
+  {
+  public:
+    static RefObject *slots[DEFERRED_DECR_SLOTS];
+    static int count;
+
+    static void flush();
+
+    static inline bool cancel(RefObject *p)
+    {
+      for (int i = count - 1; i >= 0; --i)
+        if (slots[i] == p) {
+          slots[i] = slots[--count];
+          return true;
+        }
+      return false;
+    }
+  };
+
+  #define DEFERRED_DECR_FLUSH() ::bitvm::DeferredDecr::flush()
+#else
+  #define DEFERRED_DECR_FLUSH() ((void)0)
+#endif
+
   extern uint32_t *globals;
   extern int numGlobals;
 
 
-  inline void die() { uBit.panic(42); }
+  inline void die() { ::touch_develop::serial_log::flush(); uBit.panic(42); }
 
   void error(ERROR code, int subcode = 0);
 
@@ -49,14 +203,11 @@ namespace bitvm {
   void exec_binary(uint16_t *pc);
 
   extern const uint32_t functionsAndBytecode[];
+  extern const int numShims;
   extern uint16_t *bytecode;
 
 
-#ifdef DEBUG_MEMLEAKS
-  class RefObject;
-  extern std::set<RefObject*> allptrs;
   void debugMemLeaks();
-#endif
 
   // A base abstract class for ref-counted objects.
   class RefObject
@@ -68,7 +219,7 @@ namespace bitvm {
     {
       refcnt = 1;
 #ifdef DEBUG_MEMLEAKS
-      allptrs.insert(this);
+      HeapTracker::track(this);
 #endif
     }
 
@@ -77,7 +228,7 @@ namespace bitvm {
     void canLeak()
     {
 #ifdef DEBUG_MEMLEAKS
-      allptrs.erase(this);
+      HeapTracker::untrack(this);
 #endif
     }
 
@@ -86,16 +237,47 @@ namespace bitvm {
     {
       check(refcnt > 0, ERR_REF_DELETED);
       //printf("INCR "); this->print();
+#ifdef BITVM_DEFERRED_DECR
+      if (DeferredDecr::cancel(this))
+        return;
+#endif
       refcnt++;
     }
 
     inline void unref()
     {
+#ifdef BITVM_DEFERRED_DECR
+      if (refcnt > 1 && DeferredDecr::count < DEFERRED_DECR_SLOTS) {
+        DeferredDecr::slots[DeferredDecr::count++] = this;
+        return;
+      }
+#endif
+      unrefNow();
+    }
+
+    // Decrement right away, even in the deferred mode.
+    inline void unrefNow()
+    {
       //printf("DECR "); this->print();
       if (--refcnt == 0) {
+        PERF_COUNT(PERF_FREE);
         delete this;
       }
+#ifdef BITVM_CYCLE_COLLECTOR
+      else {
+        CycleCollector::possibleRoot(this);
+      }
+#endif
+    }
+
+#ifdef BITVM_CYCLE_COLLECTOR
+    // The ref-counted fields of the object, which may point back at it.
+    virtual uint32_t *refs(int *n)
+    {
+      *n = 0;
+      return NULL;
     }
+#endif
 
     virtual void print()
     {
@@ -106,8 +288,9 @@ namespace bitvm {
     {
       // This is just a base class for ref-counted objects.
       // There is nothing to free yet, but derived classes will have things to free.
-#ifdef DEBUG_MEMLEAKS
-      allptrs.erase(this);
+      canLeak();
+#ifdef BITVM_CYCLE_COLLECTOR
+      CycleCollector::forget(this);
 #endif
     }
 
@@ -136,6 +319,7 @@ namespace bitvm {
   void incr(uint32_t e)
   {
     if (e) {
+      PERF_COUNT(PERF_INCR);
       if (hasVTable(e))
         ((RefObject*)e)->ref();
       else
@@ -147,6 +331,7 @@ namespace bitvm {
   void decr(uint32_t e)
   {
     if (e) {
+      PERF_COUNT(PERF_DECR);
       if (hasVTable(e))
         ((RefObject*)e)->unref();
       else
@@ -182,16 +367,23 @@ namespace bitvm {
   public:
     // 1 - collection of refs (need decr)
     // 2 - collection of strings (in fact we always have 3, never 2 alone)
+    // bits 4-6 - element type of a RefTypedCollection
     uint16_t flags;
     std::vector<uint32_t> data;
+    // The elements are data[head..]; the slots before are kept zero. Removing
+    // from the front only moves head, so that queues are O(1) per element.
+    uint32_t head;
 
     RefCollection(uint16_t f)
     {
       flags = f;
+      head = 0;
+      heapAlloc(HEAP_COLLECTION, sizeof(RefCollection));
     }
 
     virtual ~RefCollection()
     {
+      heapFree(HEAP_COLLECTION, sizeof(RefCollection));
       // printf("KILL "); this->print();
       if (flags & 1)
         for (uint32_t i = 0; i < data.size(); ++i) {
@@ -201,9 +393,198 @@ namespace bitvm {
       data.resize(0);
     }
 
+    inline uint32_t size()
+    {
+      return data.size() - head;
+    }
+
+    inline uint32_t& item(int i)
+    {
+      return data[head + i];
+    }
+
+    // Removes an element without decr()ing it; the caller takes over the
+    // reference.
+    void erase(int i)
+    {
+      uint32_t n = size();
+      if (i < (int)n / 2) {
+        memmove(&data[head + 1], &data[head], i * sizeof(uint32_t));
+        data[head++] = 0;
+        // don't let the dead slots outgrow the live ones
+        if (head >= n - 1) {
+          data.erase(data.begin(), data.begin() + head);
+          head = 0;
+        }
+      } else {
+        data.erase(data.begin() + head + i);
+      }
+    }
+
+    // Inserts an element without incr()ing it. Making room at the front
+    // reserves as many slots as there are elements, so that pushing at
+    // either end is amortized O(1).
+    void insert(int i, uint32_t x)
+    {
+      if (i == 0 && head == 0) {
+        uint32_t gap = max(4, (int)size());
+        data.insert(data.begin(), gap, 0);
+        head = gap;
+      }
+      if (i == 0) {
+        data[--head] = x;
+      } else {
+        data.insert(data.begin() + head + i, x);
+      }
+    }
+
+#ifdef BITVM_CYCLE_COLLECTOR
+    virtual uint32_t *refs(int *n)
+    {
+      // the slots before head are zero
+      *n = (flags & 1) ? data.size() : 0;
+      return data.size() ? &data[0] : NULL;
+    }
+#endif
+
+    virtual void print()
+    {
+      printf("RefCollection %p r=%d flags=%d size=%d [%p, ...]\n", this, refcnt, flags, size(), size() > 0 ? item(0) : 0);
+    }
+  };
+
+  // Layout of a number stored in a RefBuffer (see buffer::get_number()).
+  // Multi-byte formats are little endian, like the CPU, unless
+  // BITVM_NUMBER_FORMAT_BIG_ENDIAN is or-ed in (as for most I2C sensors).
+  typedef enum {
+    NUMBER_FORMAT_INT8 = 1,
+    NUMBER_FORMAT_UINT8 = 2,
+    NUMBER_FORMAT_INT16 = 3,
+    NUMBER_FORMAT_UINT16 = 4,
+    NUMBER_FORMAT_INT32 = 5,
+  } NumberFormat;
+
+  #define BITVM_NUMBER_FORMAT_BIG_ENDIAN 8
+
+  // Bits 4-6 of the collection::mk() flags select the element type of a
+  // collection of numbers: a NumberFormat, or BITVM_COLLECTION_BITS for
+  // booleans stored in a bit each. 0 (and NUMBER_FORMAT_INT32) is a plain
+  // RefCollection.
+  #define BITVM_COLLECTION_TYPE_SHIFT 4
+  #define BITVM_COLLECTION_BITS 6
+  #define COLLECTION_TYPE_MASK (7 << BITVM_COLLECTION_TYPE_SHIFT)
+
+  // A collection of numbers stored in 1, 8 or 16 bits each instead of a
+  // word; [data] stays empty. Storing a number that does not fit keeps its
+  // low bits, like buffer::set_number().
+  class RefTypedCollection
+    : public RefCollection
+  {
+  public:
+    std::vector<uint8_t> bytes;
+    uint32_t length;
+
+    RefTypedCollection(uint16_t f) : RefCollection(f), length(0)
+    {
+      heapStats.bytes += sizeof(RefTypedCollection) - sizeof(RefCollection);
+    }
+
+    virtual ~RefTypedCollection()
+    {
+      heapStats.bytes -= sizeof(RefTypedCollection) - sizeof(RefCollection);
+    }
+
+    inline int type()
+    {
+      return (flags & COLLECTION_TYPE_MASK) >> BITVM_COLLECTION_TYPE_SHIFT;
+    }
+
+    inline int get(int i)
+    {
+      switch (type()) {
+        case NUMBER_FORMAT_INT8:
+          return (int8_t)bytes[i];
+        case NUMBER_FORMAT_UINT8:
+          return bytes[i];
+        case NUMBER_FORMAT_INT16:
+          return (int16_t)(bytes[2 * i] | (bytes[2 * i + 1] << 8));
+        case NUMBER_FORMAT_UINT16:
+          return bytes[2 * i] | (bytes[2 * i + 1] << 8);
+        default:
+          return (bytes[i >> 3] >> (i & 7)) & 1;
+      }
+    }
+
+    inline void set(int i, int v)
+    {
+      switch (type()) {
+        case NUMBER_FORMAT_INT8:
+        case NUMBER_FORMAT_UINT8:
+          bytes[i] = v;
+          break;
+        case NUMBER_FORMAT_INT16:
+        case NUMBER_FORMAT_UINT16:
+          bytes[2 * i] = v;
+          bytes[2 * i + 1] = v >> 8;
+          break;
+        default:
+          if (v)
+            bytes[i >> 3] |= 1 << (i & 7);
+          else
+            bytes[i >> 3] &= ~(1 << (i & 7));
+          break;
+      }
+    }
+
+    // Storage needed for [n] elements.
+    inline uint32_t sizeFor(uint32_t n)
+    {
+      switch (type()) {
+        case NUMBER_FORMAT_INT8:
+        case NUMBER_FORMAT_UINT8:
+          return n;
+        case NUMBER_FORMAT_INT16:
+        case NUMBER_FORMAT_UINT16:
+          return 2 * n;
+        default:
+          return (n + 7) >> 3;
+      }
+    }
+
+    void push(int v)
+    {
+      bytes.resize(sizeFor(++length));
+      set(length - 1, v);
+    }
+
+    void insert(int i, int v)
+    {
+      push(0);
+      if (type() == BITVM_COLLECTION_BITS) {
+        for (uint32_t k = length - 1; k > (uint32_t)i; --k)
+          set(k, get(k - 1));
+      } else {
+        int w = sizeFor(1);
+        memmove(&bytes[(i + 1) * w], &bytes[i * w], (length - 1 - i) * w);
+      }
+      set(i, v);
+    }
+
+    void erase(int i)
+    {
+      if (type() == BITVM_COLLECTION_BITS) {
+        for (uint32_t k = i; k + 1 < length; ++k)
+          set(k, get(k + 1));
+      } else {
+        int w = sizeFor(1);
+        bytes.erase(bytes.begin() + i * w, bytes.begin() + (i + 1) * w);
+      }
+      bytes.resize(sizeFor(--length));
+    }
+
     virtual void print()
     {
-      printf("RefCollection %p r=%d flags=%d size=%d [%p, ...]\n", this, refcnt, flags, data.size(), data.size() > 0 ? data[0] : 0);
+      printf("RefTypedCollection %p r=%d type=%d size=%d\n", this, refcnt, type(), length);
     }
   };
 
@@ -212,19 +593,82 @@ namespace bitvm {
     : public RefObject
   {
   public:
+    // Set on a RefBufferView, whose bytes live in another buffer; [data] is
+    // then empty. Use ptr() and size() rather than [data].
+    bool isView;
     std::vector<uint8_t> data;
 
+    RefBuffer()
+    {
+      isView = false;
+      heapAlloc(HEAP_BUFFER, sizeof(RefBuffer));
+    }
+
     virtual ~RefBuffer()
     {
+      heapFree(HEAP_BUFFER, sizeof(RefBuffer));
       data.resize(0);
     }
 
+    inline uint8_t *ptr();
+    inline int size();
+
     virtual void print()
     {
       printf("RefBuffer %p r=%d size=%d [%p, ...]\n", this, refcnt, data.size(), data.size() > 0 ? data[0] : 0);
     }
   };
 
+  // A range of another buffer, which it keeps alive; see buffer::slice().
+  // Views share the bytes of the parent, so writes show through both ways.
+  class RefBufferView
+    : public RefBuffer
+  {
+  public:
+    RefBuffer *parent; // never a view itself
+    uint32_t offset;
+    uint32_t length;
+
+    RefBufferView(RefBuffer *p, uint32_t off, uint32_t len)
+      : parent(p), offset(off), length(len)
+    {
+      isView = true;
+      parent->ref();
+      heapStats.bytes += sizeof(RefBufferView) - sizeof(RefBuffer);
+    }
+
+    virtual ~RefBufferView()
+    {
+      heapStats.bytes -= sizeof(RefBufferView) - sizeof(RefBuffer);
+      parent->unref();
+    }
+
+    virtual void print()
+    {
+      printf("RefBufferView %p r=%d parent=%p off=%d size=%d\n", this, refcnt, parent, offset, length);
+    }
+  };
+
+  inline uint8_t *RefBuffer::ptr()
+  {
+    if (isView) {
+      RefBufferView *v = (RefBufferView*)this;
+      return &v->parent->data[0] + v->offset;
+    }
+    return &data[0];
+  }
+
+  // The parent only ever grows, but clamp anyway.
+  inline int RefBuffer::size()
+  {
+    if (isView) {
+      RefBufferView *v = (RefBufferView*)this;
+      int avail = (int)v->parent->data.size() - (int)v->offset;
+      return max(0, min((int)v->length, avail));
+    }
+    return data.size();
+  }
+
   // A ref-counted, user-defined Touch Develop object.
   class RefRecord
     : public RefObject
@@ -241,12 +685,21 @@ namespace bitvm {
     virtual ~RefRecord()
     {
       //printf("DELREC: %p\n", this);
+      heapFree(HEAP_RECORD, sizeof(RefRecord) + len * sizeof(uint32_t));
       for (int i = 0; i < this->reflen; ++i) {
         decr(fields[i]);
         fields[i] = 0;
       }
     }
 
+#ifdef BITVM_CYCLE_COLLECTOR
+    virtual uint32_t *refs(int *n)
+    {
+      *n = reflen;
+      return fields;
+    }
+#endif
+
     virtual void print()
     {
       printf("RefRecord %p r=%d size=%d (%d refs)\n", this, refcnt, len, reflen);
@@ -299,12 +752,21 @@ namespace bitvm {
     // fields[] contain captured locals
     virtual ~RefAction()
     {
+      heapFree(HEAP_ACTION, sizeof(RefAction) + len * sizeof(uint32_t));
       for (int i = 0; i < this->reflen; ++i) {
         decr(fields[i]);
         fields[i] = 0;
       }
     }
 
+#ifdef BITVM_CYCLE_COLLECTOR
+    virtual uint32_t *refs(int *n)
+    {
+      *n = reflen;
+      return fields;
+    }
+#endif
+
     virtual void print()
     {
       printf("RefAction %p r=%d pc=0x%lx size=%d (%d refs)\n", this, refcnt, (const uint8_t*)func - (const uint8_t*)bytecode, len, reflen);
@@ -318,15 +780,57 @@ namespace bitvm {
       fields[idx] = v;
     }
 
+    // Invoke without touching the ref-count; the caller has to hold a
+    // reference for the duration of the call.
+    inline uint32_t call(int arg)
+    {
+      return this->func(this, &this->fields[0], arg);
+    }
+
     inline uint32_t run(int arg)
     {
       this->ref();
-      uint32_t r = this->func(this, &this->fields[0], arg);
+      uint32_t r = this->call(arg);
       this->unref();
       return r;
     }
   };
 
+  // An action with the header checked and the entry point computed, so that
+  // running it is a direct call. Used by event handlers and fibers, which run
+  // the same action over and over.
+  class ResolvedAction
+  {
+  public:
+    ActionCB func;
+    RefAction *clo; // NULL for actions that do not capture anything
+
+    ResolvedAction() : func(NULL), clo(NULL) {}
+    ResolvedAction(uint32_t a);
+
+    // Does not ref() the closure; see RefAction::call().
+    inline uint32_t run(int arg)
+    {
+      return func(clo, clo ? &clo->fields[0] : NULL, arg);
+    }
+  };
+
+  // Size of the boxes below, in words. The code emitter reserves this much
+  // space in the frame for boxes that do not escape it (see mklocFrame()).
+  // Host builds of the tests, with 64-bit vtable pointers, need more.
+  #ifndef BITVM_LOCAL_BOX_WORDS
+  #define BITVM_LOCAL_BOX_WORDS 3
+  #endif
+
+  // Boxes are all the same size, so freed ones are kept on a free-list and
+  // reused, instead of going back to the heap.
+  class LocalPool
+  {
+  public:
+    static void *alloc(size_t sz);
+    static void free(void *p);
+  };
+
   // These two are used to represent locals written from inside inline functions
   class RefLocal
     : public RefObject
@@ -340,6 +844,10 @@ namespace bitvm {
     }
 
     RefLocal() : v(0) {}
+
+    static void *operator new(size_t sz) { return LocalPool::alloc(sz); }
+    static void *operator new(size_t sz, void *p) { return p; }
+    static void operator delete(void *p) { LocalPool::free(p); }
   };
 
   class RefRefLocal
@@ -348,6 +856,14 @@ namespace bitvm {
   public:
     uint32_t v;
 
+#ifdef BITVM_CYCLE_COLLECTOR
+    virtual uint32_t *refs(int *n)
+    {
+      *n = 1;
+      return &v;
+    }
+#endif
+
     virtual void print()
     {
       printf("RefRefLocal %p r=%d v=%p\n", this, refcnt, (void*)v);
@@ -359,6 +875,75 @@ namespace bitvm {
     {
       decr(v);
     }
+
+    static void *operator new(size_t sz) { return LocalPool::alloc(sz); }
+    static void *operator new(size_t sz, void *p) { return p; }
+    static void operator delete(void *p) { LocalPool::free(p); }
+  };
+
+  typedef enum {
+    FILTER_AVERAGE = 1,
+    FILTER_EMA = 2,
+    FILTER_MEDIAN = 3,
+    FILTER_MIN = 4,
+    FILTER_MAX = 5,
+    FILTER_HYSTERESIS = 6,
+  } FilterKind;
+
+  #define BITVM_FILTER_MAX_WINDOW 255
+
+  // A filter over a stream of numbers; see the filter namespace for what each
+  // kind computes. Like a RefRecord, it is allocated with the space for its
+  // window at the end, so that push() allocates nothing.
+  class RefFilter
+    : public RefObject
+  {
+  public:
+    uint8_t kind;
+    // Window size; for FILTER_EMA, the new sample weighs 1/2^n.
+    uint8_t n;
+    // Samples in the window (or in the min/max deque), up to n.
+    uint8_t count;
+    // Oldest sample in the window (or first deque entry).
+    uint8_t head;
+    // FILTER_EMA: the average in 256ths; FILTER_HYSTERESIS: 0 or 1.
+    int32_t state;
+    int32_t lo, hi;
+    // FILTER_AVERAGE: sum of the window, which wraps around like the
+    // samples it is made of, and is exact as long as it fits 32 bits;
+    // FILTER_MIN/MAX: samples so far.
+    uint32_t sum;
+    // The window, in arrival order; for FILTER_MEDIAN followed by the same
+    // samples sorted, and for FILTER_MIN/MAX by their sequence numbers.
+    int32_t window[];
+
+    static int words(int kind, int n)
+    {
+      switch (kind) {
+        case FILTER_AVERAGE:
+          return n;
+        case FILTER_MEDIAN:
+        case FILTER_MIN:
+        case FILTER_MAX:
+          return 2 * n;
+        default:
+          return 0;
+      }
+    }
+
+    virtual ~RefFilter()
+    {
+      heapFree(HEAP_FILTER, sizeof(RefFilter) + words(kind, n) * sizeof(int32_t));
+    }
+
+    virtual void print()
+    {
+      printf("RefFilter %p r=%d kind=%d n=%d count=%d\n", this, refcnt, kind, n, count);
+    }
+
+    void reset();
+    void push(int x);
+    int value();
   };
 }
 
@@ -0,0 +1,48 @@
+#include <stdint.h>
+
+/* Integer replacements for the libm functions scripts need, so that nothing
+ * goes through soft-float doubles.
+ *
+ * Angles are binary: 65536 to the turn, so that 16384 is a right angle and
+ * angles wrap around for free in 16 bits. Fixed-point results carry their
+ * scale in the comment of each function.
+ *
+ * Error bounds, checked against libm over the whole input range:
+ *
+ *    isin, icos    +-1.5 (of 32768)     table of 129 entries + interpolation
+ *    iatan2        +-1 (of 65536)       16 CORDIC iterations
+ *    isqrt, ihypot exact (floor)
+ *    ilog2         -1..0 (of 65536)     bit by bit; truncates (to -1.0001)
+ *    iexp2         +-8e-6 relative      product of 2^(2^-k) for the bits set
+ * */
+
+#ifndef __MICROBIT_FIXEDMATH_H
+#define __MICROBIT_FIXEDMATH_H
+
+namespace touch_develop {
+namespace fixed_math {
+
+  #define FIXED_ANGLE_TURN    65536
+  #define FIXED_SIN_ONE       32768
+
+  // sin and cos of a binary angle, times FIXED_SIN_ONE.
+  int       isin(int angle);
+  int       icos(int angle);
+
+  // The binary angle of (x, y), above -32768 and up to 32768; 0 for (0, 0).
+  int       iatan2(int y, int x);
+
+  uint32_t  isqrt(uint32_t x);
+  // sqrt(x*x + y*y) without overflow.
+  uint32_t  ihypot(int x, int y);
+
+  // log2(x) times 65536; INT_MIN for 0.
+  int       ilog2(uint32_t x);
+  // 2^(x / 65536) times 65536, for x below 15 * 65536 (INT_MAX above).
+  int       iexp2(int x);
+}
+}
+
+#endif
+
+// vim: set ts=2 sw=2 sts=2:
@@ -158,7 +158,13 @@ namespace touch_develop {
   namespace math {
     int max(int x, int y);
     int min(int x, int y);
+    // A number between 0 and [max] (excluded), or between [max] (excluded)
+    // and 0 if negative, with every value equally likely.
     int random(int max);
+    // The same seed gives the same numbers from random() and random_bits();
+    // 0 goes back to a seed from the hardware.
+    void seed_random(int seed);
+    uint32_t random_bits();
     // Unspecified behavior for int_min
     int abs(int x);
     int mod (int x, int y);
@@ -170,6 +176,16 @@ namespace touch_develop {
     int sqrt(int x);
 
     int sign(int x);
+
+    // Fixed point, on top of FixedMath.h: angles are in degrees, and
+    // fractions are in 1024ths.
+    int sin(int degrees);
+    int cos(int degrees);
+    int atan2(int y, int x);
+    int hypot(int x, int y);
+    // log2(x) times 1024, and 2^(x / 1024).
+    int log2(int x);
+    int exp2(int x);
   }
 
   namespace number {
@@ -315,7 +331,12 @@ namespace touch_develop {
     // Sensors
     // -------------------------------------------------------------------------
 
+    // Tilt-compensated, in degrees clockwise from magnetic north. Starts
+    // the compass calibration in the background if needed, like
+    // getMagneticForce().
     int compassHeading();
+    void startCompassCalibration();
+    bool isCompassCalibrated();
     
     int lightLevel();
 
@@ -326,7 +347,7 @@ namespace touch_develop {
     //  x = 0, y = 1, z = 2, strength = 3
     int getAcceleration(int dimension);
 
-    //  pitch = 0, roll = 1
+    //  pitch = 0, roll = 1; in degrees
     int getRotation(int dimension);
 
     // -------------------------------------------------------------------------
@@ -406,6 +427,14 @@ namespace touch_develop {
 
     bool point(int x, int y);
 
+    // Off-screen drawing for the functions above; see displayPresent().
+    void displaySetDoubleBuffered(bool on);
+
+    #define DISPLAY_LAST_ROW_PIN        15    // rows are on P0.13 to P0.15
+    #define DISPLAY_PRESENT_TIMEOUT_MS  50    // the display is off, or frozen
+
+    void displayPresent();
+
     // -------------------------------------------------------------------------
     // Images (helpers that create/modify a MicroBitImage)
     // -------------------------------------------------------------------------
@@ -467,11 +496,31 @@ namespace touch_develop {
     void onSignalStrengthChanged(function<void()> f);
     void onGamepadButton(int id, function<void()> f);
     
+    // Received datagrams are queued along with their metadata. Popping (or
+    // peeking) one makes it the current datagram, which the datagramGet*
+    // functions read, so that all values come from the same packet. Until
+    // then, or after popping from an empty queue, it is empty, with an RSSI
+    // of -1.
+    struct Datagram {
+      uint8_t data[MICROBIT_RADIO_MAX_PACKET_SIZE];
+      uint32_t time;
+      int16_t rssi;
+      uint8_t length;
+    };
+    extern Datagram datagramCurrent;
+
     void datagramSendNumber(int value);
     void datagramSendNumbers(int value0, int value1, int value2, int value3);
     int datagramReceiveNumber();
     int datagramGetNumber(int index);
     int datagramGetRSSI();
+    int datagramGetTime();
+    int datagramGetLength();
+    int datagramCount();
+    int datagramPeek();
+    int datagramPop();
+    int datagramDropped();
+    void datagramSetQueueDepth(int depth);
     void onDatagramReceived(function<void()> f);
 
     namespace devices {
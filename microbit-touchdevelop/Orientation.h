@@ -0,0 +1,75 @@
+#include "MicroBitTouchDevelop.h"
+
+/* Pitch, roll and tilt-compensated heading in integer arithmetic.
+ *
+ * All three come from one Sample, i.e. one reading of the accelerometer and
+ * one of the magnetometer taken back to back, so that the heading is
+ * compensated with the tilt the board had when the field was measured. The
+ * sample is turned into the north-east-down frame (x towards the logo, y
+ * towards button B, z out of the back of the board); pitch is positive with
+ * the logo up, roll with button B down, and the heading goes clockwise from
+ * magnetic north.
+ *
+ * The compass calibration only removes the hard-iron offset: the centre of
+ * the box spanned by the raw readings. A Calibrator is fed from a background
+ * fiber (and from every sample taken meanwhile) until each axis has seen a
+ * spread of ORIENTATION_CAL_SPREAD; nothing blocks waiting for the user to
+ * wave the board around, unlike MicroBitCompass::calibrate(). The fiber
+ * stops when nobody has wanted the heading for ORIENTATION_CAL_IDLE_MS, so
+ * a board that is never rotated does not sample forever; the next reading
+ * of the heading starts it again, with what it had gathered.
+ *
+ * The functions taking a Sample do not talk to the hardware, so they can be
+ * checked against a floating point reference on recorded traces.
+ * */
+
+#ifndef __MICROBIT_ORIENTATION_H
+#define __MICROBIT_ORIENTATION_H
+
+namespace touch_develop {
+namespace orientation {
+
+  #define ORIENTATION_CAL_SPREAD  20000   // nT, per axis
+  #define ORIENTATION_CAL_MS      50      // sampling period of the fiber
+  #define ORIENTATION_CAL_IDLE_MS 10000   // the fiber stops after that long unused
+
+  // Accelerometer (mg) and magnetometer (nT) readings, north-east-down.
+  struct Sample {
+    int ax, ay, az;
+    int mx, my, mz;
+  };
+
+  // Binary angles (see FixedMath.h).
+  int       pitch(const Sample& s);
+  int       roll(const Sample& s);
+  int       heading(const Sample& s);
+
+  // Rounded to the nearest degree, between -180 and 180.
+  int       degrees(int angle);
+
+  class Calibrator {
+    public:
+      Calibrator();
+      void      reset();
+      void      add(int x, int y, int z);
+      bool      done();
+      int       lo[3];
+      int       hi[3];
+      int       n;
+  };
+
+  // Reads both sensors, minus the compass offset found so far (none before
+  // the calibration is done); the accelerometer only, without [compass].
+  Sample    sample(bool compass = true);
+
+  // Starts the background calibration, unless done or already running, and
+  // keeps it running for ORIENTATION_CAL_IDLE_MS more; so does polling
+  // calibrated() while it runs.
+  void      startCalibration();
+  bool      calibrated();
+}
+}
+
+#endif
+
+// vim: set ts=2 sw=2 sts=2:
@@ -0,0 +1,69 @@
+#include "MicroBit.h"
+
+/* Sampling profiler for compiled scripts.
+ *
+ * A timer interrupt samples the interrupted PC. Samples inside the compiled
+ * script are counted in buckets of 2^shift bytes of bytecode; the others are
+ * attributed to the shim with the closest entry point below the PC (DAL code
+ * called from a shim thus counts towards some neighbouring shim, which is
+ * good enough to tell where the time goes).
+ *
+ * The dump lists non-zero counters, one per line:
+ *
+ *    PROFILE samples shift
+ *    S shim-index count        -- index into functionsAndBytecode[]
+ *    B bytecode-offset count
+ *    END
+ *
+ * and scripts/profile.js turns shim indices into names using
+ * generated/metainfo.json.
+ * */
+
+#ifndef __MICROBIT_PROFILER_H
+#define __MICROBIT_PROFILER_H
+
+namespace bitvm {
+namespace profiler {
+
+  #define PROFILER_BUCKETS    128
+
+  // The Cortex-M0 of the nRF51822 comes without SysTick, and TIMER0
+  // belongs to the SoftDevice, TIMER2 to the PWM outputs and RTC1 to the
+  // system ticker: TIMER1 is the one left. It is 16-bit, so the prescaler is
+  // picked to fit the period.
+  #ifndef PROFILER_TIMER
+  #define PROFILER_TIMER          NRF_TIMER1
+  #define PROFILER_TIMER_IRQn     TIMER1_IRQn
+  #define PROFILER_TIMER_HANDLER  TIMER1_IRQHandler
+  #endif
+  #define PROFILER_TIMER_MAX      0xffff
+  #define PROFILER_IRQ_PRIORITY   1     // 0 and 2 are the SoftDevice's
+
+  typedef int (*PrintFn)(const char *fmt, ...);
+
+  // Does not touch the hardware, so that it can be fed synthetic PCs.
+  class Histogram {
+    public:
+      Histogram(const uint32_t *functions, int numFunctions, uint32_t code, int shift);
+      ~Histogram();
+      void      record(uint32_t pc);
+      void      dump(PrintFn print);
+      uint32_t  samples;
+      uint16_t *shimCounts;
+      uint16_t  codeCounts[PROFILER_BUCKETS]; // the last one also counts overflows
+    private:
+      const uint32_t *functions;
+      int       numFunctions;
+      uint32_t  code;
+      int       shift;
+  };
+
+  // Sample at [hz] into a fresh histogram, replacing the previous one.
+  bool      startSampling(Histogram *h, int hz);
+  void      stopSampling();
+}
+}
+
+#endif
+
+// vim: set ts=2 sw=2 sts=2:
@@ -0,0 +1,128 @@
+#include "MicroBitTouchDevelop.h"
+
+/* Reliable transfer of buffers larger than a single datagram over the radio.
+ *
+ * The buffer is cut into fragments, each sent in its own datagram with a
+ * small header. The receiver answers with acknowledgements carrying the
+ * first missing fragment and a bitmap of the fragments received after it
+ * (selective ACKs); the sender keeps a window of unacknowledged fragments in
+ * flight and resends those that are not acknowledged in time.
+ *
+ * The receiver allocates the whole buffer from the header of the first
+ * fragment it sees, and only if that leaves BULK_HEAP_RESERVE bytes free. A
+ * transfer is keyed on its id and fragment count: after it completes, the
+ * same pair is only acknowledged again (for a sender that lost the final ACK)
+ * for BULK_GIVE_UP_MS; anything else starts a new transfer, once the
+ * previous one has been taken: until then, new transfers are not
+ * acknowledged. The sender picks a fresh random id for every transfer.
+ *
+ * The Sender and Receiver classes do not talk to the hardware: packets go out
+ * through a SendFn and come in through onAck() and onData(), and the time is
+ * passed in, so they can be driven by a simulated radio (test/radio_transfer.cpp).
+ * */
+
+#ifndef __MICROBIT_RADIOTRANSFER_H
+#define __MICROBIT_RADIOTRANSFER_H
+
+#include <vector>
+
+namespace touch_develop {
+namespace radio_transfer {
+
+  #define BULK_MAGIC0         0xB7
+  #define BULK_MAGIC1         0x4B
+  #define BULK_DATA           1
+  #define BULK_ACK            2
+
+  // DATA: magic0 magic1 type xfer seq:16 count:16 payload...
+  // ACK:  magic0 magic1 type xfer base:16 0:16 received:32
+  #define BULK_HEADER_SIZE    8
+  #define BULK_ACK_SIZE       12
+  #define BULK_FRAGMENT_SIZE  (MICROBIT_RADIO_MAX_PACKET_SIZE - BULK_HEADER_SIZE)
+
+  #define BULK_WINDOW         8     // fragments in flight, at most 32
+  #define BULK_ACK_EVERY      4     // in-order fragments per ACK
+  #define BULK_RTO_MS         100   // retransmission timeout
+  #define BULK_GIVE_UP_MS     3000  // no progress for that long fails the transfer
+  #define BULK_POLL_MS        5
+  #define BULK_MAX_SIZE       8192
+  #define BULK_HEAP_RESERVE   1024  // left free when allocating a receive buffer
+
+  typedef void (*SendFn)(const uint8_t *buf, int len);
+
+  struct Stats {
+    uint32_t bytesSent;
+    uint32_t packetsSent;
+    uint32_t retransmissions;
+    uint32_t acksReceived;
+    uint32_t packetsReceived;
+    uint32_t duplicates;
+    uint32_t transfersOk;
+    uint32_t transfersFailed;
+    uint32_t lastBytesPerSecond;
+  };
+
+  extern Stats stats;
+
+  class Sender {
+    public:
+      Sender(SendFn send);
+      void      start(const uint8_t *data, int len, uint8_t xfer, uint32_t now);
+      // Sends whatever is due; returns false once the transfer is over.
+      bool      poll(uint32_t now);
+      void      onAck(const uint8_t *buf, int len, uint32_t now);
+      bool      succeeded() { return base == count; }
+      uint8_t   xfer;
+    private:
+      void      sendFragment(int seq);
+      SendFn    send;
+      const uint8_t *data;
+      int       len;
+      uint16_t  count;
+      uint16_t  base;             // first fragment not acknowledged
+      uint32_t  acked;            // bit i: base + i acknowledged
+      uint32_t  sent;             // bit i: base + i sent at least once
+      uint32_t  sentAt[BULK_WINDOW];
+      uint32_t  progressAt;
+      bool      failed;
+  };
+
+  class Receiver {
+    public:
+      Receiver(SendFn send);
+      void      onData(const uint8_t *buf, int len, uint32_t now);
+      // Hands over the completed buffer, if any, and frees the slot for the
+      // next transfer.
+      bool      take(std::vector<uint8_t>& out);
+    private:
+      void      sendAck(uint8_t x, uint16_t b, uint32_t r);
+      bool      reserve(int size);
+      SendFn    send;
+      std::vector<uint8_t> data;
+      bool      active;           // receiving into data
+      bool      complete;         // data holds a transfer not taken yet
+      uint8_t   xfer;
+      uint16_t  count;
+      uint16_t  base;             // first fragment not received
+      uint32_t  received;         // bit i: base + i received
+      int       lastLen;
+      int       sinceAck;
+      bool      finished;         // the last completed transfer, acknowledged
+      uint8_t   doneXfer;         // again until doneAt + BULK_GIVE_UP_MS
+      uint16_t  doneCount;
+      uint32_t  doneAt;
+  };
+
+  // Called for every incoming datagram; returns true if it was a transfer
+  // packet (and thus should not be queued for the script).
+  bool handlePacket(const uint8_t *buf, int len);
+
+  // Blocking calls for the current fiber, using uBit.radio.
+  bool send(const uint8_t *data, int len);
+  bool receive(std::vector<uint8_t>& out, int timeoutMs);
+}
+}
+
+#endif
+
+// vim: set ts=2 sw=2 sts=2:
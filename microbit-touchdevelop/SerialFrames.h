@@ -0,0 +1,45 @@
+#include "MicroBit.h"
+
+/* Binary framing for streaming buffers over the serial port.
+ *
+ * Plain frames are
+ *
+ *    0xA5 len:16 payload[len] crc:16
+ *
+ * and COBS frames are the COBS encoding of payload[] followed by crc:16,
+ * between two 0x00 bytes; the latter cost about one byte in 254 more,
+ * but a receiver that joins mid-stream resynchronizes at the next zero.
+ * Multi-byte fields are little endian, and the CRC is CRC-16/CCITT-FALSE
+ * over payload[] only.
+ *
+ * scripts/serialFrames.js is the matching decoder for the host side.
+ * */
+
+#ifndef __MICROBIT_SERIALFRAMES_H
+#define __MICROBIT_SERIALFRAMES_H
+
+#include <vector>
+
+namespace touch_develop {
+namespace serial_frames {
+
+  #define SERIAL_FRAME_SYNC       0xA5
+  #define SERIAL_FRAME_MAX_SIZE   1024
+
+  uint16_t  crc16(const uint8_t *data, int len, uint16_t crc = 0xffff);
+
+  // Writes a frame straight from [data], without copying it; blocks until the
+  // UART has taken all of it. Sends nothing and returns false above
+  // SERIAL_FRAME_MAX_SIZE, which no receiver would accept.
+  bool      send(const uint8_t *data, int len, bool cobs);
+
+  // Reads the next frame with a good CRC into [out], skipping anything else;
+  // gives up after [timeoutMs] (-1 waits for ever).
+  bool      receive(std::vector<uint8_t>& out, bool cobs, int timeoutMs);
+
+  // Number of frames dropped because of a bad CRC or length.
+  extern uint32_t errors;
+}
+}
+
+#endif
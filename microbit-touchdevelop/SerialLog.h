@@ -0,0 +1,37 @@
+#include "MicroBit.h"
+
+/* Buffered logging to the serial port.
+ *
+ * Writes are formatted into a RAM ring buffer and return straight away; a
+ * background fiber drains the buffer into the UART as fast as it accepts
+ * characters. When the buffer is full, whole lines are dropped (and counted)
+ * rather than blocking the caller. flush() writes out whatever is pending
+ * synchronously, and is called before panicking.
+ *
+ * There is one consumer (the fiber, or flush()) and any number of fibers
+ * writing; the scheduler is cooperative, so the writers never interleave
+ * within a line.
+ * */
+
+#ifndef __MICROBIT_SERIALLOG_H
+#define __MICROBIT_SERIALLOG_H
+
+namespace touch_develop {
+namespace serial_log {
+
+  #define SERIAL_LOG_SIZE       256   // ring buffer
+  #define SERIAL_LOG_LINE       96    // longest line format() produces
+  #define SERIAL_LOG_ID         3050  // event the draining fiber waits on
+  #define SERIAL_LOG_EVT_DATA   1
+
+  // printf() replacement; returns the number of characters queued.
+  int       format(const char *fmt, ...);
+  int       write(const char *s, int len);
+  void      flush();
+
+  // Number of lines dropped because the buffer was full.
+  extern uint32_t dropped;
+}
+}
+
+#endif
@@ -14,6 +14,7 @@ var prefixes = ["bitvm::bitvm_", "bitvm::", "touch_develop::", ""]
 var fullfuns = {}
 var basenames = {}
 var enums = {}
+var config = {}
 
 process.argv.slice(2).forEach(function (fn) {
     var type = null;
@@ -44,6 +45,13 @@ process.argv.slice(2).forEach(function (fn) {
             return;
         }
 
+        // BITVM_* numeric defines are passed on to the code emitter
+        m = /^\s*#define\s+(BITVM_\w+)\s+(\d+)\s*$/.exec(ln)
+        if (m) {
+            config[m[1]] = parseInt(m[2])
+            return;
+        }
+
         var top = nsStack[nsStack.length - 1]
 
         if (justPushed) {
@@ -132,7 +140,7 @@ funnames.forEach(bn => {
               tp += " bvm"
             if (inf.full == "bitvm::bitvm_" + bn)
               tp += " over"
-            ptrs += `(uint32_t)(void*)::${fn},  // ${tp} {shim:${bn}}\n`;
+            ptrs += `(uint32_t)(uintptr_t)(void*)::${fn},  // ${tp} {shim:${bn}}\n`;
             functions.push(inf)
             protos += inf.proto + "// " + tp + "\n";
             break;
@@ -142,7 +150,8 @@ funnames.forEach(bn => {
 
 var metainfo = {
   functions: functions,
-  enums: enums
+  enums: enums,
+  config: config
 }
 
 function write(fn, cont)
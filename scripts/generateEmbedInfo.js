@@ -21,6 +21,7 @@ function addfld(n, v) {
   s += n + ": " + JSON.stringify(v, null, 2) + ",\n";
 };
 addfld("enums", metainfo.enums)
+addfld("config", metainfo.config)
 addfld("hex", hex)
 s += "}\n"
 fs.writeFileSync("build/bytecode.js", "TDev.bytecodeInfo = " + s)
@@ -0,0 +1,79 @@
+"use strict";
+
+if (process.argv.length < 3) {
+  console.log("Symbolize a dump from profiler::dump using generated/metainfo.json.")
+  console.log("USAGE: node profile.js [--metainfo file] /dev/ttyACM0|file|-")
+  process.exit(1)
+}
+
+var fs = require('fs');
+
+var args = process.argv.slice(2)
+var metainfoFile = "generated/metainfo.json"
+if (args[0] == "--metainfo") {
+    metainfoFile = args[1]
+    args = args.slice(2)
+}
+
+var functions = JSON.parse(fs.readFileSync(metainfoFile, "utf8")).functions
+
+// Shim indices past the end of metainfo.json are extension functions, which
+// come after the core ones in functionsAndBytecode[].
+function shimName(idx) {
+    if (idx < functions.length)
+        return functions[idx].name
+    return "extension #" + (idx - functions.length)
+}
+
+function pad(s, n) {
+    s = s + ""
+    while (s.length < n) s = " " + s
+    return s
+}
+
+function report(samples, shift, rows) {
+    var other = samples - rows.reduce((s, r) => s + r.count, 0)
+    if (other > 0)
+        rows.push({ name: "(below all shims)", count: other })
+    rows.sort((a, b) => b.count - a.count)
+    console.log("samples: " + samples + (shift >= 0 ? ", bytecode buckets of " + (1 << shift) + " bytes" : ""))
+    rows.forEach(r => {
+        var pct = samples ? (r.count * 100 / samples).toFixed(1) : "0.0"
+        console.log(pad(r.count, 7) + pad(pct, 6) + "%  " + r.name)
+    })
+    console.log("")
+}
+
+var input = args[0] == "-" ? process.stdin : fs.createReadStream(args[0])
+var pending = ""
+var rows = null
+var samples = 0
+var shift = -1
+
+function line(ln) {
+    var w = ln.trim().split(/\s+/)
+    if (w[0] == "PROFILE") {
+        rows = []
+        samples = parseInt(w[1])
+        shift = parseInt(w[2])
+    } else if (!rows) {
+        // other serial output
+    } else if (w[0] == "S") {
+        rows.push({ name: shimName(parseInt(w[1])), count: parseInt(w[2]) })
+    } else if (w[0] == "B") {
+        var off = parseInt(w[1])
+        rows.push({ name: "bytecode+0x" + off.toString(16), count: parseInt(w[2]) })
+    } else if (w[0] == "END") {
+        report(samples, shift, rows)
+        rows = null
+    }
+}
+
+input.on("data", d => {
+    var lines = (pending + d.toString("binary")).split(/\r?\n/)
+    pending = lines.pop()
+    lines.forEach(line)
+})
+input.on("end", () => {
+    if (pending) line(pending)
+})
@@ -0,0 +1,121 @@
+"use strict";
+
+if (process.argv.length < 3) {
+  console.log("Decode binary frames sent with micro_bit::serialSendFrame.")
+  console.log("USAGE: node serialFrames.js [--cobs] /dev/ttyACM0|file|-")
+  process.exit(1)
+}
+
+var fs = require('fs');
+
+var args = process.argv.slice(2)
+var cobs = false
+if (args[0] == "--cobs") {
+    cobs = true
+    args.shift()
+}
+
+var input = args[0] == "-" ? process.stdin : fs.createReadStream(args[0])
+
+var frames = 0
+var errors = 0
+
+// CRC-16/CCITT-FALSE, same as serial_frames::crc16()
+function crc16(buf) {
+    var crc = 0xffff
+    for (var i = 0; i < buf.length; ++i) {
+        crc ^= buf[i] << 8
+        for (var k = 0; k < 8; ++k)
+            crc = crc & 0x8000 ? ((crc << 1) ^ 0x1021) & 0xffff : (crc << 1) & 0xffff
+    }
+    return crc
+}
+
+function frame(buf) {
+    if (buf.length < 2) {
+        errors++
+        return
+    }
+    var n = buf.length - 2
+    var payload = buf.slice(0, n)
+    if (crc16(payload) != buf.readUInt16LE(n)) {
+        errors++
+        console.log("bad CRC")
+        return
+    }
+    frames++
+    console.log(n + ": " + payload.toString("hex"))
+}
+
+// Plain frames: 0xA5 len:16 payload crc:16
+var pending = Buffer.alloc(0)
+function plain(chunk) {
+    pending = Buffer.concat([pending, chunk])
+    while (true) {
+        var start = pending.indexOf(0xa5)
+        if (start < 0) {
+            pending = Buffer.alloc(0)
+            return
+        }
+        pending = pending.slice(start)
+        if (pending.length < 3)
+            return
+        var len = pending.readUInt16LE(1)
+        if (len > 1024) {
+            errors++
+            pending = pending.slice(1)
+            continue
+        }
+        if (pending.length < 5 + len)
+            return
+        var buf = pending.slice(3, 5 + len)
+        var n = buf.length - 2
+        if (crc16(buf.slice(0, n)) != buf.readUInt16LE(n)) {
+            // a false sync; try again from the next byte
+            errors++
+            pending = pending.slice(1)
+            continue
+        }
+        frame(buf)
+        pending = pending.slice(5 + len)
+    }
+}
+
+// COBS frames, delimited by zeros
+var block = []
+function unstuff(bytes) {
+    var out = []
+    var i = 0
+    while (i < bytes.length) {
+        var code = bytes[i++]
+        if (code == 0 || i + code - 1 > bytes.length)
+            return null
+        for (var k = 1; k < code; ++k)
+            out.push(bytes[i++])
+        if (code < 0xff && i < bytes.length)
+            out.push(0)
+    }
+    return Buffer.from(out)
+}
+
+function cobsChunk(chunk) {
+    for (var i = 0; i < chunk.length; ++i) {
+        if (chunk[i] != 0) {
+            block.push(chunk[i])
+            continue
+        }
+        if (block.length > 0) {
+            var buf = unstuff(block)
+            if (buf) frame(buf)
+            else errors++
+        }
+        block = []
+    }
+}
+
+input.on("data", cobs ? cobsChunk : plain)
+input.on("end", () => {
+    console.log("frames: " + frames + ", errors: " + errors)
+})
+
+// vim: ts=4 sw=4
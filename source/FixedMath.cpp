@@ -0,0 +1,177 @@
+#include "FixedMath.h"
+
+#include <climits>
+
+namespace touch_develop {
+namespace fixed_math {
+
+  // sin(i/128 * pi/2) * 32768, for i = 0..128.
+  static const uint16_t sinTable[129] = {
+    0, 402, 804, 1206, 1608, 2009, 2411, 2811, 3212, 3612, 4011, 4410, 4808,
+    5205, 5602, 5998, 6393, 6787, 7180, 7571, 7962, 8351, 8740, 9127, 9512,
+    9896, 10279, 10660, 11039, 11417, 11793, 12167, 12540, 12910, 13279,
+    13646, 14010, 14373, 14733, 15091, 15447, 15800, 16151, 16500, 16846,
+    17190, 17531, 17869, 18205, 18538, 18868, 19195, 19520, 19841, 20160,
+    20475, 20788, 21097, 21403, 21706, 22006, 22302, 22595, 22884, 23170,
+    23453, 23732, 24008, 24279, 24548, 24812, 25073, 25330, 25583, 25833,
+    26078, 26320, 26557, 26791, 27020, 27246, 27467, 27684, 27897, 28106,
+    28311, 28511, 28707, 28899, 29086, 29269, 29448, 29622, 29792, 29957,
+    30118, 30274, 30425, 30572, 30715, 30853, 30986, 31114, 31238, 31357,
+    31471, 31581, 31686, 31786, 31881, 31972, 32058, 32138, 32214, 32286,
+    32352, 32413, 32470, 32522, 32568, 32610, 32647, 32679, 32706, 32729,
+    32746, 32758, 32766, 32768,
+  };
+
+  // atan(2^-i) as a binary angle times 256, for i = 0..15.
+  static const int32_t atanTable[16] = {
+    2097152, 1238021, 654136, 332050, 166669, 83416, 41718, 20860, 10430,
+    5215, 2608, 1304, 652, 326, 163, 81,
+  };
+
+  // 2^(2^-k) times 2^30, for k = 1..16.
+  static const uint32_t exp2Table[16] = {
+    1518500250, 1276901417, 1170923762, 1121280436, 1097253708, 1085434106,
+    1079572136, 1076653033, 1075196443, 1074468888, 1074105294, 1073923544,
+    1073832680, 1073787251, 1073764537, 1073753181,
+  };
+
+  int isin(int angle) {
+    uint32_t a = angle & 0xffff;
+    uint32_t r = a & 0x3fff;
+    // the second and fourth quadrants run backwards through the table
+    if (a & 0x4000)
+      r = 0x4000 - r;
+    int i = r >> 7, f = r & 0x7f;
+    int v = sinTable[i];
+    if (f)
+      v += ((sinTable[i + 1] - v) * f + 64) >> 7;
+    return (a & 0x8000) ? -v : v;
+  }
+
+  int icos(int angle) {
+    return isin(angle + FIXED_ANGLE_TURN / 4);
+  }
+
+  int iatan2(int y, int x) {
+    if (x == 0 && y == 0)
+      return 0;
+
+    // Scale so that the larger coordinate has its top bit at bit 28: small
+    // vectors keep their precision, and the length times the CORDIC gain
+    // (1.65) stays below 2^31.
+    uint32_t ax = x < 0 ? -(uint32_t)x : x;
+    uint32_t ay = y < 0 ? -(uint32_t)y : y;
+    int s = __builtin_clz(ax > ay ? ax : ay) - 3;
+    int32_t X, Y;
+    if (s >= 0) {
+      X = (int32_t)((uint32_t)x << s);
+      Y = (int32_t)((uint32_t)y << s);
+    } else {
+      X = x >> -s;
+      Y = y >> -s;
+    }
+
+    // CORDIC only converges within +-99 degrees; start from the right half
+    // plane.
+    int32_t a = 0;
+    if (X < 0) {
+      X = -X;
+      Y = -Y;
+      a = (FIXED_ANGLE_TURN / 2) << 8;
+    }
+
+    for (int i = 0; i < 16; ++i) {
+      int32_t nx;
+      if (Y > 0) {
+        nx = X + (Y >> i);
+        Y -= X >> i;
+        a += atanTable[i];
+      } else {
+        nx = X - (Y >> i);
+        Y += X >> i;
+        a -= atanTable[i];
+      }
+      X = nx;
+    }
+
+    int r = (a + 128) >> 8;
+    if (r > FIXED_ANGLE_TURN / 2)
+      r -= FIXED_ANGLE_TURN;
+    else if (r <= -FIXED_ANGLE_TURN / 2)
+      r += FIXED_ANGLE_TURN;
+    return r;
+  }
+
+  uint32_t isqrt(uint32_t x) {
+    uint32_t r = 0, bit = 1u << 30;
+    while (bit > x)
+      bit >>= 2;
+    while (bit) {
+      if (x >= r + bit) {
+        x -= r + bit;
+        r = (r >> 1) + bit;
+      } else {
+        r >>= 1;
+      }
+      bit >>= 2;
+    }
+    return r;
+  }
+
+  static uint32_t isqrt64(uint64_t x) {
+    uint64_t r = 0, bit = 1ull << 62;
+    while (bit > x)
+      bit >>= 2;
+    while (bit) {
+      if (x >= r + bit) {
+        x -= r + bit;
+        r = (r >> 1) + bit;
+      } else {
+        r >>= 1;
+      }
+      bit >>= 2;
+    }
+    return r;
+  }
+
+  uint32_t ihypot(int x, int y) {
+    return isqrt64((int64_t)x * x + (int64_t)y * y);
+  }
+
+  // Squaring the mantissa doubles its log2, so each squaring yields one
+  // more bit of the fraction.
+  int ilog2(uint32_t x) {
+    if (x == 0)
+      return INT_MIN;
+    int n = 31 - __builtin_clz(x);
+    // mantissa in [1, 2), with 1 as 2^30
+    uint32_t m = n > 30 ? x >> 1 : x << (30 - n);
+    int r = n << 16;
+    for (int b = 1 << 15; b; b >>= 1) {
+      m = ((uint64_t)m * m) >> 30;
+      if (m >= 1u << 31) {
+        m >>= 1;
+        r |= b;
+      }
+    }
+    return r;
+  }
+
+  int iexp2(int x) {
+    int n = x >> 16;
+    if (n >= 15)
+      return INT_MAX;
+    if (n < -17)
+      return 0;
+    // 2^fraction in [1, 2), with 1 as 2^30
+    uint32_t m = 1u << 30;
+    for (int k = 0; k < 16; ++k)
+      if (x & (0x8000 >> k))
+        m = ((uint64_t)m * exp2Table[k] + (1u << 29)) >> 30;
+    int s = 14 - n;
+    return s ? (m + (1u << (s - 1))) >> s : m;
+  }
+}
+}
+
+// vim: set ts=2 sw=2 sts=2:
@@ -1,4 +1,8 @@
 #include "MicroBitTouchDevelop.h"
+#include "FixedMath.h"
+#include "Orientation.h"
+#include "RadioTransfer.h"
+#include "SerialLog.h"
 
 namespace touch_develop {
 
@@ -109,7 +113,7 @@ namespace touch_develop {
     }
 
     void post_to_wall(ManagedString s) {
-      uBit.serial.printf("%s\r\n", s.toCharArray());
+      serial_log::format("%s\r\n", s.toCharArray());
     }
   }
 
@@ -130,15 +134,62 @@ namespace touch_develop {
   namespace math {
     int max(int x, int y) { return x < y ? y : x; }
     int min(int x, int y) { return x < y ? x : y; }
+
+    // A xorshift128 generator (Marsaglia, "Xorshift RNGs", 2003): a few
+    // shifts and xors per 32 bits, where uBit.random() steps an LFSR once per
+    // bit it returns. Unless the script seeds it, the state comes from
+    // uBit.random(), itself seeded from the hardware RNG.
+    static uint32_t rng[4];
+    static bool rngSeeded = false;
+
+    static uint32_t splitmix32(uint32_t *s) {
+      uint32_t z = (*s += 0x9e3779b9);
+      z = (z ^ (z >> 16)) * 0x85ebca6b;
+      z = (z ^ (z >> 13)) * 0xc2b2ae35;
+      return z ^ (z >> 16);
+    }
+
+    void seed_random(int seed) {
+      uint32_t s = seed;
+      for (int i = 0; i < 4; ++i)
+        rng[i] = seed ? splitmix32(&s) : ((uint32_t)uBit.random(0x10000) << 16) | uBit.random(0x10000);
+      // the all-zero state is a fixed point
+      if (!(rng[0] | rng[1] | rng[2] | rng[3]))
+        rng[0] = 1;
+      rngSeeded = true;
+    }
+
+    uint32_t random_bits() {
+      if (!rngSeeded)
+        seed_random(0);
+      uint32_t t = rng[0] ^ (rng[0] << 11);
+      rng[0] = rng[1];
+      rng[1] = rng[2];
+      rng[2] = rng[3];
+      rng[3] = rng[3] ^ (rng[3] >> 19) ^ t ^ (t >> 8);
+      return rng[3];
+    }
+
+    // [0, range) by multiply-shift, dropping the few products that would
+    // make some values more likely (Lemire, "Fast random integer generation
+    // in an interval", 2019); the division only runs one time in 2^32/range.
+    static uint32_t bounded(uint32_t range) {
+      uint64_t m = (uint64_t)random_bits() * range;
+      if ((uint32_t)m < range) {
+        uint32_t threshold = -range % range;
+        while ((uint32_t)m < threshold)
+          m = (uint64_t)random_bits() * range;
+      }
+      return m >> 32;
+    }
+
     int random(int max) {
-      if (max == INT_MIN)
-        return -uBit.random(INT_MAX);
-      else if (max < 0)
-        return -uBit.random(-max);
+      if (max < 0)
+        return -(int)bounded(-(uint32_t)max);
       else if (max == 0)
         return 0;
       else
-        return uBit.random(max);
+        return bounded(max);
     }
     // Unspecified behavior for int_min
     int abs(int x) { return x < 0 ? -x : x; }
@@ -162,12 +213,59 @@ namespace touch_develop {
     }
 
     int sqrt(int x) {
-      return ::sqrt(x);
+      return x > 0 ? fixed_math::isqrt(x) : 0;
     }
 
     int sign(int x) {
       return x > 0 ? 1 : (x == 0 ? 0 : -1);
     }
+
+    static int binaryAngle(int degrees) {
+      degrees %= 360;
+      if (degrees < 0)
+        degrees += 360;
+      return (degrees * FIXED_ANGLE_TURN + 180) / 360;
+    }
+
+    int sin(int degrees) {
+      return (fixed_math::isin(binaryAngle(degrees)) + 16) >> 5;
+    }
+
+    int cos(int degrees) {
+      return (fixed_math::icos(binaryAngle(degrees)) + 16) >> 5;
+    }
+
+    // Between -180 and 180.
+    int atan2(int y, int x) {
+      return (fixed_math::iatan2(y, x) * 360 + FIXED_ANGLE_TURN / 2) >> 16;
+    }
+
+    int hypot(int x, int y) {
+      uint32_t r = fixed_math::ihypot(x, y);
+      return r > INT_MAX ? INT_MAX : r;
+    }
+
+    // INT_MIN for 0 and below.
+    int log2(int x) {
+      if (x <= 0)
+        return INT_MIN;
+      return (fixed_math::ilog2(x) + 32) >> 6;
+    }
+
+    // The integer part goes in as a shift, so that results up to INT_MAX
+    // keep all of iexp2()'s precision.
+    int exp2(int x) {
+      int n = x >> 10;
+      if (n >= 31)
+        return INT_MAX;
+      if (n < -15)
+        return 0;
+      // 2^fraction in [1, 2), with 1 as 65536
+      uint32_t m = fixed_math::iexp2((x & 1023) << 6);
+      if (n >= 16)
+        return m << (n - 16);
+      return (m + (1u << (15 - n))) >> (16 - n);
+    }
   }
 
   namespace number {
@@ -184,7 +282,7 @@ namespace touch_develop {
     ManagedString to_string(int x) { return ManagedString(x); }
     ManagedString to_character(int x) { return ManagedString((char) x); }
     void post_to_wall(int s) {
-      uBit.serial.printf("%d\r\n", s);
+      serial_log::format("%d\r\n", s);
     }
   }
 
@@ -227,9 +325,47 @@ namespace touch_develop {
     // -------------------------------------------------------------------------    
     uint8_t radioDefaultGroup = MICROBIT_RADIO_DEFAULT_GROUP;
     bool radioEnabled = false;
-    int datagramBuf[4];    
-    int datagramRSSI = -1;
-    
+
+    // Incoming datagrams are moved from the DAL into a ring of [rxDepth]
+    // entries as soon as they arrive, so that a burst does not overwrite
+    // packets the script has not looked at yet. When the ring is full, new
+    // packets are dropped and counted.
+    #define DATAGRAM_QUEUE_DEFAULT_DEPTH 4
+    #define DATAGRAM_QUEUE_MAX_DEPTH 32
+
+    Datagram datagramCurrent;
+    Datagram *rxQueue = NULL;
+    int rxDepth = 0;
+    int rxHead = 0;
+    int rxCount = 0;
+    int rxDropped = 0;
+
+    // Registered as an immediate listener, so it runs before any handler the
+    // script has for the same event, and the packet is already queued by then.
+    void datagramReceived(MicroBitEvent) {
+        PacketBuffer packet = uBit.radio.datagram.recv();
+        if (radio_transfer::handlePacket(packet.getBytes(), packet.length()))
+            return;
+        if (rxCount == rxDepth) {
+            rxDropped++;
+            return;
+        }
+
+        Datagram *d = &rxQueue[(rxHead + rxCount) % rxDepth];
+        int n = min(MICROBIT_RADIO_MAX_PACKET_SIZE, packet.length());
+        memcpy(d->data, packet.getBytes(), n);
+        d->length = n;
+        d->rssi = packet.getRSSI();
+        d->time = uBit.systemTime();
+        rxCount++;
+    }
+
+    // What the datagramGet* functions return before anything is received.
+    static void datagramClear() {
+        memset(&datagramCurrent, 0, sizeof(datagramCurrent));
+        datagramCurrent.rssi = -1;
+    }
+
     int radioEnable() {
         int r = uBit.radio.enable();
         if (r != MICROBIT_OK) return r;
@@ -237,7 +373,10 @@ namespace touch_develop {
             if (radioDefaultGroup != MICROBIT_RADIO_DEFAULT_GROUP) {
                 uBit.radio.setGroup(radioDefaultGroup);
             }
-            memset(datagramBuf, 4, 0);           
+            datagramClear();
+            if (rxQueue == NULL)
+                datagramSetQueueDepth(DATAGRAM_QUEUE_DEFAULT_DEPTH);
+            uBit.MessageBus.listen(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM, datagramReceived, MESSAGE_BUS_LISTENER_IMMEDIATE);
             radioEnabled = true;
         }
         return r;
@@ -267,39 +406,86 @@ namespace touch_develop {
     void datagramSendNumbers(int value0, int value1, int value2, int value3) {
         if (radioEnable() != MICROBIT_OK) return;
         
-        datagramBuf[0] = value0;
-        datagramBuf[1] = value1;
-        datagramBuf[2] = value2;
-        datagramBuf[3] = value3;
-        uBit.radio.datagram.send((uint8_t*)datagramBuf, 16);
-        memset(datagramBuf, 4, 0);      
+        int buf[4] = { value0, value1, value2, value3 };
+        uBit.radio.datagram.send((uint8_t*)buf, 16);
     }
     
     int datagramReceiveNumber() {
         if (radioEnable() != MICROBIT_OK) return 0;
-        
-        memset(datagramBuf, 4, 0);
 
-        PacketBuffer packet = uBit.radio.datagram.recv();
-        uint8_t* buf = (uint8_t*)datagramBuf;
-        int n = min(16, packet.length());
-        for(int i = 0;i<n;++i) 
-            buf[i] = packet[i];
-        datagramRSSI = packet.getRSSI();
-        
-        return datagramBuf[0];
+        if (datagramPop() < 0) {
+            // no packet; behave as if an empty one was received
+            datagramClear();
+        }
+        return datagramGetNumber(0);
     }
     
     int datagramGetNumber(int index) {
         if (radioEnable() != MICROBIT_OK) return 0;
-        if (index < 0 || index >= 4) return 0;
-        return datagramBuf[index];
+        if (index < 0 || (index + 1) * 4 > datagramCurrent.length) return 0;
+
+        int v;
+        memcpy(&v, &datagramCurrent.data[index * 4], 4);
+        return v;
     }
     
     int datagramGetRSSI() {
         if (radioEnable() != MICROBIT_OK) return 0;
 
-        return datagramRSSI;
+        return datagramCurrent.rssi;
+    }
+
+    int datagramGetTime() {
+        if (radioEnable() != MICROBIT_OK) return 0;
+
+        return datagramCurrent.time;
+    }
+
+    int datagramGetLength() {
+        if (radioEnable() != MICROBIT_OK) return 0;
+
+        return datagramCurrent.length;
+    }
+
+    int datagramCount() {
+        if (radioEnable() != MICROBIT_OK) return 0;
+
+        return rxCount;
+    }
+
+    // Returns the length of the datagram made current, or -1 if the queue is
+    // empty (in which case the current datagram is left alone).
+    int datagramPeek() {
+        if (radioEnable() != MICROBIT_OK || rxCount == 0) return -1;
+
+        datagramCurrent = rxQueue[rxHead];
+        return datagramCurrent.length;
+    }
+
+    int datagramPop() {
+        int r = datagramPeek();
+        if (r >= 0) {
+            rxHead = (rxHead + 1) % rxDepth;
+            rxCount--;
+        }
+        return r;
+    }
+
+    int datagramDropped() {
+        if (radioEnable() != MICROBIT_OK) return 0;
+
+        return rxDropped;
+    }
+
+    // Changing the depth discards any queued datagrams.
+    void datagramSetQueueDepth(int depth) {
+        if (depth < 1 || depth > DATAGRAM_QUEUE_MAX_DEPTH) return;
+
+        delete[] rxQueue;
+        rxQueue = new Datagram[depth];
+        rxDepth = depth;
+        rxHead = 0;
+        rxCount = 0;
     }
         
     void onDatagramReceived(function<void()> f) {
@@ -313,33 +499,43 @@ namespace touch_develop {
     // -------------------------------------------------------------------------
 
     int compassHeading() {
-      return uBit.compass.heading();
+      orientation::startCalibration();
+      return (orientation::heading(orientation::sample()) * 360) >> 16;
+    }
+
+    void startCompassCalibration() {
+      orientation::startCalibration();
+    }
+
+    bool isCompassCalibrated() {
+      return orientation::calibrated();
     }
     
     int lightLevel() {
         return uBit.display.readLightLevel();
     }
 
+    // The sample is north-east-down; see Orientation.h.
     int getMagneticForce(int dimension) {
-      if (!uBit.compass.isCalibrated())
-        uBit.compass.calibrate();
+      orientation::startCalibration();
+      orientation::Sample s = orientation::sample();
       if (dimension == 0)
-        return uBit.compass.getX() / 1000;
+        return s.my / 1000;
       else if (dimension == 1)
-        return uBit.compass.getY() / 1000;
+        return s.mx / 1000;
       else if (dimension == 2)
-        return uBit.compass.getZ() / 1000;
+        return -s.mz / 1000;
       else if (dimension == 3)
-        return uBit.compass.getFieldStrength() / 1000;
+        return fixed_math::ihypot(fixed_math::ihypot(s.mx, s.my), s.mz) / 1000;
       // unknown
       else return 0;
     }
     
     int getAccelerationStrength() {
-        double x = uBit.accelerometer.getX();
-        double y = uBit.accelerometer.getY();
-        double z = uBit.accelerometer.getZ();
-        return (int)sqrt(x*x+y*y+z*z);
+        int x = uBit.accelerometer.getX();
+        int y = uBit.accelerometer.getY();
+        int z = uBit.accelerometer.getZ();
+        return fixed_math::isqrt(x*x + y*y + z*z);
     }
 
     int getAcceleration(int dimension) {
@@ -357,9 +553,9 @@ namespace touch_develop {
 
     int getRotation(int dimension) {
       if (dimension == 0)
-        return uBit.accelerometer.getPitch();
+        return orientation::degrees(orientation::pitch(orientation::sample(false)));
       else if (dimension == 1)
-        return uBit.accelerometer.getRoll();
+        return orientation::degrees(orientation::roll(orientation::sample(false)));
       // unknown
       else return 0;        
     }
@@ -533,20 +729,108 @@ namespace touch_develop {
         uBit.display.setDisplayMode((DisplayMode)mode);
     }
 
+    // While double buffering is on, the drawing functions below draw into
+    // [backBuffer] instead of the display, and displayPresent() copies it
+    // onto the display in one go, if anything changed. The whole image is
+    // copied (it is 25 bytes), so all that is kept is whether it changed.
+    MicroBitImage backBuffer;
+    bool doubleBuffered = false;
+    bool dirty = false;
+
+    // The display lights one row of its LED matrix per system tick, reading
+    // the image afresh each time, so that a frame spans
+    // MICROBIT_DISPLAY_ROW_COUNT ticks: a copy made between two of them would
+    // light the first rows from the old frame and the others from the new
+    // one. The copy is left to this component instead, which ticks along
+    // with the display and copies when the row just lit is the last one, so
+    // that the next frame starts from the new image.
+
+    inline void copyBackBuffer() {
+      memcpy(uBit.display.image.getBitmap(), backBuffer.getBitmap(),
+        backBuffer.getWidth() * backBuffer.getHeight());
+    }
+
+    class Presenter : public MicroBitComponent {
+      public:
+        volatile bool pending;
+
+        Presenter(): pending(false) {}
+
+        virtual void systemTick() {
+          if (pending && (NRF_GPIO->OUT & (1 << DISPLAY_LAST_ROW_PIN))) {
+            copyBackBuffer();
+            pending = false;
+          }
+        }
+    };
+
+    Presenter presenter;
+
+    inline MicroBitImage& drawTarget() {
+      return doubleBuffered ? backBuffer : uBit.display.image;
+    }
+
+    void displaySetDoubleBuffered(bool on) {
+      if (on == doubleBuffered)
+        return;
+      if (on) {
+        backBuffer = uBit.display.image.clone();
+        dirty = false;
+        doubleBuffered = true;
+        uBit.addSystemComponent(&presenter);
+      } else {
+        displayPresent();
+        uBit.removeSystemComponent(&presenter);
+        doubleBuffered = false;
+        backBuffer = MicroBitImage();
+      }
+    }
+
+    // Blocks until the next frame boundary, at most a frame later.
+    void displayPresent() {
+      if (!doubleBuffered || !dirty)
+        return;
+      dirty = false;
+
+      presenter.pending = true;
+      for (int ms = 0; presenter.pending && ms < DISPLAY_PRESENT_TIMEOUT_MS; ms += MICROBIT_DEFAULT_TICK_PERIOD)
+        uBit.sleep(MICROBIT_DEFAULT_TICK_PERIOD);
+
+      __disable_irq();
+      if (presenter.pending) {
+        copyBackBuffer();
+        presenter.pending = false;
+      }
+      __enable_irq();
+    }
+
     void clearScreen() {
-      uBit.display.image.clear();
+      drawTarget().clear();
+      dirty = doubleBuffered;
+    }
+
+    // Only actual changes mark the back buffer dirty, so that presenting an
+    // unchanged frame costs nothing.
+    inline void setPixel(int x, int y, int value) {
+      MicroBitImage& img = drawTarget();
+      if (doubleBuffered && img.getPixelValue(x, y) != value) {
+        if (img.setPixelValue(x, y, value) == MICROBIT_OK)
+          dirty = true;
+      } else {
+        img.setPixelValue(x, y, value);
+      }
     }
 
     void plot(int x, int y) {
-      uBit.display.image.setPixelValue(x, y, 1);
+      setPixel(x, y, 1);
     }
 
     void unPlot(int x, int y) {
-      uBit.display.image.setPixelValue(x, y, 0);
+      setPixel(x, y, 0);
     }
 
     bool point(int x, int y) {
-      return getImagePixel(uBit.display.image, x, y);
+      return getImagePixel(drawTarget(), x, y);
     }
 
     // -------------------------------------------------------------------------
@@ -624,7 +908,14 @@ namespace touch_develop {
     }
 
     void plotImage(MicroBitImage i, int offset) {
-      uBit.display.print(i, -offset, 0, 0, 0);
+      if (doubleBuffered) {
+        // as print() does on the display
+        backBuffer.clear();
+        backBuffer.paste(i, -offset, 0, 0);
+        dirty = true;
+      } else {
+        uBit.display.print(i, -offset, 0, 0, 0);
+      }
     }
 
     void plotLeds(int w, int h, const uint8_t* bitmap) {
@@ -0,0 +1,141 @@
+#include "Orientation.h"
+#include "FixedMath.h"
+
+namespace touch_develop {
+namespace orientation {
+
+  using namespace fixed_math;
+
+  int pitch(const Sample& s) {
+    // atan(-x / (y sin(roll) + z cos(roll))), where the denominator is the
+    // length of (y, z)
+    uint32_t yz = ihypot(s.ay, s.az);
+    return iatan2(-s.ax, yz > INT_MAX ? INT_MAX : yz);
+  }
+
+  int roll(const Sample& s) {
+    return iatan2(s.ay, s.az);
+  }
+
+  // Rotates the field back to the horizontal plane, then takes its angle.
+  int heading(const Sample& s) {
+    int p = pitch(s), r = roll(s);
+    int64_t sp = isin(p), cp = icos(p);
+    int64_t sr = isin(r), cr = icos(r);
+    // in 2^30ths, FIXED_SIN_ONE being 2^15
+    int64_t xh = s.mx * cp * FIXED_SIN_ONE + s.my * sp * sr + s.mz * sp * cr;
+    int64_t yh = (s.mz * sr - s.my * cr) * FIXED_SIN_ONE;
+    // down to 31 bits for iatan2(), keeping the ratio
+    while (xh > INT_MAX || xh < -INT_MAX || yh > INT_MAX || yh < -INT_MAX) {
+      xh >>= 1;
+      yh >>= 1;
+    }
+    return iatan2((int)yh, (int)xh) & (FIXED_ANGLE_TURN - 1);
+  }
+
+  int degrees(int angle) {
+    return (angle * 360 + FIXED_ANGLE_TURN / 2) >> 16;
+  }
+
+  // ---------------------------------------------------------------------------
+  // Calibration
+  // ---------------------------------------------------------------------------
+
+  Calibrator::Calibrator() {
+    reset();
+  }
+
+  void Calibrator::reset() {
+    for (int i = 0; i < 3; ++i) {
+      lo[i] = INT_MAX;
+      hi[i] = INT_MIN;
+    }
+    n = 0;
+  }
+
+  void Calibrator::add(int x, int y, int z) {
+    int v[3] = { x, y, z };
+    for (int i = 0; i < 3; ++i) {
+      lo[i] = min(lo[i], v[i]);
+      hi[i] = max(hi[i], v[i]);
+    }
+    n++;
+  }
+
+  bool Calibrator::done() {
+    for (int i = 0; i < 3; ++i)
+      if (n == 0 || hi[i] - lo[i] < ORIENTATION_CAL_SPREAD)
+        return false;
+    return true;
+  }
+
+  // ---------------------------------------------------------------------------
+  // Glue to uBit.accelerometer and uBit.compass
+  // ---------------------------------------------------------------------------
+
+  static Calibrator calibrator;
+  static int offset[3];
+  static bool isCalibrated = false;
+  static bool calibrating = false;
+  // When the heading was last wanted.
+  static unsigned long lastWanted;
+
+  Sample sample(bool compass) {
+    int ax = uBit.accelerometer.getX();
+    int ay = uBit.accelerometer.getY();
+    int az = uBit.accelerometer.getZ();
+    int mx = 0, my = 0, mz = 0;
+    if (compass) {
+      mx = uBit.compass.getX();
+      my = uBit.compass.getY();
+      mz = uBit.compass.getZ();
+    }
+
+    if (compass && calibrating && !isCalibrated) {
+      calibrator.add(mx, my, mz);
+      if (calibrator.done()) {
+        for (int i = 0; i < 3; ++i)
+          offset[i] = calibrator.lo[i] + (calibrator.hi[i] - calibrator.lo[i]) / 2;
+        isCalibrated = true;
+      }
+    }
+
+    // the DAL axes have x towards button B, y towards the logo and z out of
+    // the screen
+    Sample s;
+    s.ax = ay;
+    s.ay = ax;
+    s.az = -az;
+    s.mx = my - offset[1];
+    s.my = mx - offset[0];
+    s.mz = -(mz - offset[2]);
+    return s;
+  }
+
+  static void calibrate() {
+    while (!isCalibrated && uBit.systemTime() - lastWanted < ORIENTATION_CAL_IDLE_MS) {
+      sample();
+      uBit.sleep(ORIENTATION_CAL_MS);
+    }
+    calibrating = false;
+  }
+
+  // The calibrator is left as it is between runs: the spread seen before
+  // still counts.
+  void startCalibration() {
+    lastWanted = uBit.systemTime();
+    if (isCalibrated || calibrating)
+      return;
+    calibrating = true;
+    create_fiber(calibrate);
+  }
+
+  bool calibrated() {
+    if (calibrating)
+      lastWanted = uBit.systemTime();
+    return isCalibrated;
+  }
+}
+}
+
+// vim: set ts=2 sw=2 sts=2:
@@ -0,0 +1,150 @@
+#include "Profiler.h"
+
+namespace bitvm {
+namespace profiler {
+
+  Histogram::Histogram(const uint32_t *functions, int numFunctions, uint32_t code, int shift)
+    : samples(0), functions(functions), numFunctions(numFunctions), code(code), shift(shift)
+  {
+    shimCounts = new uint16_t[numFunctions];
+    memset(shimCounts, 0, numFunctions * sizeof(uint16_t));
+    memset(codeCounts, 0, sizeof(codeCounts));
+  }
+
+  Histogram::~Histogram()
+  {
+    delete[] shimCounts;
+  }
+
+  static inline void bump(uint16_t *c)
+  {
+    if (*c != 0xffff) (*c)++;
+  }
+
+  // Runs in the interrupt; the shim lookup is a linear scan over a couple
+  // hundred entries, which is cheap at the sampling rates used, and needs no
+  // RAM for a sorted copy of the table.
+  void Histogram::record(uint32_t pc)
+  {
+    pc &= ~1;
+    samples++;
+
+    if (pc >= code) {
+      uint32_t b = (pc - code) >> shift;
+      bump(&codeCounts[b < PROFILER_BUCKETS ? b : PROFILER_BUCKETS - 1]);
+      return;
+    }
+
+    int best = -1;
+    uint32_t bestAddr = 0;
+    for (int i = 0; i < numFunctions; ++i) {
+      uint32_t a = functions[i] & ~1;
+      if (a <= pc && a >= bestAddr) {
+        best = i;
+        bestAddr = a;
+      }
+    }
+    if (best >= 0)
+      bump(&shimCounts[best]);
+  }
+
+  void Histogram::dump(PrintFn print)
+  {
+    print("PROFILE %lu %d\n", (unsigned long)samples, shift);
+    for (int i = 0; i < numFunctions; ++i)
+      if (shimCounts[i])
+        print("S %d %d\n", i, shimCounts[i]);
+    for (int i = 0; i < PROFILER_BUCKETS; ++i)
+      if (codeCounts[i])
+        print("B %d %d\n", i << shift, codeCounts[i]);
+    print("END\n");
+  }
+
+  static Histogram * volatile active;
+
+#if defined(__GNUC__) && defined(__thumb__)
+  extern "C" void profilerSample(uint32_t pc)
+  {
+    // read back, so that the write is done before the interrupt returns
+    PROFILER_TIMER->EVENTS_COMPARE[0] = 0;
+    (void)PROFILER_TIMER->EVENTS_COMPARE[0];
+    Histogram *h = active;
+    if (h) h->record(pc);
+  }
+
+  bool startSampling(Histogram *h, int hz)
+  {
+    if (hz <= 0)
+      return false;
+    // the timer runs at 16 MHz >> prescaler, the prescaler going up to 9
+    int prescaler = 0;
+    while ((16000000 >> prescaler) / hz > PROFILER_TIMER_MAX)
+      if (++prescaler > 9)
+        return false;
+    uint32_t period = (16000000 >> prescaler) / hz;
+    if (period == 0)
+      return false;
+
+    stopSampling();
+    active = h;
+    PROFILER_TIMER->MODE = TIMER_MODE_MODE_Timer;
+    PROFILER_TIMER->BITMODE = TIMER_BITMODE_BITMODE_16Bit;
+    PROFILER_TIMER->PRESCALER = prescaler;
+    PROFILER_TIMER->CC[0] = period;
+    PROFILER_TIMER->SHORTS = TIMER_SHORTS_COMPARE0_CLEAR_Msk;
+    PROFILER_TIMER->EVENTS_COMPARE[0] = 0;
+    PROFILER_TIMER->INTENSET = TIMER_INTENSET_COMPARE0_Msk;
+    PROFILER_TIMER->TASKS_CLEAR = 1;
+    NVIC_SetPriority(PROFILER_TIMER_IRQn, PROFILER_IRQ_PRIORITY);
+    NVIC_ClearPendingIRQ(PROFILER_TIMER_IRQn);
+    NVIC_EnableIRQ(PROFILER_TIMER_IRQn);
+    PROFILER_TIMER->TASKS_START = 1;
+    return true;
+  }
+
+  void stopSampling()
+  {
+    PROFILER_TIMER->TASKS_STOP = 1;
+    PROFILER_TIMER->INTENCLR = TIMER_INTENCLR_COMPARE0_Msk;
+    NVIC_DisableIRQ(PROFILER_TIMER_IRQn);
+    active = NULL;
+  }
+#else
+  bool startSampling(Histogram *, int)
+  {
+    return false;
+  }
+
+  void stopSampling()
+  {
+    active = NULL;
+  }
+#endif
+}
+}
+
+#if defined(__GNUC__) && defined(__thumb__)
+// Passes the PC stacked on exception entry, from whichever stack was in use,
+// to profilerSample(); the tail call leaves EXC_RETURN in lr, so returning
+// from there returns from the exception.
+extern "C" __attribute__((naked)) void PROFILER_TIMER_HANDLER()
+{
+  __asm volatile(
+    "movs r0, #4          \n"
+    "mov  r1, lr          \n"
+    "tst  r0, r1          \n"
+    "beq  1f              \n"
+    "mrs  r0, psp         \n"
+    "b    2f              \n"
+    "1:                   \n"
+    "mrs  r0, msp         \n"
+    "2:                   \n"
+    "ldr  r0, [r0, #24]   \n"
+    "ldr  r1, =profilerSample \n"
+    "bx   r1              \n"
+    ".ltorg               \n"
+  );
+}
+#endif
+
+// vim: set ts=2 sw=2 sts=2:
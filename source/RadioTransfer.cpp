@@ -0,0 +1,296 @@
+#include "RadioTransfer.h"
+
+namespace touch_develop {
+namespace radio_transfer {
+
+  Stats stats;
+
+  static inline uint16_t get16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+  }
+
+  static inline void put16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+  }
+
+  static inline void header(uint8_t *p, int type, uint8_t xfer, uint16_t a, uint16_t b) {
+    p[0] = BULK_MAGIC0;
+    p[1] = BULK_MAGIC1;
+    p[2] = type;
+    p[3] = xfer;
+    put16(p + 4, a);
+    put16(p + 6, b);
+  }
+
+  // ---------------------------------------------------------------------------
+  // Sender
+  // ---------------------------------------------------------------------------
+
+  Sender::Sender(SendFn send): xfer(0), send(send), data(NULL), len(0), count(0),
+    base(0), acked(0), sent(0), progressAt(0), failed(false) {}
+
+  void Sender::start(const uint8_t *data, int len, uint8_t xfer, uint32_t now) {
+    this->data = data;
+    this->len = len;
+    this->xfer = xfer;
+    // an empty buffer still takes one (empty) fragment
+    count = len == 0 ? 1 : (len + BULK_FRAGMENT_SIZE - 1) / BULK_FRAGMENT_SIZE;
+    base = 0;
+    acked = 0;
+    sent = 0;
+    progressAt = now;
+    failed = false;
+  }
+
+  void Sender::sendFragment(int seq) {
+    uint8_t buf[MICROBIT_RADIO_MAX_PACKET_SIZE];
+    int off = seq * BULK_FRAGMENT_SIZE;
+    int n = min(BULK_FRAGMENT_SIZE, len - off);
+    header(buf, BULK_DATA, xfer, seq, count);
+    memcpy(buf + BULK_HEADER_SIZE, data + off, n);
+    send(buf, BULK_HEADER_SIZE + n);
+    stats.packetsSent++;
+    stats.bytesSent += n;
+  }
+
+  bool Sender::poll(uint32_t now) {
+    if (failed || succeeded())
+      return false;
+
+    if (now - progressAt > BULK_GIVE_UP_MS) {
+      failed = true;
+      return false;
+    }
+
+    for (int i = 0; i < BULK_WINDOW && base + i < count; ++i) {
+      uint32_t bit = 1u << i;
+      if (acked & bit)
+        continue;
+      if (sent & bit) {
+        if (now - sentAt[i] < BULK_RTO_MS)
+          continue;
+        stats.retransmissions++;
+      }
+      sendFragment(base + i);
+      sent |= bit;
+      sentAt[i] = now;
+    }
+
+    return true;
+  }
+
+  void Sender::onAck(const uint8_t *buf, int len, uint32_t now) {
+    if (len < BULK_ACK_SIZE || buf[3] != xfer)
+      return;
+    stats.acksReceived++;
+
+    uint16_t ackBase = get16(buf + 4);
+    uint32_t ackReceived;
+    memcpy(&ackReceived, buf + 8, 4);
+
+    // stale or bogus
+    if (ackBase < base || ackBase > count)
+      return;
+
+    int shift = ackBase - base;
+    if (shift > 0) {
+      progressAt = now;
+      base = ackBase;
+      if (shift >= 32) {
+        acked = sent = 0;
+      } else {
+        acked >>= shift;
+        sent >>= shift;
+      }
+      if (shift < BULK_WINDOW)
+        memmove(sentAt, sentAt + shift, (BULK_WINDOW - shift) * sizeof(uint32_t));
+    }
+    acked |= ackReceived;
+  }
+
+  // ---------------------------------------------------------------------------
+  // Receiver
+  // ---------------------------------------------------------------------------
+
+  Receiver::Receiver(SendFn send): send(send), active(false), complete(false),
+    xfer(0), count(0), base(0), received(0), lastLen(0), sinceAck(0),
+    finished(false), doneXfer(0), doneCount(0), doneAt(0) {}
+
+  void Receiver::sendAck(uint8_t x, uint16_t b, uint32_t r) {
+    uint8_t buf[BULK_ACK_SIZE];
+    header(buf, BULK_ACK, x, b, 0);
+    memcpy(buf + 8, &r, 4);
+    send(buf, BULK_ACK_SIZE);
+    sinceAck = 0;
+  }
+
+  // Runs in the radio listener, so it must neither grow the buffer fragment
+  // by fragment nor be the one to run the heap dry: the previous buffer is
+  // released, then the new one allocated at once if enough would be left.
+  bool Receiver::reserve(int size) {
+    std::vector<uint8_t>().swap(data);
+    void *probe = malloc(size + BULK_HEAP_RESERVE);
+    if (probe == NULL)
+      return false;
+    free(probe);
+    data.resize(size);
+    return true;
+  }
+
+  void Receiver::onData(const uint8_t *buf, int len, uint32_t now) {
+    if (len < BULK_HEADER_SIZE)
+      return;
+    stats.packetsReceived++;
+
+    uint8_t x = buf[3];
+    uint16_t seq = get16(buf + 4);
+    uint16_t n = get16(buf + 6);
+    int plen = len - BULK_HEADER_SIZE;
+
+    if (finished && x == doneXfer && n == doneCount && now - doneAt < BULK_GIVE_UP_MS) {
+      // our final ACK got lost
+      stats.duplicates++;
+      sendAck(x, n, 0);
+      return;
+    }
+
+    if (!active || x != xfer || n != count) {
+      if (n == 0 || n * BULK_FRAGMENT_SIZE > BULK_MAX_SIZE + BULK_FRAGMENT_SIZE)
+        return;
+      // the previous transfer was acknowledged, so it must not be lost: the
+      // new one goes unacknowledged, and is retransmitted, until take()
+      if (complete)
+        return;
+      active = false;
+      if (!reserve(n * BULK_FRAGMENT_SIZE))
+        return;
+      active = true;
+      xfer = x;
+      count = n;
+      base = 0;
+      received = 0;
+      lastLen = 0;
+      sinceAck = 0;
+    }
+
+    if (seq >= count || (seq != count - 1 && plen != BULK_FRAGMENT_SIZE))
+      return;
+
+    if (seq < base || seq >= base + 32 || (received & (1u << (seq - base)))) {
+      stats.duplicates++;
+      sendAck(xfer, base, received);
+      return;
+    }
+
+    memcpy(&data[seq * BULK_FRAGMENT_SIZE], buf + BULK_HEADER_SIZE, plen);
+    if (seq == count - 1)
+      lastLen = plen;
+
+    bool inOrder = seq == base;
+    received |= 1u << (seq - base);
+    while (received & 1) {
+      received >>= 1;
+      base++;
+    }
+
+    if (base == count) {
+      active = false;
+      complete = true;
+      finished = true;
+      doneXfer = xfer;
+      doneCount = count;
+      doneAt = now;
+      data.resize((count - 1) * BULK_FRAGMENT_SIZE + lastLen);
+      sendAck(xfer, base, received);
+    } else if (!inOrder || ++sinceAck >= BULK_ACK_EVERY) {
+      sendAck(xfer, base, received);
+    }
+  }
+
+  bool Receiver::take(std::vector<uint8_t>& out) {
+    if (!complete)
+      return false;
+    out.swap(data);
+    std::vector<uint8_t>().swap(data);
+    complete = false;
+    return true;
+  }
+
+  // ---------------------------------------------------------------------------
+  // Glue to uBit.radio
+  // ---------------------------------------------------------------------------
+
+  static void radioSend(const uint8_t *buf, int len) {
+    uBit.radio.datagram.send((uint8_t*)buf, len);
+  }
+
+  static bool enabled = false;
+  // Not on the stack of the fiber in send(): handlePacket() runs on another
+  // fiber, while that stack may be swapped out.
+  static Sender sender(radioSend);
+  static Sender *activeSender = NULL;
+  static Receiver receiver(radioSend);
+  static uint8_t lastXfer;
+
+  bool handlePacket(const uint8_t *buf, int len) {
+    if (!enabled || len < BULK_HEADER_SIZE || buf[0] != BULK_MAGIC0 || buf[1] != BULK_MAGIC1)
+      return false;
+
+    if (buf[2] == BULK_ACK) {
+      if (activeSender)
+        activeSender->onAck(buf, len, uBit.systemTime());
+    } else if (buf[2] == BULK_DATA) {
+      receiver.onData(buf, len, uBit.systemTime());
+    }
+    return true;
+  }
+
+  bool send(const uint8_t *data, int len) {
+    if (len > BULK_MAX_SIZE || activeSender != NULL)
+      return false;
+    if (micro_bit::radioEnable() != MICROBIT_OK)
+      return false;
+    enabled = true;
+
+    // a fresh id every time, so that neither a receiver still acknowledging
+    // the previous transfer nor one that saw this id before a reboot takes
+    // the new transfer for a retransmission
+    uint8_t x;
+    do {
+      x = uBit.random(256);
+    } while (x == lastXfer);
+    lastXfer = x;
+
+    uint32_t start = uBit.systemTime();
+    sender.start(data, len, x, start);
+    activeSender = &sender;
+    while (sender.poll(uBit.systemTime()))
+      uBit.sleep(BULK_POLL_MS);
+    activeSender = NULL;
+
+    if (sender.succeeded()) {
+      uint32_t ms = uBit.systemTime() - start;
+      stats.transfersOk++;
+      stats.lastBytesPerSecond = (uint32_t)len * 1000 / (ms ? ms : 1);
+      return true;
+    } else {
+      stats.transfersFailed++;
+      return false;
+    }
+  }
+
+  bool receive(std::vector<uint8_t>& out, int timeoutMs) {
+    if (micro_bit::radioEnable() != MICROBIT_OK)
+      return false;
+    enabled = true;
+    uint32_t start = uBit.systemTime();
+    while (!receiver.take(out)) {
+      if (timeoutMs >= 0 && (int)(uBit.systemTime() - start) >= timeoutMs)
+        return false;
+      uBit.sleep(BULK_POLL_MS);
+    }
+    return true;
+  }
+}
+}
@@ -0,0 +1,155 @@
+#include "SerialFrames.h"
+#include "SerialLog.h"
+
+namespace touch_develop {
+namespace serial_frames {
+
+  uint32_t errors;
+
+  uint16_t crc16(const uint8_t *data, int len, uint16_t crc) {
+    while (len--) {
+      crc ^= *data++ << 8;
+      for (int i = 0; i < 8; ++i)
+        crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+  }
+
+  static inline void put(uint8_t c) {
+    uBit.serial.putc(c);
+  }
+
+  // Payload followed by the two CRC bytes, without building it in memory.
+  static inline uint8_t byteAt(const uint8_t *data, int len, const uint8_t *crc, int i) {
+    return i < len ? data[i] : crc[i - len];
+  }
+
+  bool send(const uint8_t *data, int len, bool cobs) {
+    if (len > SERIAL_FRAME_MAX_SIZE)
+      return false;
+
+    uint16_t c = crc16(data, len);
+    uint8_t crc[2] = { (uint8_t)c, (uint8_t)(c >> 8) };
+
+    // anything still queued in the log goes first, so the two don't mix
+    serial_log::flush();
+
+    if (!cobs) {
+      put(SERIAL_FRAME_SYNC);
+      put(len);
+      put(len >> 8);
+      for (int i = 0; i < len; ++i)
+        put(data[i]);
+      put(crc[0]);
+      put(crc[1]);
+      return true;
+    }
+
+    // The leading zero ends whatever garbage the receiver may have seen so
+    // far. Each block is then a code byte n followed by n - 1 non-zero bytes;
+    // a code below 0xff stands for an implicit zero after the block.
+    put(0);
+    int total = len + 2;
+    int i = 0;
+    while (true) {
+      int n = 0;
+      while (i + n < total && n < 254 && byteAt(data, len, crc, i + n) != 0)
+        n++;
+      put(n + 1);
+      for (int k = 0; k < n; ++k)
+        put(byteAt(data, len, crc, i + k));
+      i += n;
+      if (i >= total)
+        break;
+      if (n < 254)
+        i++; // skip the zero the code stands for
+    }
+    put(0);
+    return true;
+  }
+
+  // Returns the next byte, or -1 on timeout.
+  static int get(uint32_t deadline, bool forever) {
+    while (!uBit.serial.readable()) {
+      if (!forever && (int32_t)(uBit.systemTime() - deadline) >= 0)
+        return -1;
+      schedule();
+    }
+    return uBit.serial.getc();
+  }
+
+  static bool checkAndTrim(std::vector<uint8_t>& out) {
+    int n = out.size() - 2;
+    if (n < 0 || crc16(&out[0], n) != (out[n] | (out[n + 1] << 8))) {
+      errors++;
+      return false;
+    }
+    out.resize(n);
+    return true;
+  }
+
+  static bool receivePlain(std::vector<uint8_t>& out, uint32_t deadline, bool forever) {
+    while (true) {
+      int c = get(deadline, forever);
+      if (c < 0) return false;
+      if (c != SERIAL_FRAME_SYNC) continue;
+
+      int lo = get(deadline, forever);
+      int hi = get(deadline, forever);
+      if (lo < 0 || hi < 0) return false;
+      int len = lo | (hi << 8);
+      if (len > SERIAL_FRAME_MAX_SIZE) {
+        errors++;
+        continue;
+      }
+
+      out.resize(len + 2);
+      for (int i = 0; i < len + 2; ++i) {
+        if ((c = get(deadline, forever)) < 0) return false;
+        out[i] = c;
+      }
+      if (checkAndTrim(out))
+        return true;
+    }
+  }
+
+  static bool receiveCobs(std::vector<uint8_t>& out, uint32_t deadline, bool forever) {
+    while (true) {
+      out.clear();
+      // 0 - expecting a code byte; otherwise the number of data bytes left in
+      // the current block
+      int left = 0;
+      bool zeroAfter = false, bad = false;
+      int c;
+      while ((c = get(deadline, forever)) != 0) {
+        if (c < 0) return false;
+        if (bad) continue;
+        if (left == 0) {
+          if (zeroAfter) out.push_back(0);
+          left = c - 1;
+          zeroAfter = c < 0xff;
+        } else {
+          out.push_back(c);
+          left--;
+        }
+        if (out.size() > SERIAL_FRAME_MAX_SIZE + 2)
+          bad = true;
+      }
+      if (bad || left != 0) {
+        errors++;
+        continue;
+      }
+      if (out.size() == 0)
+        continue; // stray delimiter
+      if (checkAndTrim(out))
+        return true;
+    }
+  }
+
+  bool receive(std::vector<uint8_t>& out, bool cobs, int timeoutMs) {
+    uint32_t deadline = uBit.systemTime() + timeoutMs;
+    bool forever = timeoutMs < 0;
+    return cobs ? receiveCobs(out, deadline, forever) : receivePlain(out, deadline, forever);
+  }
+}
+}
@@ -0,0 +1,76 @@
+#include "SerialLog.h"
+#include <stdarg.h>
+
+namespace touch_develop {
+namespace serial_log {
+
+  uint32_t dropped;
+
+  static char buf[SERIAL_LOG_SIZE];
+  // [head] is only moved by writers and [tail] only by the consumer.
+  static volatile uint16_t head, tail;
+  static bool fiberStarted;
+  static volatile bool fiberWaiting;
+
+  static inline int used() {
+    return (head - tail + SERIAL_LOG_SIZE) % SERIAL_LOG_SIZE;
+  }
+
+  static void drain() {
+    while (true) {
+      if (head == tail) {
+        fiberWaiting = true;
+        fiber_wait_for_event(SERIAL_LOG_ID, SERIAL_LOG_EVT_DATA);
+        continue;
+      }
+      while (head != tail && uBit.serial.writeable()) {
+        uBit.serial.putc(buf[tail]);
+        tail = (tail + 1) % SERIAL_LOG_SIZE;
+      }
+      // let other fibers run while the UART is busy
+      schedule();
+    }
+  }
+
+  int write(const char *s, int len) {
+    // one slot is kept free to tell a full buffer from an empty one
+    if (len > SERIAL_LOG_SIZE - 1 - used()) {
+      dropped++;
+      return 0;
+    }
+
+    int h = head;
+    int n = min(len, SERIAL_LOG_SIZE - h);
+    memcpy(buf + h, s, n);
+    memcpy(buf, s + n, len - n);
+    head = (h + len) % SERIAL_LOG_SIZE;
+
+    if (!fiberStarted) {
+      fiberStarted = true;
+      create_fiber(drain);
+    } else if (fiberWaiting) {
+      fiberWaiting = false;
+      MicroBitEvent(SERIAL_LOG_ID, SERIAL_LOG_EVT_DATA);
+    }
+    return len;
+  }
+
+  int format(const char *fmt, ...) {
+    char line[SERIAL_LOG_LINE];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (len < 0)
+      return 0;
+    return write(line, min(len, (int)sizeof(line) - 1));
+  }
+
+  void flush() {
+    while (head != tail) {
+      uBit.serial.putc(buf[tail]);
+      tail = (tail + 1) % SERIAL_LOG_SIZE;
+    }
+  }
+}
+}
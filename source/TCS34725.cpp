@@ -13,6 +13,7 @@
 /**************************************************************************/
 
 #include "TCS34725.h"
+#include "SerialLog.h"
 
 namespace touch_develop {
 namespace tcs34725 {
@@ -47,7 +48,8 @@ namespace tcs34725 {
     /* Make sure we're actually connected */
     uint8_t x = i2c.read8(TCS34725_ID);
     if (x != 0x44 && x != 0x10) {
-      uBit.serial.printf("Bad peripheral id: %x\n", x);
+      serial_log::format("Bad peripheral id: %x\n", x);
+      serial_log::flush();
       uBit.panic(TD_PERIPHERAL_ERROR);
     }
     _tcs34725Initialised = true;
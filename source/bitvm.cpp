@@ -1,9 +1,14 @@
 #include "BitVM.h"
 #include "MicroBitTouchDevelop.h"
+#include "RadioTransfer.h"
+#include "SerialFrames.h"
+#include "Profiler.h"
 #include <cstdlib>
 #include <climits>
 #include <cmath>
 #include <vector>
+#include <algorithm>
+#include <stdarg.h>
 
 
 #define DBG printf
@@ -20,6 +25,10 @@
 namespace bitvm {
   uint16_t *bytecode;
 
+#ifdef BITVM_PERF_COUNTERS
+  uint32_t perfCounters[PERF_COUNTERS];
+#endif
+
   uint32_t ldloc(RefLocal *r)
   {
     return r->v;
@@ -45,12 +54,79 @@ namespace bitvm {
 
   RefLocal *mkloc()
   {
-    return new RefLocal();
+    GC_SAFE_POINT();
+    RefLocal *r = new RefLocal();
+    HEAP_SITE(r);
+    return r;
   }
 
   RefRefLocal *mklocRef()
   {
-    return new RefRefLocal();
+    GC_SAFE_POINT();
+    RefRefLocal *r = new RefRefLocal();
+    HEAP_SITE(r);
+    return r;
+  }
+
+  // Boxes which the code emitter has proven not to outlive the current frame
+  // are placed in BITVM_LOCAL_BOX_WORDS words of the frame instead of the heap.
+  // The frame's own reference is never decr()ed; instead rmlocFrame() is
+  // called when the frame is left.
+  RefLocal *mklocFrame(uint32_t *mem)
+  {
+    return new (mem) RefLocal();
+  }
+
+  RefRefLocal *mklocRefFrame(uint32_t *mem)
+  {
+    return new (mem) RefRefLocal();
+  }
+
+  void rmlocFrame(RefObject *r)
+  {
+#ifdef BITVM_DEFERRED_DECR
+    while (DeferredDecr::cancel(r))
+      r->refcnt--;
+#endif
+    // anything still holding on to the box means it did escape after all
+    check(r->refcnt == 1, ERR_LOCAL_ESCAPED);
+    r->~RefObject();
+  }
+
+  static_assert(sizeof(RefLocal) <= BITVM_LOCAL_BOX_WORDS * 4 &&
+                sizeof(RefRefLocal) <= BITVM_LOCAL_BOX_WORDS * 4,
+                "BITVM_LOCAL_BOX_WORDS too small");
+
+  // Freed boxes are threaded through their first word. Only a handful are
+  // kept; beyond that they go back to the heap, so that a one-off burst of
+  // boxes does not pin the memory for ever.
+  #define LOCAL_POOL_MAX 16
+
+  static void *localPoolHead;
+  static int localPoolSize;
+
+  void *LocalPool::alloc(size_t sz)
+  {
+    heapAlloc(HEAP_LOCAL, BITVM_LOCAL_BOX_WORDS * 4);
+    if (localPoolHead) {
+      void *r = localPoolHead;
+      localPoolHead = *(void**)r;
+      localPoolSize--;
+      return r;
+    }
+    return ::operator new(BITVM_LOCAL_BOX_WORDS * 4);
+  }
+
+  void LocalPool::free(void *p)
+  {
+    heapFree(HEAP_LOCAL, BITVM_LOCAL_BOX_WORDS * 4);
+    if (localPoolSize >= LOCAL_POOL_MAX) {
+      ::operator delete(p);
+      return;
+    }
+    *(void**)p = localPoolHead;
+    localPoolHead = p;
+    localPoolSize++;
   }
 
   // All of the functions below unref() self. This is for performance reasons -
@@ -126,21 +202,419 @@ namespace bitvm {
   // This one is used for testing in 'bitvm test0'
   uint32_t const3() { return 3; }
 
+  HeapStats heapStats;
+
+#ifdef BITVM_DEFERRED_DECR
+  RefObject *DeferredDecr::slots[DEFERRED_DECR_SLOTS];
+  int DeferredDecr::count;
+
+  void DeferredDecr::flush()
+  {
+    // Freeing an object can queue more decrements (of its fields), which
+    // are picked up by the same loop.
+    while (count > 0)
+      slots[--count]->unrefNow();
+  }
+#endif
+
 #ifdef DEBUG_MEMLEAKS
-  std::set<RefObject*> allptrs;
+  // Open addressing with linear probing. Sites are stored as the offset in
+  // the bytecode, in half-words, plus one; 0 means unknown.
+  #define HEAP_TRACK_SIZE 256 // power of 2
+
+  static RefObject *trackedPtrs[HEAP_TRACK_SIZE];
+  static uint16_t trackedSites[HEAP_TRACK_SIZE];
+  static int trackedCount;
+  static int trackedOverflow;
+
+  static inline int trackSlot(RefObject *p)
+  {
+    return ((((uint32_t)(uintptr_t)p >> 2) * 2654435761u) >> 16) & (HEAP_TRACK_SIZE - 1);
+  }
+
+  static int trackFind(RefObject *p)
+  {
+    for (int i = trackSlot(p); trackedPtrs[i]; i = (i + 1) & (HEAP_TRACK_SIZE - 1))
+      if (trackedPtrs[i] == p)
+        return i;
+    return -1;
+  }
+
+  void HeapTracker::track(RefObject *p)
+  {
+    // keep one slot free, so that lookups terminate
+    if (trackedCount >= HEAP_TRACK_SIZE - 1) {
+      trackedOverflow++;
+      return;
+    }
+    int i = trackSlot(p);
+    while (trackedPtrs[i])
+      i = (i + 1) & (HEAP_TRACK_SIZE - 1);
+    trackedPtrs[i] = p;
+    trackedSites[i] = 0;
+    trackedCount++;
+  }
+
+  void HeapTracker::untrack(RefObject *p)
+  {
+    int i = trackFind(p);
+    if (i < 0)
+      return;
+    trackedPtrs[i] = NULL;
+    trackedCount--;
+
+    // Move back entries that would no longer be found past the hole.
+    int j = i;
+    while (true) {
+      j = (j + 1) & (HEAP_TRACK_SIZE - 1);
+      if (!trackedPtrs[j])
+        break;
+      int k = trackSlot(trackedPtrs[j]);
+      bool stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+      if (!stays) {
+        trackedPtrs[i] = trackedPtrs[j];
+        trackedSites[i] = trackedSites[j];
+        trackedPtrs[j] = NULL;
+        i = j;
+      }
+    }
+  }
+
+  void HeapTracker::setSite(RefObject *p, void *site)
+  {
+    int i = trackFind(p);
+    int off = ((uint8_t*)site - (uint8_t*)bytecode) / 2;
+    if (i >= 0 && 0 <= off && off < 0xffff)
+      trackedSites[i] = off + 1;
+  }
+
+  void HeapTracker::dump()
+  {
+    for (int i = 0; i < HEAP_TRACK_SIZE; ++i) {
+      if (!trackedPtrs[i])
+        continue;
+      if (trackedSites[i])
+        printf("@0x%x ", (trackedSites[i] - 1) * 2);
+      trackedPtrs[i]->print();
+    }
+    if (trackedOverflow)
+      printf("(%d objects not tracked, table full)\n", trackedOverflow);
+  }
+
   void debugMemLeaks()
   {
+    DEFERRED_DECR_FLUSH();
     printf("LIVE POINTERS:\n");
-    for(std::set<RefObject*>::iterator itr = allptrs.begin();itr!=allptrs.end();itr++)
-    {
-      (*itr)->print();
-    }    
+    HeapTracker::dump();
     printf("\n");
   }
 #else
   void debugMemLeaks() {}
 #endif
 
+#ifdef BITVM_CYCLE_COLLECTOR
+  // Synchronous trial deletion (as in Bacon & Rajan), on a bounded subgraph:
+  //   1. gather the objects reachable from the possible roots, up to
+  //      GC_MAX_OBJECTS; collections longer than GC_MAX_EDGES are not looked
+  //      into (nor collected);
+  //   2. take away from each ref-count the references from within the
+  //      subgraph; anything left comes from outside (the stack, globals,
+  //      objects not gathered), so the object is alive, and so is
+  //      everything reachable from it;
+  //   3. the rest is only referenced by garbage: the references between
+  //      garbage objects are dropped, and the objects freed.
+  // Gathering less only ever makes the result more conservative.
+  #define GC_MAX_ROOTS      48
+  #define GC_ROOTS_TRIGGER  24
+  #define GC_MAX_OBJECTS    64
+  #define GC_MAX_EDGES      64
+  #define GC_ROOTS_TABLE    64    // sizes of the hash tables below
+  #define GC_INDEX_TABLE    128
+
+  // A set of pointers with a byte of data each. Open addressing with linear
+  // probing; N is a power of 2, and at most N - 1 entries are used.
+  template <int N>
+  class PtrSet
+  {
+  public:
+    RefObject *ptrs[N];
+    uint8_t vals[N];
+    int count;
+
+    static int slot(uint32_t p)
+    {
+      return (((p >> 2) * 2654435761u) >> 16) & (N - 1);
+    }
+
+    int find(uint32_t p)
+    {
+      for (int i = slot(p); ptrs[i]; i = (i + 1) & (N - 1))
+        if ((uint32_t)(uintptr_t)ptrs[i] == p)
+          return i;
+      return -1;
+    }
+
+    void add(RefObject *p, uint8_t v)
+    {
+      int i = slot((uint32_t)(uintptr_t)p);
+      while (ptrs[i])
+        i = (i + 1) & (N - 1);
+      ptrs[i] = p;
+      vals[i] = v;
+      count++;
+    }
+
+    void remove(uint32_t p)
+    {
+      int i = find(p);
+      if (i < 0)
+        return;
+      ptrs[i] = NULL;
+      count--;
+      // move back entries that would no longer be found past the hole
+      for (int j = (i + 1) & (N - 1); ptrs[j]; j = (j + 1) & (N - 1)) {
+        int k = slot((uint32_t)(uintptr_t)ptrs[j]);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+          continue;
+        ptrs[i] = ptrs[j];
+        vals[i] = vals[j];
+        ptrs[j] = NULL;
+        i = j;
+      }
+    }
+
+    void clear()
+    {
+      memset(ptrs, 0, sizeof(ptrs));
+      count = 0;
+    }
+  };
+
+  static PtrSet<GC_ROOTS_TABLE> gcRoots;
+  static PtrSet<GC_INDEX_TABLE> gcIndex;     // object -> its index in gcObjects
+  static RefObject *gcObjects[GC_MAX_OBJECTS];
+  static int16_t gcTrial[GC_MAX_OBJECTS];
+  static uint8_t gcLive[GC_MAX_OBJECTS];
+  static uint8_t gcStack[GC_MAX_OBJECTS];
+  static int gcCount;
+  static bool gcCollecting;
+
+  bool CycleCollector::pending;
+  uint32_t CycleCollector::threshold = 0xffffffff;
+  uint32_t CycleCollector::lastPauseUs;
+  uint32_t CycleCollector::freed;
+  uint32_t CycleCollector::rootsDropped;
+
+  void CycleCollector::possibleRoot(RefObject *p)
+  {
+    if (gcRoots.find((uint32_t)(uintptr_t)p) >= 0)
+      return;
+    int n;
+    p->refs(&n);
+    if (n == 0)
+      return;
+    if (gcRoots.count >= GC_MAX_ROOTS) {
+      // Too many decrements between two allocations; a cycle rooted here
+      // is only found if it is decremented again.
+      rootsDropped++;
+      return;
+    }
+    gcRoots.add(p, 0);
+    if (gcRoots.count >= GC_ROOTS_TRIGGER)
+      pending = true;
+  }
+
+  void CycleCollector::forget(RefObject *p)
+  {
+    if (gcRoots.count)
+      gcRoots.remove((uint32_t)(uintptr_t)p);
+  }
+
+  static void gcGather(uint32_t e)
+  {
+    if (!e || !hasVTable(e) || gcCount >= GC_MAX_OBJECTS ||
+        gcIndex.find(e) >= 0)
+      return;
+    RefObject *p = (RefObject*)e;
+    int n;
+    p->refs(&n);
+    if (n == 0 || n > GC_MAX_EDGES)
+      return;
+    gcIndex.add(p, gcCount);
+    gcObjects[gcCount++] = p;
+  }
+
+  // Index in gcObjects, or -1.
+  static inline int gcFind(uint32_t e)
+  {
+    int i = gcIndex.find(e);
+    return i < 0 ? -1 : gcIndex.vals[i];
+  }
+
+  int CycleCollector::collect()
+  {
+    DEFERRED_DECR_FLUSH(); // the ref-counts have to be exact
+    pending = false;
+    if (gcCollecting || gcRoots.count == 0)
+      return 0;
+    gcCollecting = true;
+    uint32_t start = us_ticker_read();
+
+    // Roots that do not fit this time are kept for the next collection.
+    RefObject *left[GC_MAX_ROOTS];
+    int numLeft = 0;
+    gcCount = 0;
+    gcIndex.clear();
+    for (int i = 0; i < GC_ROOTS_TABLE; ++i) {
+      if (!gcRoots.ptrs[i])
+        continue;
+      if (gcCount < GC_MAX_OBJECTS)
+        gcGather((uint32_t)(uintptr_t)gcRoots.ptrs[i]);
+      else
+        left[numLeft++] = gcRoots.ptrs[i];
+    }
+    gcRoots.clear();
+    for (int i = 0; i < numLeft; ++i)
+      gcRoots.add(left[i], 0);
+    for (int i = 0; i < gcCount; ++i) {
+      int n;
+      uint32_t *refs = gcObjects[i]->refs(&n);
+      for (int j = 0; j < n; ++j)
+        gcGather(refs[j]);
+    }
+
+    for (int i = 0; i < gcCount; ++i) {
+      gcTrial[i] = gcObjects[i]->refcnt;
+      gcLive[i] = 0;
+    }
+    for (int i = 0; i < gcCount; ++i) {
+      int n;
+      uint32_t *refs = gcObjects[i]->refs(&n);
+      for (int j = 0; j < n; ++j) {
+        int k = gcFind(refs[j]);
+        if (k >= 0)
+          gcTrial[k]--;
+      }
+    }
+
+    for (int i = 0; i < gcCount; ++i) {
+      if (gcTrial[i] <= 0 || gcLive[i])
+        continue;
+      int sp = 0;
+      gcLive[i] = 1;
+      gcStack[sp++] = i;
+      while (sp > 0) {
+        int n;
+        uint32_t *refs = gcObjects[gcStack[--sp]]->refs(&n);
+        for (int j = 0; j < n; ++j) {
+          int k = gcFind(refs[j]);
+          if (k >= 0 && !gcLive[k]) {
+            gcLive[k] = 1;
+            gcStack[sp++] = k;
+          }
+        }
+      }
+    }
+
+    // Nothing outside the garbage references it, so once the references
+    // between garbage objects are gone, the destructors only decr() objects
+    // that stay alive or are not part of the subgraph.
+    for (int i = 0; i < gcCount; ++i) {
+      if (gcLive[i])
+        continue;
+      int n;
+      uint32_t *refs = gcObjects[i]->refs(&n);
+      for (int j = 0; j < n; ++j) {
+        int k = gcFind(refs[j]);
+        if (k >= 0 && !gcLive[k])
+          refs[j] = 0;
+      }
+    }
+    int count = 0;
+    for (int i = 0; i < gcCount; ++i) {
+      if (gcLive[i])
+        continue;
+      gcObjects[i]->refcnt = 1;
+      gcObjects[i]->unref();
+      count++;
+    }
+
+    freed += count;
+    lastPauseUs = us_ticker_read() - start;
+    gcCollecting = false;
+    return count;
+  }
+
+  static int gcInterval;
+  static bool gcTimerRunning;
+
+  static void gcTimer()
+  {
+    while (gcInterval > 0) {
+      uBit.sleep(gcInterval);
+      // collected at the next allocation, where no shim is half-way through
+      // updating a reference
+      CycleCollector::pending = true;
+    }
+    gcTimerRunning = false;
+  }
+#endif
+
+  // The opt-in cycle collector; all of these do nothing unless built with
+  // BITVM_CYCLE_COLLECTOR.
+  namespace gc {
+    // Collect now; returns the number of objects freed.
+    int collect()
+    {
+#ifdef BITVM_CYCLE_COLLECTOR
+      return CycleCollector::collect();
+#else
+      return 0;
+#endif
+    }
+
+    // Collect at every allocation while more than [bytes] are in use (see
+    // HeapStats); 0 turns it off.
+    void setThreshold(int bytes)
+    {
+#ifdef BITVM_CYCLE_COLLECTOR
+      CycleCollector::threshold = bytes > 0 ? bytes : 0xffffffff;
+#endif
+    }
+
+    // Collect every [ms] milliseconds; 0 turns it off.
+    void setInterval(int ms)
+    {
+#ifdef BITVM_CYCLE_COLLECTOR
+      gcInterval = ms;
+      if (ms > 0 && !gcTimerRunning) {
+        gcTimerRunning = true;
+        create_fiber(gcTimer);
+      }
+#endif
+    }
+
+    // Duration of the last collection, in microseconds.
+    int lastPause()
+    {
+#ifdef BITVM_CYCLE_COLLECTOR
+      return CycleCollector::lastPauseUs;
+#else
+      return 0;
+#endif
+    }
+
+    // Objects freed by the collector so far.
+    int freed()
+    {
+#ifdef BITVM_CYCLE_COLLECTOR
+      return CycleCollector::freed;
+#else
+      return 0;
+#endif
+    }
+  }
+
   namespace bitvm_number {
     void post_to_wall(int n) { printf("%d\n", n); }
 
@@ -240,32 +714,56 @@ namespace bitvm {
   // The proper StringData* representation is already laid out in memory by the code generator.
   uint32_t stringData(uint32_t lit)
   {
-    return (uint32_t)getstr(lit);
+    return (uint32_t)(uintptr_t)getstr(lit);
   }
 
 
   namespace collection {
 
+    // Flags 1 and 2 (refs, strings) do not go with the typed collections.
     RefCollection *mk(uint32_t flags)
     {
-      RefCollection *r = new RefCollection(flags);
+      GC_SAFE_POINT();
+      int type = (flags & COLLECTION_TYPE_MASK) >> BITVM_COLLECTION_TYPE_SHIFT;
+      RefCollection *r;
+      if (type == 0 || type == NUMBER_FORMAT_INT32) {
+        r = new RefCollection(flags & ~COLLECTION_TYPE_MASK);
+      } else {
+        check(type <= BITVM_COLLECTION_BITS && !(flags & 3), ERR_SIZE, 4);
+        r = new RefTypedCollection(flags);
+      }
+      HEAP_SITE(r);
       return r;
     }
 
-    int count(RefCollection *c) { return c->data.size(); }
+    static inline RefTypedCollection *typed(RefCollection *c) {
+      return (c->flags & COLLECTION_TYPE_MASK) ? (RefTypedCollection*)c : NULL;
+    }
+
+    int count(RefCollection *c) {
+      if (RefTypedCollection *t = typed(c))
+        return t->length;
+      return c->size();
+    }
 
     void add(RefCollection *c, uint32_t x) {
+      if (RefTypedCollection *t = typed(c)) {
+        t->push(x);
+        return;
+      }
       if (c->flags & 1) incr(x);
       c->data.push_back(x);
     }
 
     inline bool in_range(RefCollection *c, int x) {
-      return (0 <= x && x < (int)c->data.size());
+      return (0 <= x && x < count(c));
     }
 
     uint32_t at(RefCollection *c, int x) {
       if (in_range(c, x)) {
-        uint32_t tmp = c->data.at(x);
+        if (RefTypedCollection *t = typed(c))
+          return t->get(x);
+        uint32_t tmp = c->item(x);
         if (c->flags & 1) incr(tmp);
         return tmp;
       }
@@ -279,35 +777,86 @@ namespace bitvm {
       if (!in_range(c, x))
         return;
 
-      if (c->flags & 1) decr(c->data.at(x));
-      c->data.erase(c->data.begin()+x);
+      if (RefTypedCollection *t = typed(c)) {
+        t->erase(x);
+        return;
+      }
+      if (c->flags & 1) decr(c->item(x));
+      c->erase(x);
+    }
+
+    // Adding at index count(c) appends.
+    void insert_at(RefCollection *c, int x, uint32_t y) {
+      if (x != count(c) && !in_range(c, x))
+        return;
+
+      if (RefTypedCollection *t = typed(c)) {
+        t->insert(x, y);
+        return;
+      }
+      if (c->flags & 1) incr(y);
+      c->insert(x, y);
+    }
+
+    // Remove and return the first (last) element; O(1) at either end, so
+    // that a collection can be used as a queue. The reference held by the
+    // collection passes on to the caller.
+    static uint32_t pop_at(RefCollection *c, int x) {
+      if (!in_range(c, x)) {
+        error(ERR_OUT_OF_BOUNDS);
+        return 0;
+      }
+      if (RefTypedCollection *t = typed(c)) {
+        int v = t->get(x);
+        t->erase(x);
+        return v;
+      }
+      uint32_t v = c->item(x);
+      c->erase(x);
+      return v;
+    }
+
+    uint32_t pop_first(RefCollection *c) {
+      return pop_at(c, 0);
+    }
+
+    uint32_t pop_last(RefCollection *c) {
+      return pop_at(c, count(c) - 1);
     }
 
     void set_at(RefCollection *c, int x, uint32_t y) {
       if (!in_range(c, x))
         return;
 
+      if (RefTypedCollection *t = typed(c)) {
+        t->set(x, y);
+        return;
+      }
       if (c->flags & 1) {
-        decr(c->data.at(x));
+        decr(c->item(x));
         incr(y);
       }
-      c->data.at(x) = y;
+      c->item(x) = y;
     }
 
     int index_of(RefCollection *c, uint32_t x, int start) {
       if (!in_range(c, start))
         return -1;
 
-      if (c->flags & 2) {
+      if (RefTypedCollection *t = typed(c)) {
+        for (uint32_t i = start; i < t->length; ++i)
+          if (t->get(i) == (int)x)
+            return (int)i;
+      } else if (c->flags & 2) {
         StringData *xx = (StringData*)x;
-        for (uint32_t i = start; i < c->data.size(); ++i) {
-          StringData *ee = (StringData*)c->data.at(i);
+        for (uint32_t i = start; i < c->size(); ++i) {
+          StringData *ee = (StringData*)c->item(i);
           if (xx->len == ee->len && memcmp(xx->data, ee->data, xx->len) == 0)
             return (int)i;
         }
       } else {
-        for (uint32_t i = start; i < c->data.size(); ++i)
-          if (c->data.at(i) == x)
+        for (uint32_t i = start; i < c->size(); ++i)
+          if (c->item(i) == x)
             return (int)i;
       }
 
@@ -323,47 +872,266 @@ namespace bitvm {
 
       return 0;
     }
+
+    // -------------------------------------------------------------------------
+    // Bulk operations; these move elements around without touching their
+    // ref-counts, and incr() only what ends up referenced twice.
+    // -------------------------------------------------------------------------
+
+    static inline int numberAt(RefCollection *c, int i) {
+      if (RefTypedCollection *t = typed(c))
+        return t->get(i);
+      return c->item(i);
+    }
+
+    static inline bool sameKind(RefCollection *a, RefCollection *b) {
+      return (a->flags & (COLLECTION_TYPE_MASK | 3)) == (b->flags & (COLLECTION_TYPE_MASK | 3));
+    }
+
+    static int compareStrings(uint32_t a, uint32_t b) {
+      StringData *x = (StringData*)a, *y = (StringData*)b;
+      int r = memcmp(x->data, y->data, min(x->len, y->len));
+      return r ? r : x->len - y->len;
+    }
+
+    static bool lessStrings(uint32_t a, uint32_t b) {
+      return compareStrings(a, b) < 0;
+    }
+
+    static bool lessNumbers(uint32_t a, uint32_t b) {
+      return (int)a < (int)b;
+    }
+
+    // Typed collections are unpacked, worked on as words, and packed again.
+    static void unpack(RefTypedCollection *t, std::vector<uint32_t>& out) {
+      out.resize(t->length);
+      for (uint32_t i = 0; i < t->length; ++i)
+        out[i] = t->get(i);
+    }
+
+    static void pack(RefTypedCollection *t, std::vector<uint32_t>& in) {
+      for (uint32_t i = 0; i < t->length; ++i)
+        t->set(i, in[i]);
+    }
+
+    // Sorts numbers, or strings (by bytes) in a collection of strings.
+    void sort(RefCollection *c) {
+      if (RefTypedCollection *t = typed(c)) {
+        std::vector<uint32_t> tmp;
+        unpack(t, tmp);
+        std::sort(tmp.begin(), tmp.end(), lessNumbers);
+        pack(t, tmp);
+        return;
+      }
+      check(!(c->flags & 1) || (c->flags & 2), ERR_SIZE, 5);
+      std::sort(c->data.begin() + c->head, c->data.end(), (c->flags & 2) ? lessStrings : lessNumbers);
+    }
+
+    // Stable sort by a number computed from each element by [key]. The
+    // action calling convention passes a single argument, so this takes a
+    // key rather than a comparison; it is also called n times rather than
+    // n log n. The elements are sorted in a snapshot holding a reference to
+    // each, so that the key changing the collection cannot free them.
+    void sort_by(RefCollection *c, uint32_t key) {
+      int n = count(c);
+      bool refs = (c->flags & 1) != 0;
+      std::vector<std::pair<int, uint32_t> > tmp(n);
+      for (int i = 0; i < n; ++i) {
+        uint32_t e = typed(c) ? numberAt(c, i) : c->item(i);
+        if (refs) incr(e);
+        tmp[i].second = e;
+      }
+      ResolvedAction k(key);
+      for (int i = 0; i < n; ++i)
+        tmp[i].first = k.run(tmp[i].second);
+      // the key may have changed the collection
+      if (count(c) != n) {
+        if (refs)
+          for (int i = 0; i < n; ++i)
+            decr(tmp[i].second);
+        error(ERR_SIZE, 6);
+        return;
+      }
+      std::stable_sort(tmp.begin(), tmp.end(),
+        [](const std::pair<int, uint32_t>& a, const std::pair<int, uint32_t>& b) { return a.first < b.first; });
+      // the snapshot's references pass on to the collection
+      RefTypedCollection *t = typed(c);
+      for (int i = 0; i < n; ++i)
+        if (t) t->set(i, tmp[i].second);
+        else {
+          if (refs) decr(c->item(i));
+          c->item(i) = tmp[i].second;
+        }
+    }
+
+    // Index of [x] in a collection sorted by sort(), or -1.
+    int binary_search(RefCollection *c, uint32_t x) {
+      int lo = 0, hi = count(c) - 1;
+      bool strings = (c->flags & 2) != 0;
+      while (lo <= hi) {
+        int mid = (lo + hi) >> 1;
+        uint32_t e = strings ? c->item(mid) : numberAt(c, mid);
+        int cmp = strings ? compareStrings(e, x) : ((int)e < (int)x ? -1 : (int)e > (int)x);
+        if (cmp == 0)
+          return mid;
+        if (cmp < 0)
+          lo = mid + 1;
+        else
+          hi = mid - 1;
+      }
+      return -1;
+    }
+
+    void reverse(RefCollection *c) {
+      if (RefTypedCollection *t = typed(c)) {
+        for (int i = 0, j = t->length - 1; i < j; ++i, --j) {
+          int v = t->get(i);
+          t->set(i, t->get(j));
+          t->set(j, v);
+        }
+        return;
+      }
+      std::reverse(c->data.begin() + c->head, c->data.end());
+    }
+
+    // A new collection of the same kind with elements [start, end).
+    RefCollection *slice(RefCollection *c, int start, int end) {
+      int n = count(c);
+      start = max(0, min(start, n));
+      end = max(start, min(end, n));
+      RefCollection *r = mk(c->flags);
+      if (RefTypedCollection *t = typed(r)) {
+        for (int i = start; i < end; ++i)
+          t->push(numberAt(c, i));
+        return r;
+      }
+      r->data.assign(c->data.begin() + c->head + start, c->data.begin() + c->head + end);
+      if (c->flags & 1)
+        for (uint32_t i = 0; i < r->data.size(); ++i)
+          incr(r->data[i]);
+      return r;
+    }
+
+    // Overwrites [len] elements of [dst] from [dstOff] with those of [src]
+    // from [srcOff]; the ranges may overlap.
+    void copy_range(RefCollection *dst, int dstOff, RefCollection *src, int srcOff, int len) {
+      check(sameKind(dst, src), ERR_SIZE, 7);
+      if (len <= 0)
+        return;
+      if (dstOff < 0 || srcOff < 0 || dstOff + len > count(dst) || srcOff + len > count(src)) {
+        error(ERR_OUT_OF_BOUNDS);
+        return;
+      }
+
+      if (RefTypedCollection *d = typed(dst)) {
+        RefTypedCollection *s = typed(src);
+        std::vector<uint32_t> tmp(len);
+        for (int i = 0; i < len; ++i)
+          tmp[i] = s->get(srcOff + i);
+        for (int i = 0; i < len; ++i)
+          d->set(dstOff + i, tmp[i]);
+        return;
+      }
+
+      // incr() the new ones before decr()ing the old ones, which may be the
+      // same objects
+      if (src->flags & 1)
+        for (int i = 0; i < len; ++i)
+          incr(src->item(srcOff + i));
+      if (dst->flags & 1)
+        for (int i = 0; i < len; ++i)
+          decr(dst->item(dstOff + i));
+      memmove(&dst->item(dstOff), &src->item(srcOff), len * sizeof(uint32_t));
+    }
+
+    int sum(RefCollection *c) {
+      check(!(c->flags & 1), ERR_SIZE, 5);
+      int r = 0, n = count(c);
+      for (int i = 0; i < n; ++i)
+        r += numberAt(c, i);
+      return r;
+    }
+
+    // The smallest (largest) number; 0 for an empty collection.
+    int minimum(RefCollection *c) {
+      check(!(c->flags & 1), ERR_SIZE, 5);
+      int n = count(c);
+      int r = n ? numberAt(c, 0) : 0;
+      for (int i = 1; i < n; ++i)
+        r = min(r, numberAt(c, i));
+      return r;
+    }
+
+    int maximum(RefCollection *c) {
+      check(!(c->flags & 1), ERR_SIZE, 5);
+      int n = count(c);
+      int r = n ? numberAt(c, 0) : 0;
+      for (int i = 1; i < n; ++i)
+        r = max(r, numberAt(c, i));
+      return r;
+    }
+
+    // Appends [n] numbers from math::random([bound]).
+    void add_random(RefCollection *c, int n, int bound) {
+      check(!(c->flags & 1), ERR_SIZE, 5);
+      if (RefTypedCollection *t = typed(c)) {
+        for (int i = 0; i < n; ++i)
+          t->push(touch_develop::math::random(bound));
+        return;
+      }
+      for (int i = 0; i < n; ++i)
+        c->data.push_back(touch_develop::math::random(bound));
+    }
   }
 
+
   namespace buffer {
 
     RefBuffer *mk(uint32_t size)
     {
+      GC_SAFE_POINT();
       RefBuffer *r = new RefBuffer();
+      HEAP_SITE(r);
       r->data.resize(size);
       return r;
     }
 
     char *cptr(RefBuffer *c)
     {
-      return (char*)&c->data[0];
+      return (char*)c->ptr();
     }
 
-    int count(RefBuffer *c) { return c->data.size(); }
+    int count(RefBuffer *c) { return c->size(); }
 
     void fill(RefBuffer *c, int v)
     {
       memset(cptr(c), v, count(c));
     }
 
+    // A word at a time, from the generator behind math::random().
     void fill_random(RefBuffer *c)
     {
       int len = count(c);
-      for (int i = 0; i < len; ++i)
-        c->data[i] = uBit.random(0x100);
+      uint8_t *p = c->ptr();
+      for (int i = 0; i < len; i += 4) {
+        uint32_t v = touch_develop::math::random_bits();
+        memcpy(p + i, &v, min(4, len - i));
+      }
     }
 
+    // Views have a fixed size.
     void add(RefBuffer *c, uint32_t x) {
+      check(!c->isView, ERR_SIZE, 8);
       c->data.push_back(x);
     }
 
     inline bool in_range(RefBuffer *c, int x) {
-      return (0 <= x && x < (int)c->data.size());
+      return (0 <= x && x < count(c));
     }
 
     uint32_t at(RefBuffer *c, int x) {
       if (in_range(c, x)) {
-        return c->data[x];
+        return c->ptr()[x];
       }
       else {
         error(ERR_OUT_OF_BOUNDS);
@@ -374,7 +1142,178 @@ namespace bitvm {
     void set(RefBuffer *c, int x, uint32_t y) {
       if (!in_range(c, x))
         return;
-      c->data[x] = y;
+      c->ptr()[x] = y;
+    }
+
+    static int formatSize(int format)
+    {
+      switch (format & ~BITVM_NUMBER_FORMAT_BIG_ENDIAN) {
+        case NUMBER_FORMAT_INT8:
+        case NUMBER_FORMAT_UINT8:
+          return 1;
+        case NUMBER_FORMAT_INT16:
+        case NUMBER_FORMAT_UINT16:
+          return 2;
+        case NUMBER_FORMAT_INT32:
+          return 4;
+        default:
+          error(ERR_SIZE, 3);
+          return 0;
+      }
+    }
+
+    // Whether [n] numbers in [format] fit from [off] on; off + n * size
+    // could overflow, hence the division.
+    static bool fits(RefBuffer *c, int format, int off, int n = 1) {
+      int size = formatSize(format);
+      return n >= 0 && 0 <= off && off <= count(c) && n <= (count(c) - off) / size;
+    }
+
+    // Numbers may sit at any offset, and the Cortex-M0 does not do unaligned
+    // loads, hence the memcpy()s below.
+    static int readNumber(const uint8_t *p, int format)
+    {
+      bool be = format & BITVM_NUMBER_FORMAT_BIG_ENDIAN;
+      switch (format & ~BITVM_NUMBER_FORMAT_BIG_ENDIAN) {
+        case NUMBER_FORMAT_INT8:
+          return (int8_t)*p;
+        case NUMBER_FORMAT_UINT8:
+          return *p;
+        case NUMBER_FORMAT_INT16: {
+          uint16_t v;
+          memcpy(&v, p, 2);
+          return (int16_t)(be ? __builtin_bswap16(v) : v);
+        }
+        case NUMBER_FORMAT_UINT16: {
+          uint16_t v;
+          memcpy(&v, p, 2);
+          return be ? __builtin_bswap16(v) : v;
+        }
+        default: {
+          uint32_t v;
+          memcpy(&v, p, 4);
+          return be ? __builtin_bswap32(v) : v;
+        }
+      }
+    }
+
+    static void writeNumber(uint8_t *p, int format, int value)
+    {
+      int size = formatSize(format);
+      uint32_t v = value;
+      if (format & BITVM_NUMBER_FORMAT_BIG_ENDIAN)
+        v = __builtin_bswap32(v) >> (32 - 8 * size);
+      memcpy(p, &v, size);
+    }
+
+    int get_number(RefBuffer *c, int format, int off)
+    {
+      if (!fits(c, format, off)) {
+        error(ERR_OUT_OF_BOUNDS);
+        return 0;
+      }
+      return readNumber(c->ptr() + off, format);
+    }
+
+    void set_number(RefBuffer *c, int format, int off, int value)
+    {
+      if (!fits(c, format, off))
+        return;
+      writeNumber(c->ptr() + off, format, value);
+    }
+
+    // Reads [n] consecutive numbers from [off] on into a new collection of
+    // numbers, in one call instead of [n].
+    RefCollection *get_numbers(RefBuffer *c, int format, int off, int n)
+    {
+      int size = formatSize(format);
+      check(fits(c, format, off, n), ERR_OUT_OF_BOUNDS, 12);
+      RefCollection *r = collection::mk(0);
+      r->data.resize(n);
+      const uint8_t *p = c->ptr() + off;
+      if (format == NUMBER_FORMAT_INT32 && n > 0) {
+        memcpy(&r->data[0], p, n * 4);
+      } else {
+        for (int i = 0; i < n; ++i, p += size)
+          r->data[i] = readNumber(p, format);
+      }
+      return r;
+    }
+
+    // Writes the numbers in [nums] from [off] on; the reverse of
+    // get_numbers().
+    void set_numbers(RefBuffer *c, int format, int off, RefCollection *nums)
+    {
+      int size = formatSize(format);
+      int n = collection::count(nums);
+      check(!(nums->flags & 3), ERR_SIZE, 9);
+      check(fits(c, format, off, n), ERR_OUT_OF_BOUNDS, 13);
+      uint8_t *p = c->ptr() + off;
+      for (int i = 0; i < n; ++i, p += size)
+        writeNumber(p, format, collection::numberAt(nums, i));
+    }
+
+    // A view of [length] bytes from [start], clamped to the buffer; nothing
+    // is copied, and the view can go anywhere a buffer can.
+    RefBuffer *slice(RefBuffer *c, int start, int length)
+    {
+      GC_SAFE_POINT();
+      int n = count(c);
+      start = max(0, min(start, n));
+      length = max(0, min(length, n - start));
+      RefBuffer *parent = c;
+      if (c->isView) {
+        parent = ((RefBufferView*)c)->parent;
+        start += ((RefBufferView*)c)->offset;
+      }
+      RefBuffer *r = new RefBufferView(parent, start, length);
+      HEAP_SITE(r);
+      return r;
+    }
+
+    // Copies [length] bytes from [src] to [dst] within the buffer; the
+    // ranges may overlap.
+    void copy_within(RefBuffer *c, int dst, int src, int length)
+    {
+      int n = count(c);
+      if (length <= 0)
+        return;
+      if (src < 0 || dst < 0 || src + length > n || dst + length > n) {
+        error(ERR_OUT_OF_BOUNDS);
+        return;
+      }
+      memmove(c->ptr() + dst, c->ptr() + src, length);
+    }
+
+    // Moves the bytes [offset] places towards the start (the end, if
+    // negative), filling in with zeros.
+    void shift(RefBuffer *c, int offset)
+    {
+      int n = count(c);
+      uint8_t *p = c->ptr();
+      if (offset >= n || -offset >= n) {
+        memset(p, 0, n);
+      } else if (offset > 0) {
+        memmove(p, p + offset, n - offset);
+        memset(p + n - offset, 0, offset);
+      } else if (offset < 0) {
+        memmove(p - offset, p, n + offset);
+        memset(p, 0, -offset);
+      }
+    }
+
+    // Like shift(), but the bytes going out at one end come back in at the
+    // other.
+    void rotate(RefBuffer *c, int offset)
+    {
+      int n = count(c);
+      if (n == 0)
+        return;
+      offset %= n;
+      if (offset < 0)
+        offset += n;
+      uint8_t *p = c->ptr();
+      std::rotate(p, p + offset, p + n);
     }
   }
 
@@ -391,8 +1330,11 @@ namespace bitvm {
       check(0 <= reflen && reflen <= totallen, ERR_SIZE, 1);
       check(reflen <= totallen && totallen <= 255, ERR_SIZE, 2);
 
+      GC_SAFE_POINT();
       void *ptr = ::operator new(sizeof(RefRecord) + totallen * sizeof(uint32_t));
       RefRecord *r = new (ptr) RefRecord();
+      heapAlloc(HEAP_RECORD, sizeof(RefRecord) + totallen * sizeof(uint32_t));
+      HEAP_SITE(r);
       r->len = totallen;
       r->reflen = reflen;
       memset(r->fields, 0, r->len * sizeof(uint32_t));
@@ -410,31 +1352,34 @@ namespace bitvm {
       check(bytecode[startptr] == 0xffff, ERR_INVALID_BINARY_HEADER, 3);
       check(bytecode[startptr + 1] == 0, ERR_INVALID_BINARY_HEADER, 4);
 
-
-      uint32_t tmp = (uint32_t)&bytecode[startptr];
+      uint32_t tmp = (uint32_t)(uintptr_t)&bytecode[startptr];
 
       if (totallen == 0) {
         return tmp; // no closure needed
       }
 
+      GC_SAFE_POINT();
       void *ptr = ::operator new(sizeof(RefAction) + totallen * sizeof(uint32_t));
       RefAction *r = new (ptr) RefAction();
+      heapAlloc(HEAP_ACTION, sizeof(RefAction) + totallen * sizeof(uint32_t));
+      HEAP_SITE(r);
       r->len = totallen;
       r->reflen = reflen;
       r->func = (ActionCB)((tmp + 4) | 1);
       memset(r->fields, 0, r->len * sizeof(uint32_t));
 
-      return (Action)r;
+      return (Action)(uintptr_t)r;
     }
 
+    // Actions only come from mk() above, which has already checked the
+    // header. The caller holds a reference to [a] (as per the calling
+    // convention), so the closure is not ref()ed around the call either.
     void run1(Action a, int arg)
     {
       if (hasVTable(a))
-        ((RefAction*)a)->run(arg);
-      else {
-        check(*(uint16_t*)a == 0xffff, ERR_INVALID_BINARY_HEADER, 4);
+        ((RefAction*)a)->call(arg);
+      else
         ((ActionCB)((a + 4) | 1))(NULL, NULL, arg);
-      }
     }
 
     void run(Action a)
@@ -443,6 +1388,298 @@ namespace bitvm {
     }
   }
 
+  ResolvedAction::ResolvedAction(uint32_t a)
+  {
+    if (hasVTable(a)) {
+      clo = (RefAction*)a;
+      func = clo->func;
+    } else {
+      check(*(uint16_t*)a == 0xffff, ERR_INVALID_BINARY_HEADER, 5);
+      clo = NULL;
+      func = (ActionCB)((a + 4) | 1);
+    }
+  }
+
+
+  // ---------------------------------------------------------------------------
+  // Filters
+  // ---------------------------------------------------------------------------
+
+  void RefFilter::reset()
+  {
+    count = 0;
+    head = 0;
+    state = 0;
+    sum = 0;
+  }
+
+  // No % below: the Cortex-M0 has no divide instruction.
+  void RefFilter::push(int x)
+  {
+    switch (kind) {
+      case FILTER_AVERAGE:
+        // [head] is where the next sample goes, and once the window is
+        // full, the oldest one
+        if (count == n)
+          sum -= (uint32_t)window[head];
+        else
+          count++;
+        window[head] = x;
+        sum += (uint32_t)x;
+        if (++head == n)
+          head = 0;
+        break;
+
+      case FILTER_MEDIAN: {
+        int32_t *sorted = window + n;
+        int len = count;
+        if (count == n) {
+          int i = std::lower_bound(sorted, sorted + len, window[head]) - sorted;
+          memmove(sorted + i, sorted + i + 1, (len - i - 1) * sizeof(int32_t));
+          len--;
+        } else {
+          count++;
+        }
+        window[head] = x;
+        if (++head == n)
+          head = 0;
+        int j = std::upper_bound(sorted, sorted + len, x) - sorted;
+        memmove(sorted + j + 1, sorted + j, (len - j) * sizeof(int32_t));
+        sorted[j] = x;
+        break;
+      }
+
+      // A deque of the samples that can still become the minimum (maximum):
+      // each is smaller (larger) than all the ones after it, so the front is
+      // the answer. Every sample goes in and out once, hence O(1) amortized.
+      case FILTER_MIN:
+      case FILTER_MAX: {
+        uint32_t *seqs = (uint32_t*)window + n;
+        uint32_t seq = sum++;
+        if (count > 0 && seq - seqs[head] >= n) {
+          if (++head == n)
+            head = 0;
+          count--;
+        }
+        while (count > 0) {
+          int back = head + count - 1;
+          if (back >= n)
+            back -= n;
+          if (kind == FILTER_MIN ? window[back] < x : window[back] > x)
+            break;
+          count--;
+        }
+        int pos = head + count;
+        if (pos >= n)
+          pos -= n;
+        window[pos] = x;
+        seqs[pos] = seq;
+        count++;
+        break;
+      }
+
+      case FILTER_EMA:
+        if (count == 0) {
+          state = x * 256;
+          count = 1;
+        } else {
+          state += (x * 256 - state) >> n;
+        }
+        break;
+
+      case FILTER_HYSTERESIS:
+        if (x > hi)
+          state = 1;
+        else if (x < lo)
+          state = 0;
+        break;
+    }
+  }
+
+  // [s] / [count], rounded towards zero like the / it replaces: a shift
+  // when [count] is a power of two, as it is for the usual window sizes,
+  // and otherwise a 32-bit division, which the Cortex-M0 does in software.
+  static int divide(int32_t s, int count)
+  {
+    if (count & (count - 1))
+      return s / count;
+    int shift = 0;
+    while ((1 << shift) < count)
+      shift++;
+    if (s < 0)
+      s += count - 1;
+    return s >> shift;
+  }
+
+  // The mean of [a] and [b], rounded towards zero, without overflowing.
+  static int midpoint(int32_t a, int32_t b)
+  {
+    int32_t m = (a >> 1) + (b >> 1) + (a & b & 1);
+    if (m < 0 && ((a ^ b) & 1))
+      m++;
+    return m;
+  }
+
+  int RefFilter::value()
+  {
+    if (count == 0 && kind != FILTER_HYSTERESIS)
+      return 0;
+    switch (kind) {
+      case FILTER_AVERAGE:
+        return divide((int32_t)sum, count);
+      case FILTER_MEDIAN: {
+        int32_t *sorted = window + n;
+        if (count & 1)
+          return sorted[count / 2];
+        return midpoint(sorted[count / 2 - 1], sorted[count / 2]);
+      }
+      case FILTER_MIN:
+      case FILTER_MAX:
+        return window[head];
+      case FILTER_EMA:
+        return (state + 128) >> 8;
+      default:
+        return state;
+    }
+  }
+
+  namespace filter {
+    static RefFilter *mk(int kind, int n)
+    {
+      int smallest = (kind == FILTER_EMA || kind == FILTER_HYSTERESIS) ? 0 : 1;
+      check(smallest <= n && n <= BITVM_FILTER_MAX_WINDOW, ERR_SIZE, 10);
+
+      GC_SAFE_POINT();
+      int size = sizeof(RefFilter) + RefFilter::words(kind, n) * sizeof(int32_t);
+      void *ptr = ::operator new(size);
+      RefFilter *r = new (ptr) RefFilter();
+      heapAlloc(HEAP_FILTER, size);
+      r->kind = kind;
+      r->n = n;
+      r->lo = 0;
+      r->hi = 0;
+      r->reset();
+      return r;
+    }
+
+    // Mean of the last [n] samples, rounded towards zero. Samples should
+    // stay within +-2^23.
+    RefFilter *average(int n)
+    {
+      RefFilter *r = mk(FILTER_AVERAGE, n);
+      HEAP_SITE(r);
+      return r;
+    }
+
+    // Exponential moving average, where each new sample weighs 1/2^[shift].
+    // Samples should stay within +-2^23.
+    RefFilter *ema(int shift)
+    {
+      check(shift <= 16, ERR_SIZE, 10);
+      RefFilter *r = mk(FILTER_EMA, shift);
+      HEAP_SITE(r);
+      return r;
+    }
+
+    // Median of the last [n] samples; the mean of the middle two if even.
+    RefFilter *median(int n)
+    {
+      RefFilter *r = mk(FILTER_MEDIAN, n);
+      HEAP_SITE(r);
+      return r;
+    }
+
+    RefFilter *minimum(int n)
+    {
+      RefFilter *r = mk(FILTER_MIN, n);
+      HEAP_SITE(r);
+      return r;
+    }
+
+    RefFilter *maximum(int n)
+    {
+      RefFilter *r = mk(FILTER_MAX, n);
+      HEAP_SITE(r);
+      return r;
+    }
+
+    // 1 once a sample goes above [hi], 0 once one goes below [lo]; in
+    // between, it stays as it was (0 to begin with).
+    RefFilter *hysteresis(int lo, int hi)
+    {
+      check(lo <= hi, ERR_SIZE, 10);
+      RefFilter *r = mk(FILTER_HYSTERESIS, 0);
+      HEAP_SITE(r);
+      r->lo = lo;
+      r->hi = hi;
+      return r;
+    }
+
+    // Returns the value after the sample.
+    int push(RefFilter *f, int x)
+    {
+      f->push(x);
+      return f->value();
+    }
+
+    int value(RefFilter *f)
+    {
+      return f->value();
+    }
+
+    void reset(RefFilter *f)
+    {
+      f->reset();
+    }
+
+    struct Sampling {
+      RefFilter *filter;
+      Action source;
+      int period;
+    };
+
+    // The fiber holds a reference to the filter, and stops once it is the
+    // only one left.
+    static void sample(void *p)
+    {
+      Sampling *s = (Sampling*)p;
+      ResolvedAction h(s->source);
+      while (true) {
+        DEFERRED_DECR_FLUSH();
+        if (s->filter->refcnt <= 1)
+          break;
+        s->filter->push(h.run(0));
+        uBit.sleep(s->period);
+      }
+    }
+
+    static void samplingDone(void *p)
+    {
+      Sampling *s = (Sampling*)p;
+      decr(s->source);
+      s->filter->unref();
+      delete s;
+      DEFERRED_DECR_FLUSH();
+      release_fiber();
+    }
+
+    // Pushes what [source] returns every [period] ms, in the background,
+    // until the script drops the filter. [source] must not capture the
+    // filter, or it never will be.
+    void attach(RefFilter *f, Action source, int period)
+    {
+      if (source == 0)
+        return;
+      Sampling *s = new Sampling;
+      f->ref();
+      incr(source);
+      s->filter = f;
+      s->source = source;
+      s->period = max(period, 1);
+      PERF_COUNT(PERF_FIBERS);
+      create_fiber(sample, s, samplingDone);
+    }
+  }
 
   // ---------------------------------------------------------------------------
   // Implementation of the BBC micro:bit features
@@ -455,29 +1692,52 @@ namespace bitvm {
     // An adapter for the API expected by the run-time.
     // ---------------------------------------------------------------------------
 
-    map<pair<int, int>, Action> handlersMap;
+    // Handlers are resolved when registered, so that dispatching an event is
+    // a map lookup and a direct call.
+    map<pair<int, int>, ResolvedAction> handlersMap;
+
+    static void runHandler(pair<int, int> k, int arg) {
+      auto it = handlersMap.find(k);
+      if (it == handlersMap.end())
+        return;
+
+      // The handler may register a different one for its own event, dropping
+      // the reference held by the map, so take one for the duration of the
+      // call. Static actions need no such protection.
+      ResolvedAction h = it->second;
+      if (h.clo) {
+        h.clo->ref();
+        h.run(arg);
+        h.clo->unref();
+      } else {
+        h.run(arg);
+      }
+      DEFERRED_DECR_FLUSH();
+    }
 
     // We have the invariant that if [dispatchEvent] is registered against the DAL
     // for a given event, then [handlersMap] contains a valid entry for that
     // event.
     void dispatchEvent(MicroBitEvent e) {
-      Action curr = handlersMap[{ e.source, e.value }];
-      if (curr)
-        action::run(curr);
-
-      curr = handlersMap[{ e.source, MICROBIT_EVT_ANY }];
-      if (curr)
-        action::run1(curr, e.value);
+      PERF_COUNT(PERF_EVENTS);
+      runHandler({ e.source, e.value }, 0);
+      runHandler({ e.source, MICROBIT_EVT_ANY }, e.value);
     }
 
     void registerWithDal(int id, int event, Action a) {
-      Action prev = handlersMap[{ id, event }];
-      if (prev)
-        decr(prev);
-      else
+      ResolvedAction h(a);
+      if (h.clo)
+        h.clo->ref();
+
+      auto it = handlersMap.find({ id, event });
+      if (it != handlersMap.end()) {
+        if (it->second.clo)
+          it->second.clo->unref();
+        it->second = h;
+      } else {
+        handlersMap[{ id, event }] = h;
         uBit.MessageBus.listen(id, event, dispatchEvent);
-      incr(a);
-      handlersMap[{ id, event }] = a;
+      }
     }
 
     void on_event(int id, Action a) {
@@ -564,7 +1824,8 @@ namespace bitvm {
     
     void fiberDone(void *a)
     {
-      decr((Action)a);
+      decr((Action)(uintptr_t)a);
+      DEFERRED_DECR_FLUSH();
       release_fiber();
     }
 
@@ -572,13 +1833,18 @@ namespace bitvm {
     void runInBackground(Action a) {
       if (a != 0) {
         incr(a);
+        PERF_COUNT(PERF_FIBERS);
         create_fiber((void(*)(void*))action::run, (void*)a, fiberDone);
       }
     }
 
+    // The fiber holds a reference to the action for ever, so it can be
+    // resolved once and run without ref-count traffic.
     void forever_stub(void *a) {
+      ResolvedAction h((Action)(uintptr_t)a);
       while (true) {
-        action::run((Action)a);
+        h.run(0);
+        DEFERRED_DECR_FLUSH();
         micro_bit::pause(20);
       }
     }
@@ -586,6 +1852,7 @@ namespace bitvm {
     void forever(Action a) {
       if (a != 0) {
         incr(a);
+        PERF_COUNT(PERF_FIBERS);
         create_fiber(forever_stub, (void*)a);
       }
     }
@@ -594,7 +1861,12 @@ namespace bitvm {
     // Images (helpers that create/modify a MicroBitImage)
     // -------------------------------------------------------------------------
     
-    // Argument rewritten by the code emitter to be what we need
+    // Argument rewritten by the code emitter to be what we need. Scripts
+    // hold the ImageData itself, and the writers (setImagePixel, clearImage,
+    // ...) cannot hand a different one back, so the literal is copied here:
+    // a clone deferred to the first write could not replace the reference
+    // the script keeps. Literals that are never written to can use
+    // createReadOnlyImage(), which costs neither RAM nor a copy.
     ImageData *createImage(uint32_t lit) {
       return MicroBitImage(getbytes(lit)).clone().leakData();
     }
@@ -611,6 +1883,37 @@ namespace bitvm {
     {
       return uBit.display.screenShot().leakData();
     }
+
+    // Copies the display into [i], clipped to the smaller of the two, without
+    // allocating anything. Returns a bitmask of the pixels that differ from
+    // what [i] held before (bit y * width + x; only the first 32 pixels are
+    // reported), so that passing the previous capture gives a frame diff.
+    int displayScreenShotInto(ImageData *i)
+    {
+      if (i->isReadOnly()) return 0;
+
+      MicroBitImage &disp = uBit.display.image;
+      const uint8_t *src = disp.getBitmap();
+      int sw = disp.getWidth();
+      int w = min(sw, i->width);
+      int h = min(disp.getHeight(), i->height);
+      uint32_t changed = 0;
+
+      for (int y = 0; y < h; ++y) {
+        const uint8_t *s = src + y * sw;
+        uint8_t *d = &i->data[y * i->width];
+        for (int x = 0; x < w; ++x) {
+          if (d[x] != s[x]) {
+            int bit = y * i->width + x;
+            if (bit < 32)
+              changed |= 1u << bit;
+            d[x] = s[x];
+          }
+        }
+      }
+
+      return changed;
+    }
     
     ImageData *imageClone(ImageData *i)
     {
@@ -643,6 +1946,140 @@ namespace bitvm {
       return i->isReadOnly();
     }
 
+    // -------------------------------------------------------------------------
+    // Bulk operations working directly on the ImageData bytes. The ones that
+    // modify an image do nothing on read-only (flash) images.
+    // -------------------------------------------------------------------------
+
+    // Copies [src] onto [dst] at (x, y), clipping at the edges; with
+    // [transparent] set, black pixels of [src] leave [dst] as it is.
+    // [dst] may be [src]: rows are then walked bottom-up when moving down,
+    // and pixels right to left when moving right along the same rows, so
+    // that none is read after being overwritten.
+    void blitImage(ImageData *dst, ImageData *src, int x, int y, bool transparent) {
+      if (dst->isReadOnly()) return;
+
+      int x0 = max(0, -x), x1 = min(src->width, dst->width - x);
+      int y0 = max(0, -y), y1 = min(src->height, dst->height - y);
+      if (x0 >= x1 || y0 >= y1) return;
+
+      int n = x1 - x0;
+      bool up = dst == src && y > 0;
+      bool back = dst == src && y == 0 && x > 0;
+      for (int k = y0; k < y1; ++k) {
+        int sy = up ? y1 - 1 - (k - y0) : k;
+        const uint8_t *s = &src->data[sy * src->width + x0];
+        uint8_t *d = &dst->data[(sy + y) * dst->width + x + x0];
+        if (!transparent) {
+          memmove(d, s, n);
+        } else if (back) {
+          for (int j = n - 1; j >= 0; --j)
+            if (s[j]) d[j] = s[j];
+        } else {
+          for (int j = 0; j < n; ++j)
+            if (s[j]) d[j] = s[j];
+        }
+      }
+    }
+
+    // Moves every row [n] pixels right (left if negative); with [wrap] set,
+    // pixels falling off one side come back on the other, otherwise the
+    // vacated ones are cleared.
+    static void moveRows(ImageData *i, int n, bool wrap) {
+      int w = i->width;
+      if (wrap) {
+        n %= w;
+        if (n < 0) n += w;
+        if (n == 0) return;
+      } else if (n >= w || n <= -w) {
+        memset(i->data, 0, w * i->height);
+        return;
+      }
+
+      for (int y = 0; y < i->height; ++y) {
+        uint8_t *row = &i->data[y * w];
+        if (wrap) {
+          std::rotate(row, row + w - n, row + w);
+        } else if (n > 0) {
+          memmove(row + n, row, w - n);
+          memset(row, 0, n);
+        } else if (n < 0) {
+          memmove(row, row - n, w + n);
+          memset(row + w + n, 0, -n);
+        }
+      }
+    }
+
+    // Same as moveRows(), but vertically (down if positive); rows are
+    // contiguous, so this is a single move of the whole bitmap.
+    static void moveColumns(ImageData *i, int n, bool wrap) {
+      int w = i->width, h = i->height;
+      if (wrap) {
+        n %= h;
+        if (n < 0) n += h;
+        if (n == 0) return;
+        std::rotate(i->data, i->data + (h - n) * w, i->data + h * w);
+      } else if (n >= h || n <= -h) {
+        memset(i->data, 0, w * h);
+      } else if (n > 0) {
+        memmove(i->data + n * w, i->data, (h - n) * w);
+        memset(i->data, 0, n * w);
+      } else if (n < 0) {
+        memmove(i->data, i->data - n * w, (h + n) * w);
+        memset(i->data + (h + n) * w, 0, -n * w);
+      }
+    }
+
+    void shiftImage(ImageData *i, int dx, int dy) {
+      if (i->isReadOnly() || i->width == 0 || i->height == 0) return;
+      moveRows(i, dx, false);
+      moveColumns(i, dy, false);
+    }
+
+    void rotateImage(ImageData *i, int dx, int dy) {
+      if (i->isReadOnly() || i->width == 0 || i->height == 0) return;
+      moveRows(i, dx, true);
+      moveColumns(i, dy, true);
+    }
+
+    void invertImage(ImageData *i) {
+      if (i->isReadOnly()) return;
+      for (uint8_t *p = i->data, *e = p + i->width * i->height; p < e; ++p)
+        *p = 255 - *p;
+    }
+
+    void fillImageRect(ImageData *i, int x, int y, int w, int h, int value) {
+      if (i->isReadOnly()) return;
+
+      int x0 = max(0, x), x1 = min(i->width, x + w);
+      int y0 = max(0, y), y1 = min(i->height, y + h);
+      if (x0 >= x1) return;
+      for (int yy = y0; yy < y1; ++yy)
+        memset(&i->data[yy * i->width + x0], value, x1 - x0);
+    }
+
+    bool imageEquals(ImageData *a, ImageData *b) {
+      return a->width == b->width && a->height == b->height &&
+             memcmp(a->data, b->data, a->width * a->height) == 0;
+    }
+
+    // Beyond this, every lit pixel ends up at 255 anyway; it also keeps
+    // percent * 65536 and 255 * f below 2^32.
+    #define IMAGE_MAX_BRIGHTNESS_PERCENT 25600
+
+    // Scales every pixel by [percent], saturating at 255.
+    void scaleImageBrightness(ImageData *i, int percent) {
+      if (i->isReadOnly()) return;
+      if (percent < 0) percent = 0;
+      if (percent > IMAGE_MAX_BRIGHTNESS_PERCENT) percent = IMAGE_MAX_BRIGHTNESS_PERCENT;
+      // multiply-shift instead of dividing by 100 for every pixel
+      uint32_t f = ((uint32_t)percent * 65536 + 50) / 100;
+      for (uint8_t *p = i->data, *e = p + i->width * i->height; p < e; ++p) {
+        uint32_t v = (*p * f) >> 16;
+        *p = v > 255 ? 255 : v;
+      }
+    }
+
     // -------------------------------------------------------------------------
     // Various "show"-style functions to display and scroll things on the screen
     // -------------------------------------------------------------------------
@@ -712,11 +2149,24 @@ namespace bitvm {
     MicroBitPin *ioP19() { return &uBit.io.P19; }
     MicroBitPin *ioP20() { return &uBit.io.P20; }
 
+    // A safe point for the deferred decrements.
+    void pause(int ms)
+    {
+      DEFERRED_DECR_FLUSH();
+      micro_bit::pause(ms);
+    }
+
     void panic(int code)
     {
+      serial_log::flush();
       uBit.panic(code);
     }
 
+    int serialLogDropped()
+    {
+      return serial_log::dropped;
+    }
+
     void serialSendString(StringData *s)
     {
       uBit.serial.sendString(ManagedString(s));
@@ -737,9 +2187,100 @@ namespace bitvm {
       return uBit.serial.readImage(width, height).leakData();
     }
 
+    // Binary frames, see SerialFrames.h; buffers above SERIAL_FRAME_MAX_SIZE
+    // are an error, as the receiving end would drop them.
+    void serialSendFrame(RefBuffer *buf, bool cobs)
+    {
+      if (!serial_frames::send((uint8_t*)buffer::cptr(buf), buffer::count(buf), cobs))
+        error(ERR_SIZE, 11);
+    }
+
+    // Returns NULL if no good frame arrived within [timeout] ms (-1 waits for
+    // ever).
+    RefBuffer *serialReadFrame(bool cobs, int timeout)
+    {
+      RefBuffer *r = buffer::mk(0);
+      if (serial_frames::receive(r->data, cobs, timeout))
+        return r;
+      r->unref();
+      return NULL;
+    }
+
+    int serialFrameErrors()
+    {
+      return serial_frames::errors;
+    }
+
     void serialSendDisplayState() { uBit.serial.sendDisplayState(); }
     void serialReadDisplayState() { uBit.serial.readDisplayState(); }
 
+    // -------------------------------------------------------------------------
+    // Radio datagrams carrying a RefBuffer
+    // -------------------------------------------------------------------------
+
+    // The buffer is handed to the radio as is; its size is checked by the DAL
+    // against the maximum payload.
+    int datagramSendBuffer(RefBuffer *buf)
+    {
+      int r = ::touch_develop::micro_bit::radioEnable();
+      if (r != MICROBIT_OK) return r;
+
+      return uBit.radio.datagram.send((uint8_t*)buffer::cptr(buf), buffer::count(buf));
+    }
+
+    // Pops the next datagram and copies it into [buf], which is not resized;
+    // returns the number of bytes stored, or -1 if there was no datagram.
+    // The RSSI etc. are available via datagramGetRSSI() and friends.
+    int datagramReceiveBuffer(RefBuffer *buf)
+    {
+      if (::touch_develop::micro_bit::datagramPop() < 0) return -1;
+
+      auto &d = ::touch_develop::micro_bit::datagramCurrent;
+      int n = min(buffer::count(buf), d.length);
+      memcpy(buffer::cptr(buf), d.data, n);
+      return n;
+    }
+
+    // -------------------------------------------------------------------------
+    // Reliable transfer of large buffers over the radio
+    // -------------------------------------------------------------------------
+
+    // Blocks until the receiver has acknowledged the whole buffer, or gives up.
+    bool bulkSend(RefBuffer *buf)
+    {
+      return radio_transfer::send((uint8_t*)buffer::cptr(buf), buffer::count(buf));
+    }
+
+    // Returns NULL if nothing arrived within [timeout] ms (-1 waits for ever).
+    RefBuffer *bulkReceive(int timeout)
+    {
+      RefBuffer *r = buffer::mk(0);
+      if (radio_transfer::receive(r->data, timeout))
+        return r;
+      r->unref();
+      return NULL;
+    }
+
+    //  bytes sent = 0, packets sent = 1, retransmissions = 2, acks received = 3,
+    //  packets received = 4, duplicates = 5, transfers ok = 6, failed = 7,
+    //  bytes per second of the last transfer = 8
+    int bulkStat(int which)
+    {
+      radio_transfer::Stats &s = radio_transfer::stats;
+      switch (which) {
+        case 0: return s.bytesSent;
+        case 1: return s.packetsSent;
+        case 2: return s.retransmissions;
+        case 3: return s.acksReceived;
+        case 4: return s.packetsReceived;
+        case 5: return s.duplicates;
+        case 6: return s.transfersOk;
+        case 7: return s.transfersFailed;
+        case 8: return s.lastBytesPerSecond;
+        default: return 0;
+      }
+    }
+
     void i2cReadBuffer(int address, RefBuffer *buf)
     {
       uBit.i2c.read(address << 1, buffer::cptr(buf), buffer::count(buf));
@@ -762,6 +2303,131 @@ namespace bitvm {
   }
 
 
+  // Writes out a line straight away, so that (potentially long) dumps are
+  // never dropped by the serial log.
+  static int dumpLine(const char *fmt, ...)
+  {
+    char buf[SERIAL_LOG_LINE];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    serial_log::write(buf, min(len, (int)sizeof(buf) - 1));
+    serial_log::flush();
+    return len;
+  }
+
+  // Sampling profiler, see Profiler.h
+  namespace profiler {
+    static Histogram *histogram;
+
+    // Start sampling [hz] times a second into a fresh histogram, with buckets
+    // of 2^[shift] bytes of bytecode.
+    void start(int hz, int shift)
+    {
+      check(0 <= shift && shift < 16, ERR_OUT_OF_BOUNDS, 10);
+      stopSampling();
+      delete histogram;
+      histogram = new Histogram(functionsAndBytecode + 4, numShims, (uint32_t)(uintptr_t)bytecode, shift);
+      if (!startSampling(histogram, hz))
+        error(ERR_SIZE, 10);
+    }
+
+    void stop()
+    {
+      stopSampling();
+    }
+
+    void dump()
+    {
+      if (histogram)
+        histogram->dump(dumpLine);
+    }
+
+    int samples()
+    {
+      return histogram ? histogram->samples : 0;
+    }
+  }
+
+
+#ifdef BITVM_PERF_COUNTERS
+  static const char * const perfNames[PERF_COUNTERS] = {
+    "incr", "decr", "alloc_record", "alloc_collection", "alloc_buffer",
+    "alloc_action", "alloc_local", "free", "bytes", "events", "fibers",
+    "alloc_filter",
+  };
+#endif
+
+  // Runtime counters; all read as zero unless built with BITVM_PERF_COUNTERS.
+  namespace perf {
+    int counter(int id)
+    {
+#ifdef BITVM_PERF_COUNTERS
+      if (id == PERF_BYTES)
+        return heapStats.bytes;
+      if (0 <= id && id < PERF_COUNTERS)
+        return perfCounters[id];
+#endif
+      return 0;
+    }
+
+    void reset()
+    {
+#ifdef BITVM_PERF_COUNTERS
+      memset(perfCounters, 0, sizeof(perfCounters));
+#endif
+    }
+
+    void dump()
+    {
+#ifdef BITVM_PERF_COUNTERS
+      for (int i = 0; i < PERF_COUNTERS; ++i)
+        dumpLine("PERF %s %lu\n", perfNames[i], (unsigned long)counter(i));
+#else
+      dumpLine("PERF disabled\n");
+#endif
+    }
+  }
+
+  // Heap usage by RefObjects, see HeapStats.
+  namespace heap {
+    // Number of live objects of a HeapType.
+    int live(int type)
+    {
+      DEFERRED_DECR_FLUSH();
+      if (0 <= type && type < HEAP_TYPES)
+        return heapStats.live[type];
+      return 0;
+    }
+
+    int bytes()
+    {
+      return heapStats.bytes;
+    }
+
+    int peakBytes()
+    {
+      return heapStats.peakBytes;
+    }
+
+    void resetPeak()
+    {
+      heapStats.peakBytes = heapStats.bytes;
+    }
+
+    void dump()
+    {
+      static const char * const names[HEAP_TYPES] = {
+        "record", "collection", "buffer", "action", "local", "filter",
+      };
+      for (int i = 0; i < HEAP_TYPES; ++i)
+        dumpLine("HEAP %s %d\n", names[i], heapStats.live[i]);
+      dumpLine("HEAP bytes %lu peak %lu\n", (unsigned long)heapStats.bytes,
+               (unsigned long)heapStats.peakBytes);
+    }
+  }
+
   void error(ERROR code, int subcode)
   {
     printf("Error: %d [%d]\n", code, subcode);
@@ -824,11 +2490,12 @@ namespace bitvm {
              templateHash() == ((int*)pc)[0],
              ":( Failed partial flash");
 
-    uint32_t startptr = (uint32_t)bytecode;
+    uint32_t startptr = (uint32_t)(uintptr_t)bytecode;
     startptr += 48; // header
     startptr |= 1; // Thumb state
 
     ((uint32_t (*)())startptr)();
+    DEFERRED_DECR_FLUSH();
 
 #ifdef DEBUG_MEMLEAKS
     bitvm::debugMemLeaks();
@@ -862,6 +2529,8 @@ namespace bitvm {
     #include "generated/extpointers.inc"
   };
 
+  const int numShims = sizeof(functionsAndBytecode) / sizeof(uint32_t) - 4;
+
 
 }
 
@@ -0,0 +1,336 @@
+// Typed accessors on buffers: bounds that cannot be got around by
+// overflowing them, and a round trip through every format; then decoding
+// a sensor frame and filling a buffer with random bytes, timed the way
+// scripts did it before and with the new shims; and assembling I2C
+// packets, with the bytes copied and allocated counted. The figures are
+// host nanoseconds.
+
+#include "runtime.h"
+
+#include <time.h>
+
+// Shims, which only the function table refers to.
+namespace bitvm {
+  namespace collection {
+    RefCollection *mk(uint32_t flags);
+    void add(RefCollection *c, uint32_t x);
+    int count(RefCollection *c);
+    uint32_t at(RefCollection *c, int x);
+  }
+  namespace buffer {
+    RefBuffer *mk(uint32_t size);
+    uint32_t at(RefBuffer *c, int x);
+    int get_number(RefBuffer *c, int format, int off);
+    void set_number(RefBuffer *c, int format, int off, int value);
+    RefCollection *get_numbers(RefBuffer *c, int format, int off, int n);
+    void set_numbers(RefBuffer *c, int format, int off, RefCollection *nums);
+    void fill_random(RefBuffer *c);
+    void set(RefBuffer *c, int x, uint32_t y);
+    RefBuffer *slice(RefBuffer *c, int start, int length);
+    void shift(RefBuffer *c, int offset);
+  }
+  namespace bitvm_bits { RefBuffer *create_buffer(int size); }
+  namespace bitvm_micro_bit { void i2cWriteBuffer(int address, RefBuffer *buf); }
+}
+
+using namespace bitvm;
+
+// The DAL's generator: a 32-bit LFSR, stepped once per bit drawn.
+static uint32_t lfsr = 0x1234567;
+
+int MicroBit::random(int max) {
+  uint32_t m, result;
+  max--;
+  do {
+    m = (uint32_t)max;
+    result = 0;
+    do {
+      uint32_t rnd = lfsr;
+      rnd = ((((rnd >> 31) ^ (rnd >> 6) ^ (rnd >> 4) ^ (rnd >> 2) ^ (rnd >> 1) ^ rnd) & 1) << 31) | (rnd >> 1);
+      lfsr = rnd;
+      result = (result << 1) | (rnd & 1);
+    } while (m >>= 1);
+  } while (result > (uint32_t)max);
+  return result;
+}
+
+#define BE(f)   ((f) | BITVM_NUMBER_FORMAT_BIG_ENDIAN)
+
+static bool failedWith(int subcode) {
+  char s[8];
+  snprintf(s, sizeof(s), "[%d]", subcode);
+  return strstr(logged, s) != NULL;
+}
+
+// off + n * size used to be computed as an int: a large [n] or [off]
+// wrapped around and passed the check.
+static void testOverflow() {
+  RefBuffer *b = buffer::mk(16);
+  expectError(buffer::get_numbers(b, NUMBER_FORMAT_INT32, 0, 0x40000001));
+  expect(failedWith(12));
+  expectError(buffer::get_numbers(b, NUMBER_FORMAT_INT16, 4, 0x7ffffffe));
+  expectError(buffer::get_numbers(b, NUMBER_FORMAT_INT8, 0x7fffffff, 1));
+  expectError(buffer::get_numbers(b, NUMBER_FORMAT_INT8, 17, 0));
+  expectError(buffer::get_numbers(b, NUMBER_FORMAT_INT8, 0, -1));
+
+  RefCollection *one = collection::mk(0);
+  collection::add(one, 42);
+  expectError(buffer::set_numbers(b, NUMBER_FORMAT_INT32, 0x7ffffffe, one));
+  expect(failedWith(13));
+  expectError(buffer::set_numbers(b, NUMBER_FORMAT_INT32, 13, one));
+
+  expectError(buffer::get_number(b, NUMBER_FORMAT_INT32, 0x7ffffffe));
+  buffer::set_number(b, NUMBER_FORMAT_INT32, 0x7ffffffe, 1);   // ignored
+
+  // right up to the end is fine
+  buffer::set_numbers(b, NUMBER_FORMAT_INT32, 12, one);
+  expect(buffer::get_number(b, NUMBER_FORMAT_INT32, 12) == 42);
+  RefCollection *r = buffer::get_numbers(b, NUMBER_FORMAT_INT16, 0, 8);
+  expect(collection::count(r) == 8);
+  r->unref();
+  r = buffer::get_numbers(b, NUMBER_FORMAT_INT8, 16, 0);
+  expect(collection::count(r) == 0);
+  r->unref();
+  one->unref();
+  b->unref();
+}
+
+static void testRoundTrip() {
+  static const int formats[] = { NUMBER_FORMAT_INT8, NUMBER_FORMAT_UINT8, NUMBER_FORMAT_INT16,
+    NUMBER_FORMAT_UINT16, NUMBER_FORMAT_INT32 };
+  static const int values[] = { 0, 1, -1, 127, -128, 255, 32767, -32768, 65535, 0x12345678 };
+  static const int sizes[] = { 1, 1, 2, 2, 4 };
+  for (int f = 0; f < 5; ++f)
+    for (int be = 0; be < 2; ++be) {
+      int format = be ? BE(formats[f]) : formats[f];
+      int size = sizes[f];
+      RefBuffer *b = buffer::mk(1 + 10 * size);
+      RefCollection *nums = collection::mk(0);
+      for (int i = 0; i < 10; ++i)
+        collection::add(nums, values[i]);
+      // at an odd offset, as in packed frames
+      buffer::set_numbers(b, format, 1, nums);
+      RefCollection *r = buffer::get_numbers(b, format, 1, 10);
+      for (int i = 0; i < 10; ++i) {
+        // what the format keeps of the value
+        int bits = size * 8;
+        int v = bits == 32 ? values[i] : values[i] & ((1 << bits) - 1);
+        if (bits < 32 && (formats[f] == NUMBER_FORMAT_INT8 || formats[f] == NUMBER_FORMAT_INT16) &&
+            (v & (1 << (bits - 1))))
+          v -= 1 << bits;
+        expect((int)collection::at(r, i) == v);
+        expect(buffer::get_number(b, format, 1 + i * size) == v);
+      }
+      if (be && size > 1)
+        expect(b->ptr()[1 + size - 1] == 0);    // 0 is stored most significant byte first
+      r->unref();
+      nums->unref();
+      b->unref();
+    }
+}
+
+#define ITERATIONS 1000000
+
+static uint64_t nowNs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static volatile int sink;
+
+// An accelerometer frame: x, y and z as big-endian 16-bit numbers.
+static void benchFrameDecode() {
+  RefBuffer *b = buffer::mk(6);
+  static const uint8_t frame[] = { 0xff, 0x38, 0x00, 0x64, 0x03, 0xe8 };
+  memcpy(b->ptr(), frame, 6);
+
+  uint64_t t = nowNs();
+  for (int i = 0; i < ITERATIONS; ++i)
+    for (int k = 0; k < 6; k += 2) {
+      int v = (buffer::at(b, k) << 8) | buffer::at(b, k + 1);
+      sink = v >= 0x8000 ? v - 0x10000 : v;
+    }
+  double bytes = (nowNs() - t) / (double)ITERATIONS;
+  expect(sink == 1000);
+
+  t = nowNs();
+  for (int i = 0; i < ITERATIONS; ++i)
+    for (int k = 0; k < 6; k += 2)
+      sink = buffer::get_number(b, BE(NUMBER_FORMAT_INT16), k);
+  double numbers = (nowNs() - t) / (double)ITERATIONS;
+  expect(sink == 1000);
+
+  t = nowNs();
+  for (int i = 0; i < ITERATIONS; ++i) {
+    RefCollection *r = buffer::get_numbers(b, BE(NUMBER_FORMAT_INT16), 0, 3);
+    sink = collection::at(r, 0);
+    r->unref();
+  }
+  double bulk = (nowNs() - t) / (double)ITERATIONS;
+  expect(sink == -200);
+
+  ::printf("frame decode: %.1f ns with at(), %.1f ns with get_number(), %.1f ns with get_numbers()\n",
+    bytes, numbers, bulk);
+  b->unref();
+}
+
+static void benchFillRandom() {
+  RefBuffer *b = buffer::mk(256);
+  int n = ITERATIONS / 1000;
+
+  uint64_t t = nowNs();
+  for (int i = 0; i < n; ++i)
+    for (int k = 0; k < 256; ++k)
+      b->ptr()[k] = uBit.random(0x100);
+  double bytes = (nowNs() - t) / (double)n;
+
+  t = nowNs();
+  for (int i = 0; i < n; ++i)
+    buffer::fill_random(b);
+  double words = (nowNs() - t) / (double)n;
+
+  // every byte value shows up
+  int seen[256] = { 0 };
+  for (int i = 0; i < 64; ++i) {
+    buffer::fill_random(b);
+    for (int k = 0; k < 256; ++k)
+      seen[b->ptr()[k]]++;
+  }
+  for (int v = 0; v < 256; ++v)
+    expect(seen[v] > 0);
+
+  ::printf("256-byte random fill: %.0f ns a byte at a time, %.0f ns with fill_random()\n",
+    bytes, words);
+  b->unref();
+}
+
+// The bus: what each transfer sent, and from where.
+static const char *sentFrom;
+static uint8_t sent[32];
+static int sentLength;
+
+int MicroBitI2C::write(int, const char *data, int len, bool) {
+  sentFrom = data;
+  sentLength = len;
+  memcpy(sent, data, len);
+  return MICROBIT_OK;
+}
+
+#define FRAME     64
+#define CHUNK     16
+#define REGISTER  0x40
+#define FRAMES    (ITERATIONS / 100)
+
+struct Assembly {
+  double ns;
+  size_t allocs, allocated;
+  int copied;
+};
+
+static Assembly start() {
+  Assembly a = { (double)nowNs(), arenaAllocs, arenaUsed, 0 };
+  return a;
+}
+
+static void stop(Assembly *a) {
+  a->ns = (nowNs() - a->ns) / FRAMES;
+  a->allocs = arenaAllocs - a->allocs;
+  a->allocated = arenaUsed - a->allocated;
+}
+
+static void expectSent(RefBuffer *frame, int off, bool reg) {
+  expect(sentLength == CHUNK + reg);
+  if (reg)
+    expect(sent[0] == REGISTER);
+  expect(memcmp(sent + reg, frame->ptr() + off, CHUNK) == 0);
+}
+
+// A 64-byte frame written as four 16-byte transfers, each behind a
+// register byte, as scripts had to before: a new buffer per transfer, the
+// bytes moved one at() and set() at a time. Then with views, which the bus
+// reads straight from the frame.
+static void benchI2CAssembly() {
+  RefBuffer *frame = buffer::mk(FRAME);
+  for (int k = 0; k < FRAME; ++k)
+    frame->ptr()[k] = k * 7;
+
+  Assembly before = start();
+  for (int i = 0; i < FRAMES; ++i)
+    for (int off = 0; off < FRAME; off += CHUNK) {
+      RefBuffer *b = bitvm_bits::create_buffer(CHUNK + 1);
+      buffer::set(b, 0, REGISTER);
+      for (int k = 0; k < CHUNK; ++k)
+        buffer::set(b, k + 1, buffer::at(frame, off + k));
+      before.copied += CHUNK;
+      bitvm_micro_bit::i2cWriteBuffer(0x3c, b);
+      if (i == 0)
+        expectSent(frame, off, true);
+      b->unref();
+    }
+  stop(&before);
+
+  // Without the register byte, a transfer is a view, and the bus reads the
+  // frame itself.
+  Assembly views = start();
+  for (int i = 0; i < FRAMES; ++i)
+    for (int off = 0; off < FRAME; off += CHUNK) {
+      RefBuffer *v = buffer::slice(frame, off, CHUNK);
+      bitvm_micro_bit::i2cWriteBuffer(0x3c, v);
+      if (i == 0) {
+        expect(sentFrom == (char*)frame->ptr() + off);
+        expectSent(frame, off, false);
+      }
+      v->unref();
+    }
+  stop(&views);
+
+  // With it, the frame laid out with a spare byte before each chunk, which
+  // each transfer's view takes in.
+  RefBuffer *spaced = buffer::mk(FRAME / CHUNK * (CHUNK + 1));
+  for (int c = 0; c < FRAME / CHUNK; ++c)
+    memcpy(spaced->ptr() + c * (CHUNK + 1) + 1, frame->ptr() + c * CHUNK, CHUNK);
+  Assembly spare = start();
+  for (int i = 0; i < FRAMES; ++i)
+    for (int c = 0; c < FRAME / CHUNK; ++c) {
+      RefBuffer *v = buffer::slice(spaced, c * (CHUNK + 1), CHUNK + 1);
+      buffer::set(v, 0, REGISTER);
+      bitvm_micro_bit::i2cWriteBuffer(0x3c, v);
+      if (i == 0) {
+        expect(sentFrom == (char*)spaced->ptr() + c * (CHUNK + 1));
+        expectSent(frame, c * CHUNK, true);
+      }
+      v->unref();
+    }
+  stop(&spare);
+
+  // A chunk that is already in place at the start of its slot gets its
+  // register byte with shift(), a memmove rather than a shim call a byte.
+  RefBuffer *slot = buffer::mk(CHUNK + 1);
+  memcpy(slot->ptr(), frame->ptr(), CHUNK);
+  buffer::shift(slot, -1);
+  buffer::set(slot, 0, REGISTER);
+  bitvm_micro_bit::i2cWriteBuffer(0x3c, slot);
+  expectSent(frame, 0, true);
+  slot->unref();
+
+  ::printf("64-byte frame in four I2C transfers, per frame:\n");
+  ::printf("  at()/set() into new buffers: %3d bytes copied by shim calls, %d allocations of %d bytes, %.0f ns\n",
+    before.copied / FRAMES, (int)(before.allocs / FRAMES), (int)(before.allocated / FRAMES), before.ns);
+  ::printf("  slice():                     %3d bytes copied, %d allocations of %d bytes, %.0f ns\n",
+    views.copied / FRAMES, (int)(views.allocs / FRAMES), (int)(views.allocated / FRAMES), views.ns);
+  ::printf("  slice(), register byte:      %3d bytes copied, %d allocations of %d bytes, %.0f ns\n",
+    spare.copied / FRAMES, (int)(spare.allocs / FRAMES), (int)(spare.allocated / FRAMES), spare.ns);
+  frame->unref();
+  spaced->unref();
+}
+
+int main() {
+  testOverflow();
+  testRoundTrip();
+  benchFrameDecode();
+  benchFillRandom();
+  benchI2CAssembly();
+  ::printf("buffer: ok\n");
+  return 0;
+}
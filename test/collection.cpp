@@ -0,0 +1,200 @@
+// sort_by() with a key that changes the collection it is sorting; adding
+// and removing at both ends against a std::deque; and a 1000-element
+// sliding window, against the same window in a plain vector that erases
+// its first element, as collections did before they kept a head.
+
+#include "runtime.h"
+
+#include <deque>
+#include <time.h>
+
+// Shims, which only the function table refers to.
+namespace bitvm {
+  namespace record { RefRecord *mk(int reflen, int totallen); }
+  namespace collection {
+    RefCollection *mk(uint32_t flags);
+    void add(RefCollection *c, uint32_t x);
+    uint32_t at(RefCollection *c, int x);
+    int count(RefCollection *c);
+    void insert_at(RefCollection *c, int x, uint32_t y);
+    void remove_at(RefCollection *c, int x);
+    uint32_t pop_first(RefCollection *c);
+    uint32_t pop_last(RefCollection *c);
+    void set_at(RefCollection *c, int x, uint32_t y);
+    void sort_by(RefCollection *c, uint32_t key);
+  }
+}
+
+using namespace bitvm;
+
+static int liveRecords() {
+  return heapStats.live[HEAP_RECORD];
+}
+
+// A record holding a number, the sort key.
+static RefRecord *mkrec(int v) {
+  RefRecord *r = record::mk(0, 1);
+  r->fields[0] = v;
+  return r;
+}
+
+static RefCollection *sorted;
+static int calls;
+
+// Replaces every element of the collection with a fresh record, on the
+// first call: the old ones are only kept alive by sort_by().
+static uint32_t replacingKey(RefAction *, uint32_t *, uint32_t arg) {
+  if (calls++ == 0)
+    for (int i = 0; i < (int)sorted->size(); ++i) {
+      RefRecord *r = mkrec(1000 + i);
+      collection::set_at(sorted, i, U(r));
+      r->unref();
+    }
+  return ((RefRecord*)(uintptr_t)arg)->fields[0];
+}
+
+static RefAction *mkaction(ActionCB f) {
+  RefAction *a = new (operator new(sizeof(RefAction))) RefAction();
+  heapAlloc(HEAP_ACTION, sizeof(RefAction));
+  a->len = 0;
+  a->reflen = 0;
+  a->func = f;
+  return a;
+}
+
+static void testKeyReplacesElements() {
+  static const int keys[] = { 5, 3, 9, 1, 3, 7 };
+  sorted = collection::mk(1);
+  RefRecord *orig[6];
+  for (int i = 0; i < 6; ++i) {
+    orig[i] = mkrec(keys[i]);
+    collection::add(sorted, U(orig[i]));
+  }
+  RefAction *key = mkaction(replacingKey);
+  collection::sort_by(sorted, U(key));
+  key->unref();
+
+  // the keys were taken from the original elements, which the collection
+  // now holds, sorted and stable
+  static const int order[] = { 3, 1, 4, 0, 5, 2 };
+  expect(calls == 6);
+  for (int i = 0; i < 6; ++i) {
+    expect(sorted->item(i) == U(orig[order[i]]));
+    expect(orig[i]->refcnt == 2);
+  }
+  // and the records the key put in were released
+  expect(liveRecords() == 6);
+
+  sorted->unref();
+  for (int i = 0; i < 6; ++i) {
+    expect(orig[i]->refcnt == 1);
+    orig[i]->unref();
+  }
+  expect(liveRecords() == 0);
+}
+
+static uint32_t seed = 1;
+
+static uint32_t rnd() {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static void expectSame(RefCollection *c, const std::deque<uint32_t>& golden) {
+  expect(collection::count(c) == (int)golden.size());
+  for (size_t i = 0; i < golden.size(); ++i) {
+    // at() hands out a reference of its own
+    uint32_t r = collection::at(c, i);
+    expect(r == golden[i]);
+    decr(r);
+  }
+}
+
+// Records, so that the references are checked too.
+static void testBothEnds() {
+  RefCollection *c = collection::mk(1);
+  std::deque<uint32_t> golden;
+  for (int step = 0; step < 20000; ++step) {
+    int n = golden.size();
+    int op = rnd() % 6;
+    if (n == 0 || op < 3) {
+      RefRecord *r = mkrec(step);
+      int at = op == 0 ? 0 : op == 1 ? n : rnd() % (n + 1);
+      collection::insert_at(c, at, U(r));
+      golden.insert(golden.begin() + at, U(r));
+      r->unref();
+    } else if (op == 3) {
+      int at = rnd() % n;
+      collection::remove_at(c, at);
+      golden.erase(golden.begin() + at);
+    } else {
+      uint32_t r = op == 4 ? collection::pop_first(c) : collection::pop_last(c);
+      expect(r == (op == 4 ? golden.front() : golden.back()));
+      if (op == 4) golden.pop_front(); else golden.pop_back();
+      decr(r);
+    }
+    if (step % 101 == 0)
+      expectSame(c, golden);
+  }
+  expectSame(c, golden);
+  expect(liveRecords() == (int)golden.size());
+  c->unref();
+  expect(liveRecords() == 0);
+}
+
+#define WINDOW  1000
+#define STEPS   200000
+
+static uint64_t nowNs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+// The running sum of the last WINDOW readings.
+static void testSlidingWindow() {
+  RefCollection *c = collection::mk(0);
+  std::vector<uint32_t> before;
+  uint32_t sum = 0, beforeSum = 0, peak = 0;
+  for (int i = 0; i < WINDOW; ++i) {
+    collection::add(c, i);
+    before.push_back(i);
+    sum += i;
+  }
+  beforeSum = sum;
+
+  uint64_t t = nowNs();
+  for (int i = WINDOW; i < STEPS; ++i) {
+    beforeSum += i - before[0];
+    before.erase(before.begin());
+    before.push_back(i);
+  }
+  double beforeNs = (nowNs() - t) / (double)(STEPS - WINDOW);
+
+  t = nowNs();
+  for (int i = WINDOW; i < STEPS; ++i) {
+    sum += i - collection::at(c, 0);
+    collection::remove_at(c, 0);
+    collection::add(c, i);
+    peak = max(peak, (uint32_t)c->data.size());
+  }
+  double afterNs = (nowNs() - t) / (double)(STEPS - WINDOW);
+
+  expect(sum == beforeSum);
+  expect(collection::count(c) == WINDOW);
+  expect(collection::at(c, 0) == STEPS - WINDOW);
+  expect(peak <= 2 * WINDOW);
+  ::printf("%d-element sliding window, per step: %.1f ns erasing the first element, "
+    "%.1f ns with remove_at(0); at most %u slots\n", WINDOW, beforeNs, afterNs, peak);
+  c->unref();
+}
+
+int main() {
+  testKeyReplacesElements();
+  testBothEnds();
+  testSlidingWindow();
+  ::printf("collection: ok\n");
+  return 0;
+}
@@ -0,0 +1,130 @@
+// The datagram queue against a simulated radio: bursts that arrive faster
+// than the script pops, each packet kept with its own metadata, the ones
+// beyond the depth of the queue dropped and counted.
+
+#include "MicroBitTouchDevelop.h"
+
+using namespace touch_develop::micro_bit;
+
+#define expect(c) \
+  if (!(c)) { printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #c); exit(1); }
+
+// Enough of the DAL for the radio; the rest is never called.
+MicroBit uBit;
+MicroBitImage::MicroBitImage(): ptr(NULL) {}
+
+namespace touch_develop { namespace radio_transfer {
+  bool handlePacket(const uint8_t *, int) { return false; }
+} }
+
+static int enabled;
+static void (*listener)(MicroBitEvent);
+static uint32_t now;
+
+int MicroBitRadio::enable() { enabled++; return MICROBIT_OK; }
+unsigned long MicroBit::systemTime() { return now; }
+
+void MicroBitMessageBus::listen(int id, int value, void (*f)(MicroBitEvent), uint16_t flags) {
+  expect(id == MICROBIT_ID_RADIO && value == MICROBIT_RADIO_EVT_DATAGRAM);
+  expect(flags & MESSAGE_BUS_LISTENER_IMMEDIATE);
+  listener = f;
+}
+
+// The packet on the air: the DAL hands it over in recv().
+static uint8_t air[MICROBIT_RADIO_MAX_PACKET_SIZE];
+static int airLength, airRSSI;
+
+PacketBuffer::PacketBuffer() {}
+PacketBuffer MicroBitRadioDatagram::recv() { return PacketBuffer(); }
+uint8_t *PacketBuffer::getBytes() { return air; }
+int PacketBuffer::length() { return airLength; }
+int PacketBuffer::getRSSI() { return airRSSI; }
+
+// Packet [i] carries i in its first number, is 4 + i % 16 bytes long
+// and comes in at -40 - i dBm.
+static void receive(int i) {
+  memset(air, 0, sizeof(air));
+  memcpy(air, &i, 4);
+  airLength = 4 + i % 16;
+  airRSSI = -40 - i;
+  now += 3;
+  listener(MicroBitEvent(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM));
+}
+
+static void expectPacket(int i) {
+  expect(datagramGetNumber(0) == i);
+  expect(datagramGetLength() == 4 + i % 16);
+  expect(datagramGetRSSI() == -40 - i);
+}
+
+static void expectEmpty() {
+  expect(datagramGetNumber(0) == 0);
+  expect(datagramGetLength() == 0);
+  expect(datagramGetTime() == 0);
+  expect(datagramGetRSSI() == -1);
+}
+
+// Every getter turns the radio on, as the first call a script makes may be
+// any of them.
+static void testEnable() {
+  expect(datagramGetLength() == 0);
+  expect(enabled == 1 && listener != NULL);
+  expect(datagramGetTime() == 0);
+  expect(datagramDropped() == 0);
+  expect(enabled == 3);
+  expectEmpty();
+}
+
+// Ten packets back to back into the default queue of four: the first four
+// are kept, in order and each with its own metadata.
+static void testBurst() {
+  uint32_t start = now;
+  for (int i = 1; i <= 10; ++i)
+    receive(i);
+  expect(datagramCount() == 4);
+  expect(datagramDropped() == 6);
+  for (int i = 1; i <= 4; ++i) {
+    expect(datagramPeek() == 4 + i % 16);
+    expect(datagramPop() == 4 + i % 16);
+    expectPacket(i);
+    expect(datagramGetTime() == (int)(start + 3 * i));
+  }
+  expect(datagramCount() == 0);
+
+  // an empty queue leaves the current datagram alone...
+  expect(datagramPop() == -1);
+  expectPacket(4);
+  // ...but receiveNumber() reads an empty one
+  expect(datagramReceiveNumber() == 0);
+  expectEmpty();
+}
+
+// A deeper queue takes a longer burst, and wraps around as it is popped
+// while packets keep coming.
+static void testDeeperQueue() {
+  datagramSetQueueDepth(16);
+  int dropped = datagramDropped();
+  for (int i = 1; i <= 16; ++i)
+    receive(i);
+  expect(datagramCount() == 16);
+  int next = 1;
+  for (int i = 17; i <= 40; ++i) {
+    expect(datagramReceiveNumber() == next);
+    expectPacket(next++);
+    receive(i);
+  }
+  while (datagramCount() > 0) {
+    expect(datagramPop() >= 0);
+    expectPacket(next++);
+  }
+  expect(next == 41);
+  expect(datagramDropped() == dropped);
+}
+
+int main() {
+  testEnable();
+  testBurst();
+  testDeeperQueue();
+  printf("datagram: ok\n");
+  return 0;
+}
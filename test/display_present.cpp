@@ -0,0 +1,192 @@
+// Double-buffered drawing against a simulated display that lights one row
+// of its matrix per tick: whatever the phase of displayPresent() within a
+// refresh, every frame shows either the old image or the new one.
+
+#include "MicroBitTouchDevelop.h"
+
+using namespace touch_develop::micro_bit;
+
+namespace touch_develop { namespace micro_bit { extern MicroBitImage backBuffer; } }
+
+#define expect(c) \
+  if (!(c)) { printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #c); exit(1); }
+
+#define ROWS  3
+#define SIZE  5
+
+// Enough of the DAL for the display; the rest is never called.
+MicroBit uBit;
+static NRF_GPIO_Type gpio;
+NRF_GPIO_Type *NRF_GPIO = &gpio;
+PacketBuffer::PacketBuffer() {}
+
+MicroBitImage::MicroBitImage(): ptr(NULL) {}
+
+MicroBitImage::MicroBitImage(int w, int h) {
+  ptr = (ImageData*)calloc(1, sizeof(ImageData) + w * h);
+  ptr->width = w;
+  ptr->height = h;
+}
+
+MicroBitImage& MicroBitImage::operator=(const MicroBitImage& i) {
+  ptr = i.ptr;
+  return *this;
+}
+
+MicroBitImage MicroBitImage::clone() {
+  MicroBitImage r(ptr->width, ptr->height);
+  memcpy(r.ptr->data, ptr->data, ptr->width * ptr->height);
+  return r;
+}
+
+uint8_t *MicroBitImage::getBitmap() { return ptr->data; }
+int MicroBitImage::getWidth() { return ptr->width; }
+int MicroBitImage::getHeight() { return ptr->height; }
+void MicroBitImage::clear() { memset(ptr->data, 0, ptr->width * ptr->height); }
+
+int MicroBitImage::getPixelValue(int x, int y) {
+  if (x < 0 || y < 0 || x >= ptr->width || y >= ptr->height)
+    return MICROBIT_INVALID_PARAMETER;
+  return ptr->data[y * ptr->width + x];
+}
+
+int MicroBitImage::setPixelValue(int x, int y, uint8_t v) {
+  if (x < 0 || y < 0 || x >= ptr->width || y >= ptr->height)
+    return MICROBIT_INVALID_PARAMETER;
+  ptr->data[y * ptr->width + x] = v;
+  return MICROBIT_OK;
+}
+
+int MicroBitImage::paste(const MicroBitImage& i, int x, int y, int) {
+  for (int sy = 0; sy < i.ptr->height; ++sy)
+    for (int sx = 0; sx < i.ptr->width; ++sx)
+      setPixelValue(x + sx, y + sy, i.ptr->data[sy * i.ptr->width + sx]);
+  return MICROBIT_OK;
+}
+
+static MicroBitComponent *component;
+
+int MicroBit::addSystemComponent(MicroBitComponent *c) { component = c; return MICROBIT_OK; }
+int MicroBit::removeSystemComponent(MicroBitComponent *c) { component = NULL; return MICROBIT_OK; }
+
+void __disable_irq() {}
+void __enable_irq() {}
+
+// The display: on every tick, lights the next row, i.e. every third pixel
+// of the image in this model, and keeps what it lit for the current frame.
+static bool displayOn = true;
+static int row = ROWS - 1;
+static int lit[SIZE * SIZE];
+static int frames, mixed;
+
+static void checkFrame() {
+  for (int i = 1; i < SIZE * SIZE; ++i)
+    if (lit[i] != lit[0]) {
+      mixed++;
+      break;
+    }
+  frames++;
+}
+
+static void tick() {
+  if (displayOn) {
+    row = (row + 1) % ROWS;
+    gpio.OUT = 1 << (DISPLAY_LAST_ROW_PIN - ROWS + 1 + row);
+    uint8_t *p = uBit.display.image.getBitmap();
+    for (int i = row; i < SIZE * SIZE; i += ROWS)
+      lit[i] = p[i];
+    if (row == ROWS - 1)
+      checkFrame();
+  }
+  if (component)
+    component->systemTick();
+}
+
+static uint32_t now;
+
+// Fibers sleep across ticks.
+void MicroBit::sleep(int ms) {
+  for (int i = 0; i < ms; i += MICROBIT_DEFAULT_TICK_PERIOD) {
+    tick();
+    now += MICROBIT_DEFAULT_TICK_PERIOD;
+  }
+}
+
+static void drawAll(bool on) {
+  for (int y = 0; y < SIZE; ++y)
+    for (int x = 0; x < SIZE; ++x)
+      if (on)
+        plot(x, y);
+      else
+        unPlot(x, y);
+}
+
+// Alternates between all on and all off, presenting at every phase of the
+// refresh, with some frames not presented at all.
+static void testNoTearing() {
+  displaySetDoubleBuffered(true);
+  for (int i = 0; i < 300; ++i) {
+    drawAll(i & 1);
+    for (int t = 0; t < i % (ROWS + 2); ++t)
+      tick();
+    displayPresent();
+    expect(memcmp(uBit.display.image.getBitmap(), backBuffer.getBitmap(), SIZE * SIZE) == 0);
+  }
+  displaySetDoubleBuffered(false);
+  expect(component == NULL);
+  expect(frames > 100);
+  expect(mixed == 0);
+}
+
+// An unchanged frame is not waited for.
+static void testUnchanged() {
+  displaySetDoubleBuffered(true);
+  drawAll(true);
+  displayPresent();
+  uint32_t start = now;
+  drawAll(true);
+  displayPresent();
+  expect(now == start);
+  displaySetDoubleBuffered(false);
+}
+
+// With the display switched off, the rows never move: the copy still
+// happens, once the wait times out.
+static void testDisplayOff() {
+  displaySetDoubleBuffered(true);
+  displayOn = false;
+  gpio.OUT = 0;
+  drawAll(false);
+  uint32_t start = now;
+  displayPresent();
+  expect(now - start >= DISPLAY_PRESENT_TIMEOUT_MS);
+  expect(uBit.display.image.getBitmap()[0] == 0);
+  displayOn = true;
+  displaySetDoubleBuffered(false);
+}
+
+// plotImage() replaces the whole frame, as it does without double
+// buffering: nothing of the previous one stays lit around the image.
+static void testPlotImage() {
+  displaySetDoubleBuffered(true);
+  drawAll(true);
+  displayPresent();
+  MicroBitImage small(2, 2);
+  small.setPixelValue(1, 1, 1);
+  plotImage(small, 0);
+  displayPresent();
+  uint8_t *p = uBit.display.image.getBitmap();
+  for (int i = 0; i < SIZE * SIZE; ++i)
+    expect(p[i] == (i == SIZE + 1));
+  displaySetDoubleBuffered(false);
+}
+
+int main() {
+  uBit.display.image = MicroBitImage(SIZE, SIZE);
+  testNoTearing();
+  testUnchanged();
+  testDisplayOff();
+  testPlotImage();
+  printf("display_present: ok (%d frames)\n", frames);
+  return 0;
+}
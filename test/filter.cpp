@@ -0,0 +1,112 @@
+// The windowed filters against naive implementations, on random streams
+// with negative samples, for windows of every size.
+
+#include "runtime.h"
+
+#include <algorithm>
+
+// Shims, which only the function table refers to.
+namespace bitvm {
+  namespace filter {
+    RefFilter *average(int n);
+    RefFilter *median(int n);
+    RefFilter *minimum(int n);
+    RefFilter *maximum(int n);
+    int push(RefFilter *f, int x);
+    void reset(RefFilter *f);
+  }
+}
+
+using namespace bitvm;
+
+static uint32_t seed = 1;
+
+static uint32_t rnd() {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+// Within +-2^23, as average() asks for, or small.
+static int sample(int i) {
+  if (i & 1)
+    return (int)(rnd() & 0xffffff) - 0x800000;
+  return (int)(rnd() % 21) - 10;
+}
+
+// What the filter should return, computed with 64-bit arithmetic.
+static int golden(int kind, std::vector<int>& w) {
+  std::vector<int> s(w);
+  std::sort(s.begin(), s.end());
+  int64_t sum = 0;
+  for (size_t i = 0; i < w.size(); ++i)
+    sum += w[i];
+  int c = w.size();
+  switch (kind) {
+    case FILTER_AVERAGE:
+      return sum / c;
+    case FILTER_MEDIAN:
+      return c & 1 ? s[c / 2] : ((int64_t)s[c / 2 - 1] + s[c / 2]) / 2;
+    case FILTER_MIN:
+      return s[0];
+    default:
+      return s[c - 1];
+  }
+}
+
+static RefFilter *mk(int kind, int n) {
+  switch (kind) {
+    case FILTER_AVERAGE: return filter::average(n);
+    case FILTER_MEDIAN: return filter::median(n);
+    case FILTER_MIN: return filter::minimum(n);
+    default: return filter::maximum(n);
+  }
+}
+
+static void testKind(int kind) {
+  for (int n = 1; n <= BITVM_FILTER_MAX_WINDOW; n += n < 40 ? 1 : 27) {
+    RefFilter *f = mk(kind, n);
+    std::vector<int> w;
+    for (int i = 0; i < 1000; ++i) {
+      if (i == 600) {
+        filter::reset(f);
+        w.clear();
+      }
+      int x = sample(i + (rnd() & 1));
+      w.push_back(x);
+      if ((int)w.size() > n)
+        w.erase(w.begin());
+      expect(filter::push(f, x) == golden(kind, w));
+    }
+    f->unref();
+  }
+}
+
+// Power-of-two windows are divided by a shift, and medians of two are
+// halved without a wider type: both have to round towards zero.
+static void testRounding() {
+  RefFilter *f = filter::average(4);
+  filter::push(f, -1);
+  filter::push(f, -1);
+  filter::push(f, -1);
+  expect(filter::push(f, 0) == 0);
+  expect(filter::push(f, -2) == -1);
+  f->unref();
+
+  f = filter::median(2);
+  filter::push(f, -3);
+  expect(filter::push(f, 0) == -1);
+  expect(filter::push(f, 0x7fffffff) == 0x3fffffff);
+  f->unref();
+}
+
+int main() {
+  testKind(FILTER_AVERAGE);
+  testKind(FILTER_MEDIAN);
+  testKind(FILTER_MIN);
+  testKind(FILTER_MAX);
+  testRounding();
+  ::printf("filter: ok\n");
+  return 0;
+}
@@ -0,0 +1,190 @@
+// The error bounds listed in FixedMath.h, against libm, and those of the
+// math shims built on top of it, which work in degrees and 1024ths.
+
+#include "MicroBitTouchDevelop.h"
+#include "FixedMath.h"
+
+#include <math.h>
+
+using namespace touch_develop::fixed_math;
+
+#define expect(c) \
+  if (!(c)) { printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #c); exit(1); }
+
+// Enough of the DAL for math; the rest is never called.
+MicroBit uBit;
+MicroBitImage::MicroBitImage(): ptr(NULL) {}
+PacketBuffer::PacketBuffer() {}
+
+static uint32_t seed = 1;
+
+static uint32_t rnd() {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+// Of every magnitude: a random number of the bits kept.
+static int rndInt() {
+  return (int)rnd() >> (rnd() % 32);
+}
+
+// The worst error seen, for the report.
+static double worst;
+
+static void within(double got, double want, double bound, const char *what, double arg) {
+  double e = fabs(got - want);
+  worst = fmax(worst, e);
+  if (e > bound) {
+    printf("%s(%g) = %g, want %g +-%g\n", what, arg, got, want, bound);
+    exit(1);
+  }
+}
+
+static void report(const char *what) {
+  printf("%-24s %g\n", what, worst);
+  worst = 0;
+}
+
+static void testSin() {
+  for (int a = 0; a < FIXED_ANGLE_TURN; ++a) {
+    double r = 2 * M_PI * a / FIXED_ANGLE_TURN;
+    within(isin(a), FIXED_SIN_ONE * sin(r), 1.5, "isin", a);
+    within(icos(a), FIXED_SIN_ONE * cos(r), 1.5, "icos", a);
+  }
+  // angles wrap around
+  expect(isin(-FIXED_ANGLE_TURN / 4) == -FIXED_SIN_ONE);
+  expect(isin(FIXED_ANGLE_TURN * 5 / 4) == FIXED_SIN_ONE);
+  report("isin, icos (of 32768)");
+}
+
+static void checkAtan2(int y, int x) {
+  int got = iatan2(y, x);
+  expect(-FIXED_ANGLE_TURN / 2 < got && got <= FIXED_ANGLE_TURN / 2);
+  double want = atan2((double)y, (double)x) * FIXED_ANGLE_TURN / (2 * M_PI);
+  // -32768 and 32768 are the same angle
+  double d = got - want;
+  d -= FIXED_ANGLE_TURN * floor(d / FIXED_ANGLE_TURN + 0.5);
+  within(want + d, want, 1, "iatan2", y);
+}
+
+static void testAtan2() {
+  expect(iatan2(0, 0) == 0);
+  for (int i = 0; i < 2000000; ++i)
+    checkAtan2(rndInt(), rndInt());
+  for (int y = -200; y <= 200; ++y)
+    for (int x = -200; x <= 200; ++x)
+      if (x || y)
+        checkAtan2(y, x);
+  static const int corners[] = { INT_MIN, INT_MIN + 1, -1, 0, 1, INT_MAX };
+  for (int i = 0; i < 6; ++i)
+    for (int j = 0; j < 6; ++j)
+      if (corners[i] || corners[j])
+        checkAtan2(corners[i], corners[j]);
+  report("iatan2 (of 65536)");
+}
+
+static void testSqrt() {
+  for (uint32_t r = 1; r < 65536; ++r) {
+    expect(isqrt(r * r) == r);
+    expect(isqrt(r * r - 1) == r - 1);
+  }
+  expect(isqrt(0) == 0);
+  expect(isqrt(0xffffffff) == 65535);
+  for (int i = 0; i < 2000000; ++i) {
+    uint32_t x = rnd() >> (rnd() % 32);
+    uint64_t r = isqrt(x);
+    expect(r * r <= x && x < (r + 1) * (r + 1));
+
+    int a = rndInt(), b = rndInt();
+    uint64_t s = (int64_t)a * a + (int64_t)b * b;
+    r = ihypot(a, b);
+    expect(r * r <= s && s < (r + 1) * (r + 1));
+  }
+  expect(ihypot(INT_MIN, INT_MIN) == 3037000499u);
+  report("isqrt, ihypot");
+}
+
+static void testLog2() {
+  expect(ilog2(0) == INT_MIN);
+  for (int i = 0; i < 2000000; ++i) {
+    uint32_t x = i < 32 ? 1u << i : i == 32 ? 2270604167u : rnd() >> (rnd() % 32);
+    if (!x)
+      continue;
+    double e = ilog2(x) - log2((double)x) * 65536;
+    // truncated, as are the squarings on the way, which costs a little
+    // more than 1
+    worst = fmin(worst, e);
+    expect(-1.0001 < e && e < 1e-6);
+  }
+  report("ilog2 (of 65536)");
+}
+
+static void testExp2() {
+  double rel = 0;
+  for (int x = -17 * 65536; x < 15 * 65536; x += 7) {
+    double want = exp2(x / 65536.0) * 65536;
+    int got = iexp2(x);
+    // the rounding to an integer, plus the relative bound
+    expect(fabs(got - want) <= 0.5 + 8e-6 * want);
+    if (want > 65536)
+      rel = fmax(rel, fabs(got - want) / want);
+  }
+  expect(iexp2(15 * 65536) == INT_MAX);
+  expect(iexp2(INT_MAX) == INT_MAX);
+  expect(iexp2(INT_MIN) == 0);
+  worst = rel;
+  report("iexp2 (relative)");
+}
+
+// The shims, in 1024ths and degrees: the rounding, plus the error of the
+// function underneath, scaled.
+static void testShims() {
+  for (int d = -720; d <= 720; ++d) {
+    within(touch_develop::math::sin(d), 1024 * sin(d * M_PI / 180), 0.5 + 1.5 / 32, "math::sin", d);
+    within(touch_develop::math::cos(d), 1024 * cos(d * M_PI / 180), 0.5 + 1.5 / 32, "math::cos", d);
+  }
+  report("math::sin, cos (of 1024)");
+
+  for (int y = -100; y <= 100; ++y)
+    for (int x = -100; x <= 100; ++x)
+      if ((x || y) && !(x < 0 && y == 0))
+        within(touch_develop::math::atan2(y, x), atan2(y, x) * 180 / M_PI, 0.5 + 360.0 / 65536, "math::atan2", y);
+  expect(abs(touch_develop::math::atan2(0, -1)) == 180);
+  report("math::atan2 (degrees)");
+
+  for (int i = 0; i < 1000000; ++i) {
+    int x = rndInt() & INT_MAX;
+    if (x)
+      within(touch_develop::math::log2(x), 1024 * log2((double)x), 0.5 + 1.0001 / 64, "math::log2", x);
+  }
+  expect(touch_develop::math::log2(0) == INT_MIN);
+  report("math::log2 (of 1024)");
+
+  double rel = 0;
+  for (int x = -16 * 1024; x < 31 * 1024; ++x) {
+    double want = exp2(x / 1024.0);
+    int got = touch_develop::math::exp2(x);
+    expect(fabs(got - want) <= 0.5 + 8e-6 * want);
+    if (want > 65536)
+      rel = fmax(rel, fabs(got - want) / want);
+  }
+  expect(touch_develop::math::exp2(31 * 1024) == INT_MAX);
+  worst = rel;
+  report("math::exp2 (relative)");
+
+  expect(touch_develop::math::hypot(INT_MIN, INT_MIN) == INT_MAX);
+  expect(touch_develop::math::hypot(3, -4) == 5);
+}
+
+int main() {
+  testSin();
+  testAtan2();
+  testSqrt();
+  testLog2();
+  testExp2();
+  testShims();
+  printf("fixed_math: ok\n");
+  return 0;
+}
@@ -0,0 +1,174 @@
+// The cycle collector and the deferred-decrement table, through the shims
+// the compiled code calls; built with BITVM_CYCLE_COLLECTOR and
+// BITVM_DEFERRED_DECR.
+
+#include "runtime.h"
+
+// Shims, which only the function table refers to.
+namespace bitvm {
+  uint32_t *allocate(uint16_t sz);
+  uint32_t ldfldRef(RefRecord *r, int idx);
+  void stfldRef(RefRecord *r, int idx, uint32_t val);
+  void stglbRef(uint32_t v, int idx);
+  namespace record { RefRecord *mk(int reflen, int totallen); }
+  namespace collection {
+    RefCollection *mk(uint32_t flags);
+    void add(RefCollection *c, uint32_t x);
+  }
+}
+
+using namespace bitvm;
+
+static int live() {
+  DEFERRED_DECR_FLUSH();
+  int n = 0;
+  for (int i = 0; i < HEAP_TYPES; ++i)
+    n += heapStats.live[i];
+  return n;
+}
+
+// A record with one ref field, as the emitter creates them.
+static RefRecord *mkrec() {
+  return record::mk(1, 1);
+}
+
+// r.field = v, with the load of r and v done by the caller.
+static void link(RefRecord *r, RefObject *v) {
+  r->ref();
+  v->ref();
+  stfldRef(r, 0, U(v));
+}
+
+static void testPair() {
+  RefRecord *a = mkrec(), *b = mkrec();
+  link(a, b);
+  link(b, a);
+  a->unref();
+  b->unref();
+  expect(live() == 2);
+  expect(CycleCollector::collect() == 2);
+  expect(live() == 0);
+}
+
+// record -> collection -> records -> back to the first record
+static void testCollectionAndRecord() {
+  RefRecord *r = mkrec();
+  RefCollection *c = collection::mk(1);
+  link(r, c);
+  for (int i = 0; i < 5; ++i) {
+    RefRecord *e = mkrec();
+    link(e, r);
+    collection::add(c, U(e));
+    e->unref();
+  }
+  c->unref();
+  r->unref();
+  expect(live() == 7);
+  expect(CycleCollector::collect() == 7);
+  expect(live() == 0);
+}
+
+// A cycle hanging off a global stays, whatever the collector is told; it
+// goes once the global lets go of it.
+static void testGlobal() {
+  numGlobals = 1;
+  globals = allocate(numGlobals);
+
+  RefRecord *a = mkrec(), *b = mkrec();
+  link(a, b);
+  link(b, a);
+  stglbRef(U(a), 0);
+  b->unref();
+  expect(live() == 2);
+  CycleCollector::pending = true;
+  collection::mk(0)->unref();    // an allocation is a safe point
+  expect(CycleCollector::collect() == 0);
+  expect(live() == 2);
+  a->ref();
+  uint32_t f = ldfldRef(a, 0);
+  expect(f == U(b));
+  decr(f);
+
+  stglbRef(0, 0);
+  expect(CycleCollector::collect() == 2);
+  expect(live() == 0);
+}
+
+// Garbage holding on to a live object only drops its reference.
+static void testGarbageToLive() {
+  RefRecord *keep = mkrec();
+  RefRecord *a = record::mk(2, 2), *b = mkrec();
+  link(a, b);
+  link(b, a);
+  keep->ref();
+  a->ref();
+  stfldRef(a, 1, U(keep));
+  a->unref();
+  b->unref();
+  expect(CycleCollector::collect() == 2);
+  expect(live() == 1);
+  expect(keep->refcnt == 1);
+  keep->unref();
+  expect(live() == 0);
+}
+
+// Decrements that would not free the object are queued, up to
+// DEFERRED_DECR_SLOTS; past that, they are applied right away.
+static void testDeferredOverflow() {
+  RefRecord *r[DEFERRED_DECR_SLOTS + 2];
+  for (int i = 0; i < DEFERRED_DECR_SLOTS + 2; ++i) {
+    r[i] = mkrec();
+    r[i]->ref();
+  }
+  for (int i = 0; i < DEFERRED_DECR_SLOTS + 2; ++i)
+    r[i]->unref();
+  expect(DeferredDecr::count == DEFERRED_DECR_SLOTS);
+  for (int i = 0; i < DEFERRED_DECR_SLOTS; ++i)
+    expect(r[i]->refcnt == 2);
+  expect(r[DEFERRED_DECR_SLOTS]->refcnt == 1);
+  expect(r[DEFERRED_DECR_SLOTS + 1]->refcnt == 1);
+
+  // a ref() cancels the queued decrement instead of writing the count
+  r[3]->ref();
+  expect(DeferredDecr::count == DEFERRED_DECR_SLOTS - 1);
+  expect(r[3]->refcnt == 2);
+  r[3]->unref();
+
+  // the last reference is never deferred
+  r[DEFERRED_DECR_SLOTS]->unref();
+  expect(DeferredDecr::count == DEFERRED_DECR_SLOTS);
+
+  DEFERRED_DECR_FLUSH();
+  expect(DeferredDecr::count == 0);
+  for (int i = 0; i < DEFERRED_DECR_SLOTS; ++i)
+    expect(r[i]->refcnt == 1);
+  for (int i = 0; i < DEFERRED_DECR_SLOTS; ++i)
+    r[i]->unref();
+  r[DEFERRED_DECR_SLOTS + 1]->unref();
+  expect(live() == 0);
+}
+
+// The collector needs exact counts: a cycle whose last outside reference
+// is a queued decrement is still found.
+static void testDeferredThenCollect() {
+  RefRecord *a = mkrec(), *b = mkrec();
+  link(a, b);
+  link(b, a);
+  DEFERRED_DECR_FLUSH();
+  a->unref();
+  b->unref();
+  expect(DeferredDecr::count == 2);
+  expect(CycleCollector::collect() == 2);
+  expect(live() == 0);
+}
+
+int main() {
+  testPair();
+  testCollectionAndRecord();
+  testGlobal();
+  testGarbageToLive();
+  testDeferredOverflow();
+  testDeferredThenCollect();
+  ::printf("gc: ok (%u freed)\n", CycleCollector::freed);
+  return 0;
+}
@@ -0,0 +1,118 @@
+// The DEBUG_MEMLEAKS table of live objects against a std::set, under
+// random churn that keeps it nearly full, so that lookups probe far and
+// removals move entries back; then the allocation sites it reports, and
+// what it says once it is full.
+
+#include "runtime.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+// Shims, which only the function table refers to.
+namespace bitvm {
+  namespace record { RefRecord *mk(int reflen, int totallen); }
+}
+
+using namespace bitvm;
+
+static uint32_t seed = 1;
+
+static uint32_t rnd() {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static std::vector<std::string> lines;
+
+static void keepLine(const char *s) {
+  lines.push_back(s);
+}
+
+static void dump() {
+  lines.clear();
+  logLine = keepLine;
+  debugMemLeaks();
+  logLine = NULL;
+}
+
+// The objects the last dump() listed.
+static std::set<void*> listed() {
+  std::set<void*> r;
+  for (size_t i = 0; i < lines.size(); ++i) {
+    void *p;
+    if (sscanf(lines[i].c_str(), "RefRecord %p", &p) == 1)
+      r.insert(p);
+  }
+  return r;
+}
+
+static void testChurn() {
+  std::vector<RefRecord*> live;
+  std::set<void*> golden;
+  for (int step = 0; step < 100000; ++step) {
+    // between 200 and 250 objects, in a table of 256
+    bool add = live.size() < 200 || (live.size() < 250 && rnd() & 1);
+    if (add) {
+      RefRecord *r = record::mk(0, 1);
+      live.push_back(r);
+      golden.insert(r);
+    } else {
+      int i = rnd() % live.size();
+      golden.erase(live[i]);
+      live[i]->unref();
+      live[i] = live.back();
+      live.pop_back();
+    }
+    if (step % 997 == 0) {
+      dump();
+      expect(listed() == golden);
+    }
+  }
+  for (size_t i = 0; i < live.size(); ++i)
+    live[i]->unref();
+  dump();
+  expect(listed().empty());
+}
+
+static void testSites() {
+  static uint16_t code[256];
+  bytecode = code;
+  RefRecord *r = record::mk(0, 1), *s = record::mk(0, 1);
+  HeapTracker::setSite(r, (uint8_t*)code + 0x40);
+  // not in the bytecode: left unknown
+  HeapTracker::setSite(s, (uint8_t*)code - 2);
+  dump();
+  expect(lines.size() == 5);
+  int at = -1;
+  for (size_t i = 0; i < lines.size(); ++i)
+    if (lines[i] == "@0x40 ")
+      at = i;
+  expect(at >= 0);
+  void *p;
+  expect(sscanf(lines[at + 1].c_str(), "RefRecord %p", &p) == 1 && p == r);
+  r->unref();
+  s->unref();
+}
+
+// Past 255 live objects, the rest are counted rather than tracked.
+static void testFull() {
+  std::vector<RefRecord*> live;
+  for (int i = 0; i < 300; ++i)
+    live.push_back(record::mk(0, 1));
+  dump();
+  expect(listed().size() == 255);
+  expect(lines[lines.size() - 2] == "(45 objects not tracked, table full)\n");
+  for (size_t i = 0; i < live.size(); ++i)
+    live[i]->unref();
+}
+
+int main() {
+  testChurn();
+  testSites();
+  testFull();
+  ::printf("heap_tracker: ok\n");
+  return 0;
+}
@@ -0,0 +1,132 @@
+// The bulk image operations: blitting an image onto itself, against a blit
+// from a copy; and a scrolling sprite drawn with them, against the same
+// frames drawn pixel by pixel as scripts did before. The figures are host
+// nanoseconds, with a MicroBitImage that only models the DAL's ref-count
+// increment and range checks: they understate what the per-pixel calls
+// cost on the device.
+
+#include "runtime.h"
+
+#include <time.h>
+
+// Shims, which only the function table refers to.
+namespace bitvm {
+  namespace bitvm_micro_bit {
+    void blitImage(ImageData *dst, ImageData *src, int x, int y, bool transparent);
+    int getImagePixel(ImageData *i, int x, int y);
+    void setImagePixel(ImageData *i, int x, int y, int value);
+  }
+}
+
+using namespace bitvm::bitvm_micro_bit;
+
+MicroBitImage::MicroBitImage(ImageData *p): ptr(p) { ptr->incr(); }
+
+int MicroBitImage::getPixelValue(int x, int y) {
+  if (x < 0 || y < 0 || x >= ptr->width || y >= ptr->height)
+    return MICROBIT_INVALID_PARAMETER;
+  return ptr->data[y * ptr->width + x];
+}
+
+int MicroBitImage::setPixelValue(int x, int y, uint8_t v) {
+  if (x < 0 || y < 0 || x >= ptr->width || y >= ptr->height)
+    return MICROBIT_INVALID_PARAMETER;
+  ptr->data[y * ptr->width + x] = v;
+  return MICROBIT_OK;
+}
+
+static uint32_t seed = 1;
+
+static uint32_t rnd() {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static ImageData *mkImage(int w, int h) {
+  ImageData *i = (ImageData*)malloc(sizeof(ImageData) + w * h);
+  i->init();
+  i->width = w;
+  i->height = h;
+  return i;
+}
+
+static ImageData *copy(ImageData *i) {
+  ImageData *r = mkImage(i->width, i->height);
+  memcpy(r->data, i->data, i->width * i->height);
+  return r;
+}
+
+// Every offset that overlaps, in both modes, with black pixels about.
+static void testSelfBlit() {
+  ImageData *orig = mkImage(7, 6);
+  for (int i = 0; i < 7 * 6; ++i)
+    orig->data[i] = rnd() & 1 ? rnd() : 0;
+  for (int t = 0; t < 2; ++t)
+    for (int y = -6; y <= 6; ++y)
+      for (int x = -7; x <= 7; ++x) {
+        ImageData *expected = copy(orig), *src = copy(orig), *self = copy(orig);
+        blitImage(expected, src, x, y, t);
+        blitImage(self, self, x, y, t);
+        expect(memcmp(self->data, expected->data, 7 * 6) == 0);
+        free(expected);
+        free(src);
+        free(self);
+      }
+  free(orig);
+}
+
+#define FRAMES    100000
+#define STRIP     20
+
+static uint64_t nowNs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+// A 5x5 window scrolling along a 20x5 strip, with a 2x2 sprite bouncing
+// on top of it; black pixels of the sprite let the strip show through.
+static void benchScrollingSprite() {
+  ImageData *strip = mkImage(STRIP, 5), *sprite = mkImage(2, 2);
+  for (int i = 0; i < STRIP * 5; ++i)
+    strip->data[i] = rnd() & 3 ? 0 : 255;
+  static const uint8_t spritePixels[] = { 9, 0, 9, 9 };
+  memcpy(sprite->data, spritePixels, 4);
+  ImageData *before = mkImage(5, 5), *after = mkImage(5, 5);
+
+  uint64_t t = nowNs();
+  for (int f = 0; f < FRAMES; ++f) {
+    int off = f % (STRIP - 4), py = f % 4;
+    for (int y = 0; y < 5; ++y)
+      for (int x = 0; x < 5; ++x)
+        setImagePixel(before, x, y, getImagePixel(strip, x + off, y));
+    for (int y = 0; y < 2; ++y)
+      for (int x = 0; x < 2; ++x) {
+        int v = getImagePixel(sprite, x, y);
+        if (v)
+          setImagePixel(before, x + 2, y + py, v);
+      }
+  }
+  double perPixel = (nowNs() - t) / (double)FRAMES;
+
+  t = nowNs();
+  for (int f = 0; f < FRAMES; ++f) {
+    int off = f % (STRIP - 4), py = f % 4;
+    blitImage(after, strip, -off, 0, false);
+    blitImage(after, sprite, 2, py, true);
+  }
+  double bulk = (nowNs() - t) / (double)FRAMES;
+
+  expect(memcmp(before->data, after->data, 25) == 0);
+  ::printf("scrolling sprite, per frame: %.1f ns pixel by pixel, %.1f ns with blitImage\n",
+    perPixel, bulk);
+}
+
+int main() {
+  testSelfBlit();
+  benchScrollingSprite();
+  ::printf("image: ok\n");
+  return 0;
+}
@@ -0,0 +1,120 @@
+// Boxed locals in a closure-heavy loop, as the code emitter compiles it:
+// each iteration boxes a counter and an accumulator that a closure writes
+// to, runs the closure a few times and drops it. Counts the heap
+// allocations with heap boxes, which the pool recycles, and with boxes in
+// the frame; before the pool, every box was an allocation of its own.
+
+#include "runtime.h"
+
+// Shims, which only the function table refers to.
+namespace bitvm {
+  typedef uint32_t Action;
+  uint32_t ldloc(RefLocal *r);
+  uint32_t ldlocRef(RefRefLocal *r);
+  void stloc(RefLocal *r, uint32_t v);
+  void stlocRef(RefRefLocal *r, uint32_t v);
+  RefLocal *mkloc();
+  RefRefLocal *mklocRef();
+  RefLocal *mklocFrame(uint32_t *mem);
+  RefRefLocal *mklocRefFrame(uint32_t *mem);
+  void rmlocFrame(RefObject *r);
+  RefAction *stclo(RefAction *a, int idx, uint32_t v);
+  namespace action { Action mk(int reflen, int totallen, int startptr); }
+  namespace record { RefRecord *mk(int reflen, int totallen); }
+}
+
+using namespace bitvm;
+
+#define ITERATIONS  1000
+#define RUNS        10
+
+// Only the header of the closure's code is looked at.
+static uint16_t code[] = { 0xffff, 0x0000 };
+
+static RefRecord *item;
+
+// The body of the closure: count := count + 1, acc := item.
+static void body(RefAction *a) {
+  RefLocal *count = (RefLocal*)(uintptr_t)a->fields[0];
+  RefRefLocal *acc = (RefRefLocal*)(uintptr_t)a->fields[1];
+  stloc(count, ldloc(count) + 1);
+  incr(U(item));
+  stlocRef(acc, U(item));
+}
+
+// One iteration of the loop, with its two boxes; the closure is created,
+// run and dropped within it.
+static void iteration(RefLocal *count, RefRefLocal *acc) {
+  RefAction *a = (RefAction*)(uintptr_t)action::mk(2, 2, 0);
+  // loading the boxes incr()s them, and stclo() keeps the reference
+  incr(U(count));
+  stclo(a, 0, U(count));
+  incr(U(acc));
+  stclo(a, 1, U(acc));
+  for (int r = 0; r < RUNS; ++r)
+    body(a);
+  expect(ldloc(count) == RUNS);
+  decr(U(a));
+}
+
+struct Counts {
+  size_t allocs;
+  uint32_t peak;
+};
+
+static Counts heapBoxes() {
+  heapStats.peakBytes = heapStats.bytes;
+  size_t before = arenaAllocs;
+  for (int i = 0; i < ITERATIONS; ++i) {
+    RefLocal *count = mkloc();
+    RefRefLocal *acc = mklocRef();
+    iteration(count, acc);
+    decr(U(count));
+    decr(U(acc));
+  }
+  Counts c = { arenaAllocs - before, heapStats.peakBytes - heapStats.bytes };
+  return c;
+}
+
+// The frame's area for boxes; static, as the runtime keeps pointers in 32
+// bits, and the host stack is above 4 GB.
+static uint32_t frame[2 * BITVM_LOCAL_BOX_WORDS];
+
+static Counts frameBoxes() {
+  heapStats.peakBytes = heapStats.bytes;
+  size_t before = arenaAllocs;
+  for (int i = 0; i < ITERATIONS; ++i) {
+    RefLocal *count = mklocFrame(frame);
+    RefRefLocal *acc = mklocRefFrame(frame + BITVM_LOCAL_BOX_WORDS);
+    iteration(count, acc);
+    rmlocFrame(count);
+    rmlocFrame(acc);
+  }
+  Counts c = { arenaAllocs - before, heapStats.peakBytes - heapStats.bytes };
+  return c;
+}
+
+int main() {
+  bytecode = code;
+  item = record::mk(0, 1);
+
+  Counts heap = heapBoxes();
+  // the closures; the boxes come out of the pool after the first iteration
+  expect(heap.allocs <= ITERATIONS + 2);
+  expect(heapStats.live[HEAP_LOCAL] == 0);
+
+  Counts frame = frameBoxes();
+  expect(frame.allocs == ITERATIONS);
+  expect(heapStats.live[HEAP_LOCAL] == 0);
+  expect(heapStats.live[HEAP_ACTION] == 0);
+  expect(item->refcnt == 1);
+
+  ::printf("%d iterations, %d closures, %d boxes:\n", ITERATIONS, ITERATIONS, 2 * ITERATIONS);
+  ::printf("  before the pool: %d heap allocations\n", 2 * ITERATIONS + ITERATIONS);
+  ::printf("  pooled boxes:    %d heap allocations, %d of them boxes, peak %u bytes\n",
+    (int)heap.allocs, (int)heap.allocs - ITERATIONS, heap.peak);
+  ::printf("  frame boxes:     %d heap allocations, none of them boxes, peak %u bytes\n",
+    (int)frame.allocs, frame.peak);
+  ::printf("locals: ok\n");
+  return 0;
+}
@@ -0,0 +1,215 @@
+// Pitch, roll and heading against a floating point reference, on traces of
+// a board wobbling about in a field like Europe's, with sensor noise; then
+// the background calibration, which has to stop on a board that nobody
+// rotates or reads the heading of. There are no recordings of the sensors
+// in the repo, so the traces are made up, from a fixed seed.
+
+#include "Orientation.h"
+#include "FixedMath.h"
+
+#include <math.h>
+
+using namespace touch_develop::orientation;
+
+#define expect(c) \
+  if (!(c)) { printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #c); exit(1); }
+
+#define TRACES        200
+#define SAMPLES       500
+#define FIELD         48000     // nT
+#define INCLINATION   66        // degrees, down from the horizontal
+#define ACC_NOISE     8         // mg
+#define MAG_NOISE     150       // nT
+
+static uint32_t seed = 1;
+
+static double uniform() {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return (seed >> 8) / 16777216.0;
+}
+
+static double gaussian() {
+  double u = uniform() + 1e-12, v = uniform();
+  return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static double radians(double deg) { return deg * M_PI / 180; }
+static double toDegrees(int angle) { return angle * 360.0 / FIXED_ANGLE_TURN; }
+
+// Between -180 and 180.
+static double wrap(double deg) {
+  return deg - 360 * floor((deg + 180) / 360);
+}
+
+// Gravity and the field, from north-east-down into the frame of a board at
+// [yaw], [pitch] and [roll] (radians, in that order).
+static Sample attitude(double yaw, double pitch, double roll, bool noise) {
+  double sy = sin(yaw), cy = cos(yaw);
+  double sp = sin(pitch), cp = cos(pitch);
+  double sr = sin(roll), cr = cos(roll);
+  double bn = FIELD * cos(radians(INCLINATION)), bd = FIELD * sin(radians(INCLINATION));
+  // yaw first...
+  double x = cy * bn, y = -sy * bn, z = bd;
+  // ...then pitch, then roll
+  double x1 = cp * x - sp * z, z1 = sp * x + cp * z;
+  double y2 = cr * y + sr * z1, z2 = -sr * y + cr * z1;
+  double a = noise ? 1 : 0;
+  Sample s;
+  s.ax = lround(-1000 * sp + a * ACC_NOISE * gaussian());
+  s.ay = lround(1000 * sr * cp + a * ACC_NOISE * gaussian());
+  s.az = lround(1000 * cr * cp + a * ACC_NOISE * gaussian());
+  s.mx = lround(x1 + a * MAG_NOISE * gaussian());
+  s.my = lround(y2 + a * MAG_NOISE * gaussian());
+  s.mz = lround(z2 + a * MAG_NOISE * gaussian());
+  return s;
+}
+
+// The same formulas in doubles, in degrees.
+static double refPitch(const Sample& s) {
+  return atan2(-s.ax, hypot(s.ay, s.az)) * 180 / M_PI;
+}
+
+static double refRoll(const Sample& s) {
+  return atan2(s.ay, s.az) * 180 / M_PI;
+}
+
+static double refHeading(const Sample& s) {
+  double p = radians(refPitch(s)), r = radians(refRoll(s));
+  double xh = s.mx * cos(p) + s.my * sin(p) * sin(r) + s.mz * sin(p) * cos(r);
+  double yh = s.mz * sin(r) - s.my * cos(r);
+  return atan2(yh, xh) * 180 / M_PI;
+}
+
+// Every sample against the reference computed from it; and the heading of
+// both against the yaw the board really had, which the noise blurs as much
+// for one as for the other.
+static void testTraces() {
+  double maxPitch = 0, maxRoll = 0, maxHeading = 0, sumHeading = 0;
+  double trueInt = 0, trueRef = 0;
+  for (int t = 0; t < TRACES; ++t) {
+    double yaw = 360 * uniform(), pitch = 0, roll = 0;
+    for (int i = 0; i < SAMPLES; ++i) {
+      // a slow random wobble, up to 60 degrees each way
+      yaw = wrap(yaw + 4 * (uniform() - 0.5));
+      pitch = fmax(-60, fmin(60, pitch + 2 * (uniform() - 0.5)));
+      roll = fmax(-60, fmin(60, roll + 2 * (uniform() - 0.5)));
+      Sample s = attitude(radians(yaw), radians(pitch), radians(roll), true);
+
+      maxPitch = fmax(maxPitch, fabs(toDegrees(touch_develop::orientation::pitch(s)) - refPitch(s)));
+      maxRoll = fmax(maxRoll, fabs(toDegrees(touch_develop::orientation::roll(s)) - refRoll(s)));
+      double h = toDegrees(heading(s));
+      double d = fabs(wrap(h - refHeading(s)));
+      maxHeading = fmax(maxHeading, d);
+      sumHeading += d;
+      trueInt += fabs(wrap(h - yaw));
+      trueRef += fabs(wrap(refHeading(s) - yaw));
+    }
+  }
+  int n = TRACES * SAMPLES;
+  printf("against doubles, max: pitch %.3f, roll %.3f, heading %.3f degrees (mean %.3f)\n",
+    maxPitch, maxRoll, maxHeading, sumHeading / n);
+  printf("against the true yaw, mean: %.3f degrees, %.3f in doubles\n", trueInt / n, trueRef / n);
+  expect(maxPitch < 0.06);     // ihypot() floors
+  expect(maxRoll < 0.01);
+  expect(maxHeading < 0.1);
+  expect(sumHeading / n < 0.01);
+  expect(fabs(trueInt - trueRef) / n < 0.01);
+}
+
+// Without noise, straight against the attitude, at every whole degree of
+// yaw and some tilts.
+static void testExact() {
+  for (int yaw = 0; yaw < 360; ++yaw)
+    for (int pitch = -60; pitch <= 60; pitch += 30)
+      for (int roll = -60; roll <= 60; roll += 30) {
+        Sample s = attitude(radians(yaw), radians(pitch), radians(roll), false);
+        expect(degrees(touch_develop::orientation::pitch(s)) == pitch);
+        expect(degrees(touch_develop::orientation::roll(s)) == roll);
+        expect(fabs(wrap(toDegrees(heading(s)) - yaw)) < 0.3);
+      }
+}
+
+// The DAL: the board lies still, unless [waving], and time only moves in
+// sleep(); the calibration fiber is run by hand.
+MicroBit uBit;
+MicroBitImage::MicroBitImage(): ptr(NULL) {}
+
+static unsigned long now;
+static bool waving;
+static void (*fiber)();
+static int fibers;
+// Called on every sleep(), as another fiber would run meanwhile.
+static void (*meanwhile)();
+
+unsigned long MicroBit::systemTime() { return now; }
+
+void MicroBit::sleep(int ms) {
+  now += ms;
+  if (meanwhile)
+    meanwhile();
+}
+
+Fiber *create_fiber(void (*f)()) {
+  fiber = f;
+  fibers++;
+  return NULL;
+}
+
+int MicroBitAccelerometer::getX() { return 0; }
+int MicroBitAccelerometer::getY() { return 0; }
+int MicroBitAccelerometer::getZ() { return -1000; }
+
+// A turn every 100 samples when waving.
+static int turn;
+
+int MicroBitCompass::getX() { return waving ? lround(30000 * cos(turn * M_PI / 50)) : 20000; }
+int MicroBitCompass::getY() { return waving ? lround(30000 * sin(turn * M_PI / 50)) : 0; }
+int MicroBitCompass::getZ() { return waving ? lround(30000 * sin(turn++ * M_PI / 70)) : 40000; }
+
+static void pollCalibrated() {
+  if (now < 30000)
+    expect(!calibrated());
+}
+
+static void testCalibration() {
+  // never rotated, never read again: the fiber gives up
+  startCalibration();
+  expect(fibers == 1);
+  unsigned long start = now;
+  fiber();
+  expect(now - start >= ORIENTATION_CAL_IDLE_MS);
+  expect(now - start < ORIENTATION_CAL_IDLE_MS + 2 * ORIENTATION_CAL_MS);
+  expect(!calibrated());
+
+  // reading the heading starts it again; a script polling calibrated()
+  // keeps it going
+  startCalibration();
+  expect(fibers == 2);
+  startCalibration();
+  expect(fibers == 2);
+  meanwhile = pollCalibrated;
+  fiber();
+  meanwhile = NULL;
+  expect(now >= 30000 + ORIENTATION_CAL_IDLE_MS - ORIENTATION_CAL_MS);
+
+  // waved about, it finishes, and then nothing starts it again
+  startCalibration();
+  expect(fibers == 3);
+  waving = true;
+  start = now;
+  fiber();
+  expect(calibrated());
+  expect(now - start < 200 * ORIENTATION_CAL_MS);
+  startCalibration();
+  expect(fibers == 3);
+}
+
+int main() {
+  testExact();
+  testTraces();
+  testCalibration();
+  printf("orientation: ok\n");
+  return 0;
+}
@@ -0,0 +1,100 @@
+// The runtime's performance counters, built with BITVM_PERF_COUNTERS: an
+// allocation workload has to show up in them as it happened, and dump()
+// has to write what counter() reads.
+
+#include "runtime.h"
+
+#include <string>
+#include <vector>
+
+// Shims, which only the function table refers to.
+namespace bitvm {
+  namespace record { RefRecord *mk(int reflen, int totallen); }
+  namespace collection {
+    RefCollection *mk(uint32_t flags);
+    void add(RefCollection *c, uint32_t x);
+  }
+  namespace buffer { RefBuffer *mk(uint32_t size); }
+  namespace perf {
+    int counter(int id);
+    void reset();
+    void dump();
+  }
+}
+
+using namespace bitvm;
+
+static std::vector<std::string> lines;
+
+static void keepLine(const char *s) {
+  lines.push_back(s);
+}
+
+static void testWorkload() {
+  perf::reset();
+  for (int i = 0; i < PERF_COUNTERS; ++i)
+    if (i != PERF_BYTES)
+      expect(perf::counter(i) == 0);
+
+  // 10 records in a collection of refs, which takes a reference to each
+  RefCollection *c = collection::mk(1);
+  for (int i = 0; i < 10; ++i) {
+    RefRecord *r = record::mk(0, 1);
+    collection::add(c, U(r));
+    r->unref();
+  }
+  RefBuffer *b = buffer::mk(16);
+  expect(perf::counter(PERF_ALLOC_RECORD) == 10);
+  expect(perf::counter(PERF_ALLOC_COLLECTION) == 1);
+  expect(perf::counter(PERF_ALLOC_BUFFER) == 1);
+  expect(perf::counter(PERF_INCR) == 10);
+  expect(perf::counter(PERF_DECR) == 0);
+  expect(perf::counter(PERF_FREE) == 0);
+  expect(perf::counter(PERF_BYTES) == (int)heapStats.bytes);
+
+  // what the calling convention does around a call
+  for (int i = 0; i < 5; ++i) {
+    incr(U(b));
+    decr(U(b));
+  }
+  expect(perf::counter(PERF_INCR) == 15);
+  expect(perf::counter(PERF_DECR) == 5);
+
+  // the collection takes its records along
+  c->unref();
+  b->unref();
+  expect(perf::counter(PERF_FREE) == 12);
+  expect(perf::counter(PERF_DECR) == 15);
+  expect(heapStats.live[HEAP_RECORD] == 0);
+  expect(perf::counter(PERF_BYTES) == (int)heapStats.bytes);
+
+  // out of range
+  expect(perf::counter(-1) == 0);
+  expect(perf::counter(PERF_COUNTERS) == 0);
+}
+
+static void testDump() {
+  lines.clear();
+  logLine = keepLine;
+  perf::dump();
+  logLine = NULL;
+  expect(lines.size() == PERF_COUNTERS);
+  expect(lines[PERF_ALLOC_RECORD] == "PERF alloc_record 10\n");
+  expect(lines[PERF_FREE] == "PERF free 12\n");
+  for (int i = 0; i < PERF_COUNTERS; ++i) {
+    unsigned long v;
+    expect(sscanf(lines[i].c_str(), "PERF %*s %lu", &v) == 1);
+    expect(v == (unsigned long)perf::counter(i));
+  }
+
+  perf::reset();
+  expect(perf::counter(PERF_ALLOC_RECORD) == 0);
+  expect(perf::counter(PERF_INCR) == 0);
+}
+
+int main() {
+  testWorkload();
+  testDump();
+  ::printf("perf: ok\n");
+  return 0;
+}
@@ -0,0 +1,104 @@
+// Histogram bucketing, fed with synthetic PCs.
+
+#include "Profiler.h"
+
+#include <string>
+#include <stdarg.h>
+
+using namespace bitvm::profiler;
+
+#define expect(c) \
+  if (!(c)) { printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #c); exit(1); }
+
+MicroBit uBit;
+MicroBitImage::MicroBitImage() {}
+
+// Shim entry points, with the thumb bit set and in no particular order, as
+// in functionsAndBytecode[].
+static const uint32_t functions[] = { 0x1201, 0x1001, 0x1101, 0x1301 };
+#define CODE  0x8000
+
+static std::string dumped;
+
+static int print(const char *fmt, ...) {
+  char buf[64];
+  va_list args;
+  va_start(args, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  dumped += buf;
+  return n;
+}
+
+static void testShims() {
+  Histogram h(functions, 4, CODE, 4);
+  h.record(0x1000);   // entry point of the shim at 0x1000
+  h.record(0x10fe);   // last halfword before the next one
+  h.record(0x1101);   // thumb bit is ignored
+  h.record(0x1250);
+  h.record(0x1250);
+  h.record(0x7ffe);   // past the last shim, below the code: DAL code
+  h.record(0x0ffe);   // below every shim: sampled, not attributed
+  expect(h.samples == 7);
+  expect(h.shimCounts[1] == 2);
+  expect(h.shimCounts[2] == 1);
+  expect(h.shimCounts[0] == 2);
+  expect(h.shimCounts[3] == 1);
+}
+
+static void testCode() {
+  Histogram h(functions, 4, CODE, 4);
+  h.record(CODE);
+  h.record(CODE + 15);
+  h.record(CODE + 16);
+  h.record(CODE + (PROFILER_BUCKETS - 1) * 16);
+  h.record(CODE + PROFILER_BUCKETS * 16);         // past the end: the last bucket
+  h.record(CODE + 0x100000);
+  expect(h.codeCounts[0] == 2);
+  expect(h.codeCounts[1] == 1);
+  expect(h.codeCounts[PROFILER_BUCKETS - 1] == 3);
+  for (int i = 2; i < PROFILER_BUCKETS - 1; ++i)
+    expect(h.codeCounts[i] == 0);
+  for (int i = 0; i < 4; ++i)
+    expect(h.shimCounts[i] == 0);
+
+  // a wider shift folds more bytecode into each bucket
+  Histogram w(functions, 4, CODE, 8);
+  w.record(CODE + 255);
+  w.record(CODE + 256);
+  expect(w.codeCounts[0] == 1);
+  expect(w.codeCounts[1] == 1);
+}
+
+static void testSaturation() {
+  Histogram h(functions, 4, CODE, 4);
+  for (int i = 0; i < 70000; ++i) {
+    h.record(CODE);
+    h.record(0x1000);
+  }
+  expect(h.samples == 140000);
+  expect(h.codeCounts[0] == 0xffff);
+  expect(h.shimCounts[1] == 0xffff);
+}
+
+static void testDump() {
+  Histogram h(functions, 4, CODE, 4);
+  h.record(0x1100);
+  h.record(CODE + 32);
+  h.record(CODE + 33);
+  dumped.clear();
+  h.dump(print);
+  expect(dumped == "PROFILE 3 4\nS 2 1\nB 32 2\nEND\n");
+}
+
+int main() {
+  testShims();
+  testCode();
+  testSaturation();
+  testDump();
+  // nothing to sample with on the host
+  Histogram h(functions, 4, CODE, 4);
+  expect(!startSampling(&h, 1000));
+  printf("profiler: ok\n");
+  return 0;
+}
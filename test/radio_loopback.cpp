@@ -0,0 +1,146 @@
+// Telemetry over a loopback radio, which delivers every packet it sends:
+// three 16-bit accelerometer readings and an 8-bit temperature per sample,
+// sent with datagramSendNumbers() as scripts did before, and packed into
+// buffers, one sample or four to a packet. Reports the share of the bytes
+// on air that are the samples', the packets and samples per second the
+// air allows, and what sending and receiving cost the host.
+
+#include "runtime.h"
+#include "MicroBitTouchDevelop.h"
+
+#include <time.h>
+
+// Shims, which only the function table refers to.
+namespace bitvm {
+  namespace buffer {
+    RefBuffer *mk(uint32_t size);
+    int get_number(RefBuffer *c, int format, int off);
+    void set_number(RefBuffer *c, int format, int off, int value);
+  }
+  namespace bitvm_micro_bit {
+    int datagramSendBuffer(RefBuffer *buf);
+    int datagramReceiveBuffer(RefBuffer *buf);
+  }
+}
+
+using namespace bitvm;
+using namespace touch_develop::micro_bit;
+
+namespace touch_develop { namespace radio_transfer {
+  bool handlePacket(const uint8_t *, int) { return false; }
+} }
+
+// The radio: whatever is sent is received straight away, at -50 dBm.
+static void (*listener)(MicroBitEvent);
+static uint8_t air[MICROBIT_RADIO_MAX_PACKET_SIZE];
+static int airLength;
+static uint32_t airBytes, packets;
+
+int MicroBitRadio::enable() { return MICROBIT_OK; }
+unsigned long MicroBit::systemTime() { return 0; }
+
+void MicroBitMessageBus::listen(int, int, void (*f)(MicroBitEvent), uint16_t) {
+  listener = f;
+}
+
+int MicroBitRadioDatagram::send(uint8_t *buf, int len) {
+  if (len > MICROBIT_RADIO_MAX_PACKET_SIZE)
+    return MICROBIT_INVALID_PARAMETER;
+  memcpy(air, buf, len);
+  airLength = len;
+  airBytes += len;
+  packets++;
+  listener(MicroBitEvent(MICROBIT_ID_RADIO, MICROBIT_RADIO_EVT_DATAGRAM));
+  return MICROBIT_OK;
+}
+
+PacketBuffer MicroBitRadioDatagram::recv() { return PacketBuffer(); }
+uint8_t *PacketBuffer::getBytes() { return air; }
+int PacketBuffer::length() { return airLength; }
+int PacketBuffer::getRSSI() { return -50; }
+
+// What the nRF51 sends around a payload, as the DAL sets it up: preamble
+// (1), address (5), length, version, group and protocol (4), CRC (2); at
+// 1 Mbit/s, after 140 us of ramp-up.
+#define FRAME_BYTES   12
+#define RAMP_UP_US    140
+
+#define SAMPLE_BYTES  7
+#define BATCH         4
+#define SAMPLES       1000000
+
+static int reading(int i, int k) {
+  return k < 3 ? (int16_t)(i * 37 + k * 1000) : (int8_t)(i + 20);
+}
+
+static uint64_t nowNs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static void report(const char *what, int samplesPerPacket, uint64_t start) {
+  double ns = (nowNs() - start) / (double)SAMPLES;
+  int payload = airBytes / packets;
+  double efficiency = samplesPerPacket * SAMPLE_BYTES / (double)(payload + FRAME_BYTES);
+  double pps = 1e6 / (RAMP_UP_US + 8 * (payload + FRAME_BYTES));
+  ::printf("%-22s %3d-byte packets: %4.1f%% samples on air, %5.0f packets/s, %6.0f samples/s; "
+    "host %.0f ns/sample\n", what, payload, 100 * efficiency, pps, pps * samplesPerPacket, ns);
+  airBytes = packets = 0;
+}
+
+// Four numbers of 32 bits, whatever they hold.
+static void numbers() {
+  uint64_t t = nowNs();
+  for (int i = 0; i < SAMPLES; ++i) {
+    datagramSendNumbers(reading(i, 0), reading(i, 1), reading(i, 2), reading(i, 3));
+    expect(datagramReceiveNumber() == reading(i, 0));
+    for (int k = 1; k < 4; ++k)
+      expect(datagramGetNumber(k) == reading(i, k));
+  }
+  report("datagramSendNumbers", 1, t);
+}
+
+static void pack(RefBuffer *b, int off, int i) {
+  for (int k = 0; k < 3; ++k)
+    buffer::set_number(b, NUMBER_FORMAT_INT16, off + 2 * k, reading(i, k));
+  buffer::set_number(b, NUMBER_FORMAT_INT8, off + 6, reading(i, 3));
+}
+
+static void unpack(RefBuffer *b, int off, int i) {
+  for (int k = 0; k < 3; ++k)
+    expect(buffer::get_number(b, NUMBER_FORMAT_INT16, off + 2 * k) == reading(i, k));
+  expect(buffer::get_number(b, NUMBER_FORMAT_INT8, off + 6) == reading(i, 3));
+}
+
+// [batch] samples to a packet.
+static void buffers(int batch) {
+  RefBuffer *out = buffer::mk(batch * SAMPLE_BYTES), *in = buffer::mk(batch * SAMPLE_BYTES);
+  uint64_t t = nowNs();
+  for (int i = 0; i < SAMPLES; i += batch) {
+    for (int j = 0; j < batch; ++j)
+      pack(out, j * SAMPLE_BYTES, i + j);
+    expect(bitvm_micro_bit::datagramSendBuffer(out) == MICROBIT_OK);
+    expect(bitvm_micro_bit::datagramReceiveBuffer(in) == batch * SAMPLE_BYTES);
+    expect(datagramGetRSSI() == -50);
+    for (int j = 0; j < batch; ++j)
+      unpack(in, j * SAMPLE_BYTES, i + j);
+  }
+  report(batch == 1 ? "datagramSendBuffer" : "datagramSendBuffer, x4", batch, t);
+  out->unref();
+  in->unref();
+}
+
+int main() {
+  numbers();
+  buffers(1);
+  buffers(BATCH);
+
+  // nothing above the maximum payload goes out, and nothing is left over
+  RefBuffer *big = buffer::mk(MICROBIT_RADIO_MAX_PACKET_SIZE + 1);
+  expect(bitvm_micro_bit::datagramSendBuffer(big) == MICROBIT_INVALID_PARAMETER);
+  expect(bitvm_micro_bit::datagramReceiveBuffer(big) == -1);
+  big->unref();
+  ::printf("radio_loopback: ok\n");
+  return 0;
+}
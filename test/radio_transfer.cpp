@@ -0,0 +1,161 @@
+// Two simulated radios exchanging bulk transfers over lossy links.
+
+#include "RadioTransfer.h"
+
+#include <deque>
+
+using namespace touch_develop::radio_transfer;
+
+// Only the glue to uBit.radio uses these, and the test does not.
+MicroBit uBit;
+MicroBitImage::MicroBitImage() {}
+namespace touch_develop { namespace micro_bit { int radioEnable() { return MICROBIT_OK; } } }
+unsigned long MicroBit::systemTime() { return 0; }
+void MicroBit::sleep(int) {}
+int MicroBit::random(int) { return 0; }
+int MicroBitRadioDatagram::send(uint8_t*, int) { return 0; }
+
+#define expect(c) \
+  if (!(c)) { printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #c); exit(1); }
+
+typedef std::deque<std::vector<uint8_t> > Link;
+
+static Link toB, toA;
+static uint32_t seed = 1;
+static int lossPercent;
+
+static uint32_t rnd() {
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+  return seed;
+}
+
+static void put(Link& l, const uint8_t *buf, int len) {
+  if ((int)(rnd() % 100) >= lossPercent)
+    l.push_back(std::vector<uint8_t>(buf, buf + len));
+}
+
+static void sendA(const uint8_t *buf, int len) { put(toB, buf, len); }
+static void sendB(const uint8_t *buf, int len) { put(toA, buf, len); }
+
+static Receiver receiver(sendB);
+static uint32_t now = 0;
+
+// One poll period: the sender sends what is due, then each side gets what
+// its link carried. Returns false once the sender is done.
+static bool step(Sender& s) {
+  if (!s.poll(now))
+    return false;
+  now += BULK_POLL_MS;
+  while (!toB.empty()) {
+    receiver.onData(toB.front().data(), toB.front().size(), now);
+    toB.pop_front();
+  }
+  while (!toA.empty()) {
+    s.onAck(toA.front().data(), toA.front().size(), now);
+    toA.pop_front();
+  }
+  return true;
+}
+
+// Runs one transfer until the sender is done; [out] is what the receiver got.
+static bool transfer(const std::vector<uint8_t>& src, uint8_t xfer, std::vector<uint8_t>& out,
+    bool take = true) {
+  Sender s(sendA);
+  s.start(src.data(), src.size(), xfer, now);
+  while (step(s))
+    ;
+  out.clear();
+  if (take)
+    receiver.take(out);
+  return s.succeeded();
+}
+
+static std::vector<uint8_t> randomBuffer(int len) {
+  std::vector<uint8_t> v(len);
+  for (int i = 0; i < len; ++i)
+    v[i] = rnd();
+  return v;
+}
+
+static void testLoss() {
+  static const int sizes[] = { 0, 1, BULK_FRAGMENT_SIZE, BULK_FRAGMENT_SIZE + 1, 100, 3000, BULK_MAX_SIZE };
+  static const int losses[] = { 0, 10, 30 };
+  uint8_t xfer = 0;
+  for (int l = 0; l < 3; ++l) {
+    lossPercent = losses[l];
+    for (int i = 0; i < 7; ++i) {
+      std::vector<uint8_t> src = randomBuffer(sizes[i]), out;
+      uint32_t start = now;
+      uint32_t sent = stats.packetsSent;
+      expect(transfer(src, ++xfer, out));
+      expect(out == src);
+      printf("loss %2d%%  %5d bytes  %5u ms  %4u packets\n", lossPercent, sizes[i],
+        now - start, stats.packetsSent - sent);
+    }
+  }
+}
+
+// A link that drops everything makes the sender give up, and the receiver
+// never hands over a partial buffer.
+static void testGiveUp() {
+  lossPercent = 100;
+  std::vector<uint8_t> src = randomBuffer(500), out;
+  uint32_t start = now;
+  expect(!transfer(src, 42, out));
+  expect(out.empty());
+  expect(now - start > BULK_GIVE_UP_MS);
+}
+
+static void testIdReuse() {
+  lossPercent = 0;
+  std::vector<uint8_t> first = randomBuffer(100), second = randomBuffer(100), out;
+  expect(transfer(first, 7, out) && out == first);
+
+  // Within the re-ACK window, the same id and count is taken for a
+  // retransmission of the transfer already handed over.
+  expect(transfer(second, 7, out));
+  expect(out.empty());
+
+  // A different count is a new transfer, whatever the id.
+  std::vector<uint8_t> third = randomBuffer(300), fourth = randomBuffer(300);
+  expect(transfer(third, 7, out) && out == third);
+
+  // So is the same id and count once the window is over: the slot was
+  // cleared by take(), nothing is acknowledged before the data arrives.
+  now += BULK_GIVE_UP_MS;
+  expect(transfer(fourth, 7, out) && out == fourth);
+  expect(!receiver.take(out));
+}
+
+// A transfer that was acknowledged but not taken yet holds off the next
+// one, which goes through once the first is taken.
+static void testHeldUntilTaken() {
+  lossPercent = 0;
+  std::vector<uint8_t> first = randomBuffer(200), second = randomBuffer(200), out;
+  expect(transfer(first, 20, out, false));
+
+  Sender s(sendA);
+  s.start(second.data(), second.size(), 21, now);
+  uint32_t start = now;
+  while (now - start < BULK_GIVE_UP_MS / 2)
+    expect(step(s));
+  expect(!s.succeeded());
+
+  expect(receiver.take(out) && out == first);
+  while (step(s))
+    ;
+  expect(s.succeeded());
+  expect(receiver.take(out) && out == second);
+}
+
+int main() {
+  testLoss();
+  testGiveUp();
+  testIdReuse();
+  testHeldUntilTaken();
+  printf("radio_transfer: ok (%u packets, %u retransmissions, %u duplicates)\n",
+    stats.packetsSent, stats.retransmissions, stats.duplicates);
+  return 0;
+}
@@ -0,0 +1,148 @@
+// The runtime's generator: the xorshift128 sequence against Marsaglia's
+// formulation, the uniformity of random() over a few ranges, and that no
+// range favours some values over others, which a multiply-shift without
+// Lemire's rejection step would. Every run draws the same numbers, so the
+// chi-square limits (p = 0.001) cannot fail by bad luck.
+
+#include "MicroBitTouchDevelop.h"
+
+#include <math.h>
+
+using namespace touch_develop::math;
+
+#define expect(c) \
+  if (!(c)) { printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #c); exit(1); }
+
+// Enough of the DAL for math; the rest is never called.
+MicroBit uBit;
+MicroBitImage::MicroBitImage(): ptr(NULL) {}
+PacketBuffer::PacketBuffer() {}
+
+static int dalDraws;
+
+int MicroBit::random(int max) {
+  dalDraws++;
+  return (dalDraws * 7919) % max;
+}
+
+// xor128 from "Xorshift RNGs", seeded as seed_random() does.
+struct Reference {
+  uint32_t x, y, z, w;
+
+  Reference(uint32_t seed) {
+    uint32_t *s[] = { &x, &y, &z, &w };
+    for (int i = 0; i < 4; ++i) {
+      uint32_t v = (seed += 0x9e3779b9);
+      v = (v ^ (v >> 16)) * 0x85ebca6b;
+      v = (v ^ (v >> 13)) * 0xc2b2ae35;
+      *s[i] = v ^ (v >> 16);
+    }
+  }
+
+  uint32_t next() {
+    uint32_t t = x ^ (x << 11);
+    x = y; y = z; z = w;
+    return w = w ^ (w >> 19) ^ (t ^ (t >> 8));
+  }
+};
+
+static void testSequence() {
+  static const int seeds[] = { 1, 42, -1, 0x7fffffff };
+  for (int k = 0; k < 4; ++k) {
+    Reference r(seeds[k]);
+    seed_random(seeds[k]);
+    for (int i = 0; i < 10000; ++i)
+      expect(random_bits() == r.next());
+  }
+
+  // seed 0 takes the state from uBit.random()
+  int before = dalDraws;
+  seed_random(0);
+  expect(dalDraws == before + 8);
+  uint32_t a = random_bits();
+  seed_random(0);
+  expect(random_bits() != a);
+}
+
+static double chiSquare(const int *counts, int buckets, int n) {
+  double expected = (double)n / buckets, x = 0;
+  for (int i = 0; i < buckets; ++i)
+    x += (counts[i] - expected) * (counts[i] - expected) / expected;
+  return x;
+}
+
+#define DRAWS 1000000
+
+static int counts[1000];
+
+// [limit] is the 0.001 quantile for range - 1 degrees of freedom.
+static void testUniform(int range, double limit) {
+  seed_random(range);
+  memset(counts, 0, sizeof(counts));
+  for (int i = 0; i < DRAWS; ++i) {
+    int v = touch_develop::math::random(range);
+    expect(0 <= v && v < range);
+    counts[v]++;
+  }
+  double x = chiSquare(counts, range, DRAWS);
+  printf("random(%d): chi-square %.1f for %d degrees of freedom\n", range, x, range - 1);
+  expect(x < limit);
+}
+
+// Each bit of random_bits() is set half the time, and does not follow the
+// bit before it.
+static void testBits() {
+  seed_random(7);
+  int ones[32] = { 0 }, pairs[4] = { 0 };
+  uint32_t prev = 0;
+  for (int i = 0; i < DRAWS; ++i) {
+    uint32_t v = random_bits();
+    for (int b = 0; b < 32; ++b)
+      ones[b] += (v >> b) & 1;
+    pairs[(prev & 1) << 1 | (v & 1)]++;
+    prev = v;
+  }
+  double worst = 0;
+  for (int b = 0; b < 32; ++b)
+    worst = fmax(worst, fabs(ones[b] / (double)DRAWS - 0.5));
+  printf("random_bits(): worst bit %.4f away from 0.5\n", worst);
+  // 5 standard deviations
+  expect(worst < 0.0025);
+  expect(chiSquare(pairs, 4, DRAWS) < 16.3);
+}
+
+// 2^32 / 0x60000000 is 8/3: without the rejection, multiply-shift maps 3,
+// 3 and 2 of every 8 inputs to values 0, 1 and 2 modulo 3.
+static void testUnbiased() {
+  seed_random(3);
+  int mod3[3] = { 0 };
+  for (int i = 0; i < DRAWS; ++i)
+    mod3[touch_develop::math::random(0x60000000) % 3]++;
+  expect(chiSquare(mod3, 3, DRAWS) < 13.8);
+}
+
+static void testRanges() {
+  seed_random(5);
+  for (int i = 0; i < 100000; ++i) {
+    expect(touch_develop::math::random(1) == 0);
+    int v = touch_develop::math::random(-10);
+    expect(-10 < v && v <= 0);
+    v = touch_develop::math::random(INT_MIN);
+    expect(INT_MIN < v && v <= 0);
+    v = touch_develop::math::random(INT_MAX);
+    expect(0 <= v && v < INT_MAX);
+  }
+  expect(touch_develop::math::random(0) == 0);
+}
+
+int main() {
+  testSequence();
+  testUniform(6, 20.5);
+  testUniform(10, 27.9);
+  testUniform(1000, 1143.9);
+  testBits();
+  testUnbiased();
+  testRanges();
+  printf("random: ok\n");
+  return 0;
+}
@@ -0,0 +1,99 @@
+// Scaffolding for the tests that link source/bitvm.cpp: enough of the DAL
+// for the runtime, and a heap it can use. Each test includes this first.
+
+#include <sys/mman.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <new>
+
+// The runtime keeps pointers in 32-bit words: the heap has to live in the
+// low 4 GB (and the tests are linked without PIE, for the statics). It is
+// never freed; arenaUsed tells how much was allocated, arenaAllocs in how
+// many calls.
+static char *arena;
+static size_t arenaUsed, arenaAllocs;
+
+void *operator new(size_t size) {
+  if (!arena)
+    arena = (char*)mmap(0, 256 << 20, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+  void *r = arena + arenaUsed;
+  arenaUsed += (size + 15) & ~15;
+  arenaAllocs++;
+  return r;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *) noexcept {}
+void operator delete[](void *) noexcept {}
+void operator delete(void *, size_t) noexcept {}
+void operator delete[](void *, size_t) noexcept {}
+
+#include "BitVM.h"
+
+#undef printf
+
+#define expect(c) \
+  if (!(c)) { ::printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #c); exit(1); }
+
+#define U(p) ((uint32_t)(uintptr_t)(p))
+
+MicroBit uBit;
+MicroBitImage::MicroBitImage(): ptr(NULL) {}
+PacketBuffer::PacketBuffer() {}
+
+// As in the DAL: heap objects count in twos, 0xffff is read-only.
+void RefCounted::init() { refCount = 1; }
+void RefCounted::incr() { refCount += 2; }
+void RefCounted::decr() { refCount -= 2; }
+bool RefCounted::isReadOnly() { return refCount == 0xffff; }
+
+// What the runtime logs goes here rather than to the serial port, line by
+// line to [logLine] if the test sets it.
+static char logged[SERIAL_LOG_LINE];
+static void (*logLine)(const char *s);
+
+namespace touch_develop { namespace serial_log {
+  int format(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(logged, sizeof(logged), fmt, args);
+    va_end(args);
+    if (logLine)
+      logLine(logged);
+    return n;
+  }
+
+  int write(const char *s, int len) {
+    snprintf(logged, sizeof(logged), "%.*s", len, s);
+    if (logLine)
+      logLine(logged);
+    return len;
+  }
+
+  void flush() {}
+} }
+
+// error() panics on the device; here it ends the test, unless the test is
+// in expectError().
+static jmp_buf *panicJmp;
+
+void MicroBit::panic(int) {
+  if (panicJmp)
+    longjmp(*panicJmp, 1);
+  ::printf("panic: %s", logged);
+  exit(1);
+}
+
+// [stmt] has to end in error(); what it logged is in [logged].
+#define expectError(stmt) \
+  do { \
+    jmp_buf j; \
+    panicJmp = &j; \
+    if (setjmp(j) == 0) { \
+      stmt; \
+      ::printf("%s:%d: no error: %s\n", __FILE__, __LINE__, #stmt); \
+      exit(1); \
+    } \
+    panicJmp = NULL; \
+  } while (0)
@@ -0,0 +1,124 @@
+// Streaming the display frame by frame: a dot that moves every other
+// frame, captured with displayScreenShot() and compared with the previous
+// capture, as scripts did before, and refreshed in place with
+// displayScreenShotInto(), whose mask of changed pixels is checked
+// against the comparison. Counts the heap allocations of each.
+
+#include "runtime.h"
+
+// Shims, which only the function table refers to.
+namespace bitvm {
+  namespace bitvm_micro_bit {
+    ImageData *displayScreenShot();
+    int displayScreenShotInto(ImageData *i);
+  }
+}
+
+using namespace bitvm;
+
+// The display's bitmap; static, as the runtime keeps pointers in 32 bits.
+static struct { ImageData hdr; uint8_t pixels[25]; } display;
+
+MicroBitImage::MicroBitImage(ImageData *p): ptr(p) { ptr->incr(); }
+uint8_t *MicroBitImage::getBitmap() { return ptr->data; }
+int MicroBitImage::getWidth() { return ptr->width; }
+int MicroBitImage::getHeight() { return ptr->height; }
+
+ImageData *MicroBitImage::leakData() {
+  ImageData *r = ptr;
+  ptr = NULL;
+  return r;
+}
+
+// As in the DAL, a copy of the display on the heap.
+MicroBitImage MicroBitDisplay::screenShot() {
+  ImageData *i = (ImageData*)operator new(sizeof(ImageData) + 25);
+  i->init();
+  i->width = i->height = 5;
+  memcpy(i->data, display.pixels, 25);
+  MicroBitImage r(i);
+  i->decr();
+  return r;
+}
+
+#define FRAMES  10000
+
+static void draw(int frame) {
+  memset(display.pixels, 0, 25);
+  display.pixels[frame / 2 % 25] = 255;
+}
+
+static uint32_t diff(const uint8_t *a, const uint8_t *b) {
+  uint32_t r = 0;
+  for (int i = 0; i < 25; ++i)
+    if (a[i] != b[i])
+      r |= 1u << i;
+  return r;
+}
+
+static int changedFrames;
+
+// A new capture per frame, compared with the previous one and dropped.
+static size_t captures() {
+  changedFrames = 0;
+  ImageData *prev = bitvm_micro_bit::displayScreenShot();
+  size_t before = arenaAllocs;
+  for (int f = 1; f < FRAMES; ++f) {
+    draw(f);
+    ImageData *cur = bitvm_micro_bit::displayScreenShot();
+    expect(memcmp(cur->data, display.pixels, 25) == 0);
+    if (diff(prev->data, cur->data))
+      changedFrames++;
+    decr(U(prev));
+    prev = cur;
+  }
+  decr(U(prev));
+  return arenaAllocs - before;
+}
+
+// One capture, refreshed in place.
+static size_t refreshes() {
+  draw(0);
+  ImageData *frame = bitvm_micro_bit::displayScreenShot();
+  uint8_t prev[25];
+  int changed = 0;
+  size_t before = arenaAllocs;
+  for (int f = 1; f < FRAMES; ++f) {
+    memcpy(prev, frame->data, 25);
+    draw(f);
+    uint32_t mask = bitvm_micro_bit::displayScreenShotInto(frame);
+    expect(memcmp(frame->data, display.pixels, 25) == 0);
+    expect(mask == diff(prev, display.pixels));
+    if (mask)
+      changed++;
+  }
+  size_t allocs = arenaAllocs - before;
+  expect(changed == changedFrames);
+  decr(U(frame));
+  return allocs;
+}
+
+int main() {
+  display.hdr.init();
+  display.hdr.width = display.hdr.height = 5;
+  uBit.display.image.ptr = &display.hdr;
+
+  draw(0);
+  size_t before = captures();
+  expect(before == FRAMES - 1);
+  size_t after = refreshes();
+  expect(after == 0);
+
+  // a read-only image is left alone
+  static struct { ImageData hdr; uint8_t pixels[25]; } rom;
+  rom.hdr.refCount = 0xffff;
+  rom.hdr.width = rom.hdr.height = 5;
+  draw(0);
+  expect(bitvm_micro_bit::displayScreenShotInto(&rom.hdr) == 0);
+  expect(rom.pixels[0] == 0);
+
+  ::printf("%d frames, %d of them changed: %d heap allocations with displayScreenShot, "
+    "%d with displayScreenShotInto\n", FRAMES, changedFrames, (int)before, (int)after);
+  ::printf("screenshot: ok\n");
+  return 0;
+}
@@ -0,0 +1,108 @@
+// Accelerometer samples over a simulated UART at 115200 baud: as text
+// lines, as scripts send them, and as binary frames of one sample and of
+// sixteen, plain and COBS. Everything is read back from the wire and
+// checked; reports the bytes per sample and the samples per second the
+// link carries.
+
+#include "SerialFrames.h"
+
+#include <string>
+
+using namespace touch_develop::serial_frames;
+
+#define expect(c) \
+  if (!(c)) { printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #c); exit(1); }
+
+#define BAUD      115200
+#define CHAR_BITS 10      // start, 8 data, stop
+
+MicroBit uBit;
+MicroBitImage::MicroBitImage() {}
+
+namespace touch_develop { namespace serial_log {
+  void flush() {}
+} }
+
+// The wire, which the receiving side reads back from the start.
+static std::vector<uint8_t> wire;
+static size_t readPos;
+
+int MicroBitSerial::putc(int c) { wire.push_back(c); return c; }
+int MicroBitSerial::readable() { return readPos < wire.size(); }
+int MicroBitSerial::getc() { return wire[readPos++]; }
+unsigned long MicroBit::systemTime() { return 0; }
+void schedule() {}
+
+#define SAMPLES   4800
+#define BATCH     16
+
+static int reading(int i, int k) {
+  return (i * 37 + k * 911) % 4096 - 2048;
+}
+
+static void reset() {
+  wire.clear();
+  readPos = 0;
+}
+
+static void report(const char *what) {
+  double bytes = wire.size() / (double)SAMPLES;
+  printf("%-20s %5.2f bytes/sample, %5.0f samples/s\n", what, bytes,
+    BAUD / CHAR_BITS / bytes);
+}
+
+// "x,y,z\r\n", as serialSendString() would send it.
+static void text() {
+  reset();
+  for (int i = 0; i < SAMPLES; ++i) {
+    char line[32];
+    int n = snprintf(line, sizeof(line), "%d,%d,%d\r\n", reading(i, 0), reading(i, 1), reading(i, 2));
+    for (int j = 0; j < n; ++j)
+      uBit.serial.putc(line[j]);
+  }
+  report("text");
+
+  std::string s(wire.begin(), wire.end());
+  const char *p = s.c_str();
+  for (int i = 0; i < SAMPLES; ++i) {
+    int x, y, z, n;
+    expect(sscanf(p, "%d,%d,%d\r\n%n", &x, &y, &z, &n) == 3);
+    expect(x == reading(i, 0) && y == reading(i, 1) && z == reading(i, 2));
+    p += n;
+  }
+}
+
+// [batch] samples to a frame, as three little-endian int16 each.
+static void frames(int batch, bool cobs, const char *what) {
+  reset();
+  for (int i = 0; i < SAMPLES; i += batch) {
+    int16_t payload[3 * BATCH];
+    for (int j = 0; j < batch; ++j)
+      for (int k = 0; k < 3; ++k)
+        payload[3 * j + k] = reading(i + j, k);
+    expect(send((uint8_t*)payload, 6 * batch, cobs));
+  }
+  report(what);
+
+  std::vector<uint8_t> out;
+  for (int i = 0; i < SAMPLES; i += batch) {
+    expect(receive(out, cobs, 0));
+    expect((int)out.size() == 6 * batch);
+    int16_t *payload = (int16_t*)&out[0];
+    for (int j = 0; j < batch; ++j)
+      for (int k = 0; k < 3; ++k)
+        expect(payload[3 * j + k] == reading(i + j, k));
+  }
+  expect(readPos == wire.size());
+  expect(errors == 0);
+}
+
+int main() {
+  text();
+  frames(1, false, "frames of 1");
+  frames(1, true, "COBS frames of 1");
+  frames(BATCH, false, "frames of 16");
+  frames(BATCH, true, "COBS frames of 16");
+  printf("serial_frames: ok\n");
+  return 0;
+}
@@ -0,0 +1,149 @@
+// The serial logger against a simulated UART at 115200 baud, with the
+// draining fiber run as a coroutine while the script fiber sleeps. Reports
+// how long a script is blocked per line, against writing the same line
+// straight to the UART.
+
+#include "SerialLog.h"
+
+#include <string>
+#include <time.h>
+#include <ucontext.h>
+
+using namespace touch_develop::serial_log;
+
+#define expect(c) \
+  if (!(c)) { printf("%s:%d: failed: %s\n", __FILE__, __LINE__, #c); exit(1); }
+
+#define CHAR_US   87    // 10 bits at 115200 baud
+
+MicroBit uBit;
+MicroBitImage::MicroBitImage() {}
+
+// Simulated time, in microseconds.
+static uint32_t now, uartBusyUntil;
+static std::vector<char> wire;
+
+int MicroBitSerial::writeable() { return now >= uartBusyUntil; }
+
+int MicroBitSerial::putc(int c) {
+  // blocks until the previous character is out
+  if (now < uartBusyUntil)
+    now = uartBusyUntil;
+  uartBusyUntil = now + CHAR_US;
+  wire.push_back(c);
+  return c;
+}
+
+// One fiber besides the script's: the one draining the log.
+static ucontext_t scriptCtx, drainCtx;
+static char drainStack[64 * 1024];
+static bool drainStarted;
+
+Fiber *create_fiber(void (*f)()) {
+  getcontext(&drainCtx);
+  drainCtx.uc_stack.ss_sp = drainStack;
+  drainCtx.uc_stack.ss_size = sizeof(drainStack);
+  drainCtx.uc_link = NULL;
+  makecontext(&drainCtx, f, 0);
+  drainStarted = true;
+  return NULL;
+}
+
+void schedule() { swapcontext(&drainCtx, &scriptCtx); }
+
+int fiber_wait_for_event(uint16_t, uint16_t) {
+  swapcontext(&drainCtx, &scriptCtx);
+  return 0;
+}
+
+// The script sleeping lets the drain fiber run until the UART is busy or
+// the buffer empty; time then moves on to whichever comes first of the UART
+// being free again and the end of the sleep.
+void MicroBit::sleep(int ms) {
+  uint32_t end = now + ms * 1000;
+  while (now < end) {
+    if (drainStarted)
+      swapcontext(&scriptCtx, &drainCtx);
+    now = uartBusyUntil > now && uartBusyUntil < end ? uartBusyUntil : end;
+  }
+}
+
+static uint64_t hostNs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+static std::string expected;
+
+// A line of [len] characters, the way error() and post_to_wall log them.
+static int logLine(int i, int len, uint32_t *blockedUs, uint64_t *hostTotal) {
+  char line[SERIAL_LOG_LINE];
+  snprintf(line, sizeof(line), "%04d %-*.*s\n", i, len - 6, len - 6,
+    "the quick brown fox jumps over the lazy dog, again and again and again");
+  uint32_t start = now;
+  uint64_t h = hostNs();
+  int n = format("%s", line);
+  *hostTotal += hostNs() - h;
+  *blockedUs += now - start;
+  if (n)
+    expected += line;
+  return n;
+}
+
+// A script logging a line every [periodMs], which the UART keeps up with.
+static void testSteady(int len, int periodMs) {
+  uint32_t blocked = 0, drops = dropped;
+  uint64_t host = 0;
+  for (int i = 0; i < 200; ++i) {
+    expect(logLine(i, len, &blocked, &host) == len);
+    uBit.sleep(periodMs);
+  }
+  uBit.sleep(100);
+  expect(dropped == drops);
+  expect(std::string(wire.begin(), wire.end()) == expected);
+  printf("%2d-char lines every %d ms: blocked %u us per line (%u us writing to the UART directly), "
+    "%.2f us host CPU in format()\n", len, periodMs, blocked / 200, len * CHAR_US, host / 200 / 1000.0);
+}
+
+// A burst faster than the UART: lines that do not fit are dropped whole,
+// those that do arrive intact, and the script is never held up.
+static void testBurst() {
+  wire.clear();
+  expected.clear();
+  uint32_t blocked = 0, drops = dropped;
+  uint64_t host = 0;
+  int queued = 0;
+  for (int i = 0; i < 50; ++i)
+    if (logLine(i, 40, &blocked, &host))
+      queued++;
+  expect(blocked == 0);
+  expect(queued == (SERIAL_LOG_SIZE - 1) / 40);
+  expect((int)(dropped - drops) == 50 - queued);
+  uBit.sleep(100);
+  expect(std::string(wire.begin(), wire.end()) == expected);
+  printf("burst of 50 40-char lines: %d queued, %u dropped, blocked %u us\n",
+    queued, dropped - drops, blocked);
+}
+
+// flush() writes everything out before returning, as before a panic.
+static void testFlush() {
+  wire.clear();
+  expected.clear();
+  uint32_t blocked = 0;
+  uint64_t host = 0;
+  logLine(0, 40, &blocked, &host);
+  uint32_t start = now;
+  flush();
+  expect(std::string(wire.begin(), wire.end()) == expected);
+  expect(now - start >= 39 * CHAR_US);
+}
+
+int main() {
+  testSteady(20, 5);
+  testSteady(60, 10);
+  testBurst();
+  testFlush();
+  printf("serial_log: ok\n");
+  return 0;
+}
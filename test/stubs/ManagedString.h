@@ -0,0 +1,5 @@
+#pragma once
+#include <stdint.h>
+struct RefCounted { uint16_t refCount; void incr(); void decr(); void init(); bool isReadOnly(); };
+struct StringData : RefCounted { uint16_t len; char data[0]; };
+struct ManagedString { ManagedString(); ManagedString(StringData*); ManagedString(const char*); ManagedString(char); ManagedString(int); ManagedString(const char*,int16_t); ManagedString substring(int,int); char charAt(int); int length() const; const char *toCharArray() const; StringData *leakData(); bool operator==(const ManagedString&); ManagedString operator+(const ManagedString&); static ManagedString EmptyString; };
@@ -0,0 +1,2 @@
+#pragma once
+template <class T> struct ManagedType { T *object; int *ref; ManagedType(); ManagedType(T*); T* operator->(); T* get(); };
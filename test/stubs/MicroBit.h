@@ -0,0 +1,75 @@
+// Minimal host stubs of the microbit-dal API, for the tests in test/.
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "ManagedString.h"
+#include "MicroBitImage.h"
+#include <vector>
+using namespace std;
+inline int min(int a,int b){return a<b?a:b;}
+inline int max(int a,int b){return a>b?a:b;}
+#define MICROBIT_OK 0
+#define MICROBIT_INVALID_PARAMETER -1001
+#define MICROBIT_NO_DATA -1002
+#define MICROBIT_RADIO_DEFAULT_GROUP 0
+#define MICROBIT_RADIO_MAX_PACKET_SIZE 32
+#define MICROBIT_ID_RADIO 9
+#define MICROBIT_RADIO_EVT_DATAGRAM 1
+#define MICROBIT_EVT_ANY 0
+#define MICROBIT_ID_IO_P0 7
+#define MICROBIT_ID_IO_P1 8
+#define MICROBIT_ID_IO_P2 9
+#define MICROBIT_ID_BUTTON_A 1
+#define MICROBIT_ID_BUTTON_B 2
+#define MICROBIT_ID_BUTTON_AB 3
+#define MICROBIT_BUTTON_EVT_CLICK 3
+#define MES_BROADCAST_GENERAL_ID 2000
+#define MES_DEVICE_INFO_ID 1103
+#define MES_SIGNAL_STRENGTH_ID 1101
+#define MES_DPAD_CONTROLLER_ID 1104
+#define MES_REMOTE_CONTROL_ID 1001
+#define MES_CAMERA_ID 1002
+#define MES_ALERTS_ID 1004
+#define MICROBIT_ID_NOTIFY 1023
+#define MICROBIT_ID_NOTIFY_ONE 1022
+#define MESSAGE_BUS_LISTENER_QUEUE_IF_BUSY 0
+#define MESSAGE_BUS_LISTENER_IMMEDIATE 16
+#define MICROBIT_SERIAL_DEFAULT_BAUD_RATE 115200
+#define MICROBIT_DEFAULT_TICK_PERIOD 6
+enum MicroBitEventLaunchMode { CREATE_ONLY, CREATE_AND_FIRE };
+enum DisplayMode { DISPLAY_MODE_BLACK_AND_WHITE, DISPLAY_MODE_GREYSCALE };
+struct MicroBitEvent { uint16_t source; uint16_t value; uint64_t timestamp; MicroBitEvent(int s=0,int v=0,MicroBitEventLaunchMode m=CREATE_AND_FIRE):source(s),value(v){} void fire(); };
+struct PacketBuffer { PacketBuffer(); PacketBuffer(int len); PacketBuffer(uint8_t*d,int len,int rssi=0); uint8_t *getBytes(); int length(); int getRSSI(); void setRSSI(uint8_t); uint8_t operator[](int) const; uint8_t& operator[](int); static PacketBuffer EmptyPacket; bool operator==(const PacketBuffer&); };
+struct MicroBitRadioDatagram { int send(uint8_t*,int); int send(PacketBuffer); int recv(uint8_t*,int); PacketBuffer recv(); };
+struct MicroBitRadioEvent { int eventReceived(MicroBitEvent); };
+struct MicroBitRadio { int enable(); int disable(); int setGroup(uint8_t); int setTransmitPower(int); int dataReady(); MicroBitRadioDatagram datagram; MicroBitRadioEvent event; };
+struct MicroBitPin { int getAnalogValue(); int setAnalogValue(int); int setAnalogPeriodUs(int); int setServoValue(int); int setServoPulseUs(int); int getDigitalValue(); int setDigitalValue(int); int isTouched(); };
+struct MicroBitIO { MicroBitPin P0,P1,P2,P3,P4,P5,P6,P7,P8,P9,P10,P11,P12,P13,P14,P15,P16,P19,P20; };
+struct MicroBitDisplay { MicroBitImage image; void clear(); int readLightLevel(); int getBrightness(); int setBrightness(int); void setDisplayMode(DisplayMode); int print(char c,int d=0); int print(ManagedString,int d=0); int print(MicroBitImage,int x=0,int y=0,int a=0,int d=0); int scroll(ManagedString,int d=0); int animate(MicroBitImage,int,int,int p=0); void stopAnimation(); MicroBitImage screenShot(); void setErrorTimeout(int); };
+struct MicroBitSerial { int printf(const char*,...); int sendString(ManagedString); ManagedString readString(); void sendImage(MicroBitImage); MicroBitImage readImage(int,int); void sendDisplayState(); void readDisplayState(); int putc(int); int getc(); int readable(); int writeable(); int send(uint8_t*,int); int read(uint8_t*,int); void baud(int); };
+struct MicroBitI2C { int read(int,char*,int,bool r=false); int write(int,const char*,int,bool r=false); };
+struct MicroBitCompass { int heading(); int isCalibrated(); void calibrate(); void calibrateAsync(); int getX(); int getY(); int getZ(); int getFieldStrength(); };
+struct MicroBitAccelerometer { int getX(); int getY(); int getZ(); int getPitch(); int getRoll(); };
+struct MicroBitThermometer { int getTemperature(); };
+struct MicroBitButton { int isPressed(); };
+struct MicroBitComponent { uint16_t id; uint8_t status; virtual void systemTick() {} virtual void idleTick() {} virtual ~MicroBitComponent() {} };
+struct MicroBitMessageBus { void listen(int,int,void(*)(MicroBitEvent),uint16_t f=0); void ignore(int,int,void(*)(MicroBitEvent)); };
+struct MicroBit { MicroBitSerial serial; MicroBitDisplay display; MicroBitRadio radio; MicroBitIO io; MicroBitI2C i2c; MicroBitCompass compass; MicroBitAccelerometer accelerometer; MicroBitThermometer thermometer; MicroBitButton buttonA,buttonB,buttonAB; MicroBitMessageBus MessageBus; void panic(int); void reset(); int random(int); void sleep(int); unsigned long systemTime(); void seedRandom(); void seedRandom(uint32_t); int addSystemComponent(MicroBitComponent*); int removeSystemComponent(MicroBitComponent*); };
+extern MicroBit uBit;
+struct Fiber;
+Fiber *create_fiber(void (*)(void*), void*, void (*)(void*));
+Fiber *create_fiber(void (*)(void*), void*);
+Fiber *create_fiber(void (*)());
+void release_fiber();
+void fiber_sleep(unsigned long);
+int fiber_wait_for_event(uint16_t,uint16_t);
+void schedule();
+void wait_ms(int);
+void wait_us(int);
+void __disable_irq();
+void __enable_irq();
+inline uint32_t us_ticker_read() { return 0; }
+struct NRF_GPIO_Type { volatile uint32_t OUT; };
+extern NRF_GPIO_Type *NRF_GPIO;
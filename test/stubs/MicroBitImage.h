@@ -0,0 +1,5 @@
+#pragma once
+#include <stdint.h>
+#include "ManagedString.h"
+struct ImageData : RefCounted { uint16_t width; uint16_t height; uint8_t data[0]; };
+struct MicroBitImage { ImageData *ptr; MicroBitImage(); MicroBitImage(ImageData*); MicroBitImage(int,int); MicroBitImage(int,int,const uint8_t*); MicroBitImage(const char*); MicroBitImage clone(); ImageData *leakData(); uint8_t *getBitmap(); int getWidth(); int getHeight(); int setPixelValue(int,int,uint8_t); int getPixelValue(int,int); void clear(); int isReadOnly(); int paste(const MicroBitImage&,int x=0,int y=0,int a=0); int shiftLeft(int); int shiftRight(int); int shiftUp(int); int shiftDown(int); bool operator==(const MicroBitImage&); MicroBitImage& operator=(const MicroBitImage&); int print(char,int x=0,int y=0); };
@@ -0,0 +1,113 @@
+// Typed collections of numbers: what each type keeps of a value, and the
+// memory and the get/set throughput of each against a plain collection of
+// words, through the shims scripts call. The figures are host nanoseconds.
+
+#include "runtime.h"
+
+#include <time.h>
+
+// Shims, which only the function table refers to.
+namespace bitvm {
+  namespace collection {
+    RefCollection *mk(uint32_t flags);
+    int count(RefCollection *c);
+    void add(RefCollection *c, uint32_t x);
+    uint32_t at(RefCollection *c, int x);
+    void set_at(RefCollection *c, int x, uint32_t y);
+    void insert_at(RefCollection *c, int x, uint32_t y);
+    void remove_at(RefCollection *c, int x);
+  }
+}
+
+using namespace bitvm;
+
+#define ELEMENTS  2000
+#define PASSES    2000
+
+static const struct {
+  int type;
+  const char *name;
+} types[] = {
+  { 0, "words" },
+  { NUMBER_FORMAT_INT8, "int8" },
+  { NUMBER_FORMAT_UINT8, "uint8" },
+  { NUMBER_FORMAT_INT16, "int16" },
+  { NUMBER_FORMAT_UINT16, "uint16" },
+  { BITVM_COLLECTION_BITS, "bits" },
+};
+
+static RefCollection *mk(int type) {
+  return collection::mk(type << BITVM_COLLECTION_TYPE_SHIFT);
+}
+
+// What [type] keeps of [v]: the low bits, sign-extended or not.
+static int kept(int type, int v) {
+  switch (type) {
+    case NUMBER_FORMAT_INT8: return (int8_t)v;
+    case NUMBER_FORMAT_UINT8: return (uint8_t)v;
+    case NUMBER_FORMAT_INT16: return (int16_t)v;
+    case NUMBER_FORMAT_UINT16: return (uint16_t)v;
+    case BITVM_COLLECTION_BITS: return v != 0;
+    default: return v;
+  }
+}
+
+static void testRoundTrip() {
+  static const int values[] = { 0, 1, -1, 127, 128, -129, 255, 256, 32767, -32768, 65535, 0x12345 };
+  for (int k = 0; k < 6; ++k) {
+    int type = types[k].type;
+    RefCollection *c = mk(type);
+    for (int i = 0; i < 12; ++i)
+      collection::add(c, values[i]);
+    // the bits cross a byte boundary
+    collection::insert_at(c, 3, 1);
+    collection::remove_at(c, 0);
+    collection::remove_at(c, 2);
+    expect(collection::count(c) == 11);
+    for (int i = 1; i < 12; ++i)
+      expect((int)collection::at(c, i - 1) == kept(type, values[i]));
+    for (int i = 0; i < 11; ++i)
+      collection::set_at(c, i, values[11 - i]);
+    for (int i = 0; i < 11; ++i)
+      expect((int)collection::at(c, i) == kept(type, values[11 - i]));
+    c->unref();
+  }
+  expect(heapStats.live[HEAP_COLLECTION] == 0);
+}
+
+static uint64_t nowNs() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+// Memory is the element storage, as the collection holds it once full;
+// throughput is a get and a set of every element, ELEMENTS x PASSES times.
+static void bench() {
+  ::printf("%-8s %10s %14s\n", "type", "bytes/elt", "get+set (ns)");
+  for (int k = 0; k < 6; ++k) {
+    int type = types[k].type;
+    RefCollection *c = mk(type);
+    for (int i = 0; i < ELEMENTS; ++i)
+      collection::add(c, i & 1);
+    double bytes = type ? ((RefTypedCollection*)c)->bytes.size() : c->data.size() * 4;
+
+    uint64_t t = nowNs();
+    for (int p = 0; p < PASSES; ++p)
+      for (int i = 0; i < ELEMENTS; ++i)
+        collection::set_at(c, i, collection::at(c, i) ^ 1);
+    double ns = (nowNs() - t) / ((double)PASSES * ELEMENTS);
+    expect(collection::at(c, 1) == 1);
+    ::printf("%-8s %10.3f %14.2f\n", types[k].name, bytes / ELEMENTS, ns);
+    c->unref();
+  }
+  ::printf("objects on this host: %d bytes plain, %d typed\n",
+    (int)sizeof(RefCollection), (int)sizeof(RefTypedCollection));
+}
+
+int main() {
+  testRoundTrip();
+  bench();
+  ::printf("typed: ok\n");
+  return 0;
+}